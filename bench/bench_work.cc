@@ -0,0 +1,419 @@
+/*
+ * Copyright 2024-2026 Jimmy Fitzpatrick.
+ * This file is part of SPECTRE
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+// Calls each block's `work` directly, on synthetic buffers, and reports how many items
+// it gets through per second. Only the time spent in `work` is counted. By default, the
+// batched file sink writes to tmpfs, so the results reflect the CPU cost of each block
+// rather than the speed of the disk.
+//
+// Usage: spectre_bench_work [--dir DIR] [--min-time SECONDS] [--filter SUBSTRING]
+
+#include <gnuradio/block_detail.h>
+#include <gnuradio/buffer_double_mapped.h>
+#include <gnuradio/buffer_reader.h>
+#include <gnuradio/spectre/batched_file_sink.h>
+#include <gnuradio/spectre/frequency_sweeper.h>
+#include <gnuradio/spectre/tagged_staircase.h>
+
+#include <linux/magic.h>
+#include <sys/vfs.h>
+#include <chrono>
+#include <complex>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <functional>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace {
+
+using clock_type = std::chrono::steady_clock;
+
+const std::vector<std::string> INPUT_TYPES{ "fc32", "fc64", "sc16", "sc8" };
+const std::vector<int> NOUTPUT_ITEMS{ 256, 4096, 65536 };
+const int MAX_NOUTPUT_ITEMS = 65536;
+const float SAMPLE_RATE = 1e6;
+
+// Once this much has been written by the sink, its files are deleted (outside of the
+// timed calls), so tmpfs doesn't fill up.
+const uint64_t MAX_BYTES_ON_DISK = uint64_t(256) << 20;
+
+const pmt::pmt_t FREQ_KEY = pmt::string_to_symbol("freq");
+
+struct options {
+    std::string dir = "/dev/shm/spectre-bench";
+    double min_time = 0.5;
+    std::string filter;
+};
+
+size_t get_sizeof_item(const std::string& input_type)
+{
+    if (input_type == "fc32") {
+        return sizeof(std::complex<float>);
+    } else if (input_type == "fc64") {
+        return sizeof(std::complex<double>);
+    } else if (input_type == "sc16") {
+        return 2 * sizeof(int16_t);
+    } else if (input_type == "sc8") {
+        return 2 * sizeof(int8_t);
+    }
+    throw std::invalid_argument("Unsupported input type: " + input_type);
+}
+
+// Noise, at a tenth of full scale, so that no sample is a special case.
+std::vector<char> make_samples(const std::string& input_type, size_t nitems)
+{
+    std::vector<char> samples(nitems * get_sizeof_item(input_type));
+    std::mt19937 gen(12345);
+    std::normal_distribution<double> noise(0, 0.1);
+    size_t ncomponents = 2 * nitems;
+    for (size_t n = 0; n < ncomponents; n++) {
+        double x = noise(gen);
+        if (input_type == "fc32") {
+            reinterpret_cast<float*>(samples.data())[n] = x;
+        } else if (input_type == "fc64") {
+            reinterpret_cast<double*>(samples.data())[n] = x;
+        } else if (input_type == "sc16") {
+            reinterpret_cast<int16_t*>(samples.data())[n] = x * INT16_MAX;
+        } else {
+            reinterpret_cast<int8_t*>(samples.data())[n] = x * INT8_MAX;
+        }
+    }
+    return samples;
+}
+
+bool is_tmpfs(const std::string& dir)
+{
+    struct statfs info;
+    return ::statfs(dir.c_str(), &info) == 0 && info.f_type == TMPFS_MAGIC;
+}
+
+/*!
+ * Stands in for the scheduler. Connects a block to a buffer on each side, so that it
+ * can look up the offsets of its items and tag them, and moves them along after each
+ * call to `work`. Nothing is copied through the buffers, since `work` is handed the
+ * synthetic samples directly.
+ */
+class harness
+{
+public:
+    harness(std::shared_ptr<gr::sync_block> block,
+            size_t sizeof_input_item,
+            size_t sizeof_output_item)
+        : d_block(block),
+          d_detail(gr::make_block_detail(sizeof_input_item > 0, sizeof_output_item > 0))
+    {
+        if (sizeof_input_item > 0) {
+            d_input = gr::buffer_double_mapped::make_buffer(
+                MAX_NOUTPUT_ITEMS, sizeof_input_item, MAX_NOUTPUT_ITEMS, 1);
+            d_reader = gr::buffer_add_reader(d_input, 0);
+            d_detail->set_input(0, d_reader);
+        }
+        if (sizeof_output_item > 0) {
+            d_output = gr::buffer_double_mapped::make_buffer(
+                MAX_NOUTPUT_ITEMS, sizeof_output_item, MAX_NOUTPUT_ITEMS, 1);
+            d_detail->set_output(0, d_output);
+        }
+        d_block->set_detail(d_detail);
+    }
+
+    ~harness() { d_block->set_detail(gr::block_detail_sptr()); }
+
+    // Tag an input item, as an upstream block would.
+    void add_input_tag(uint64_t offset, const pmt::pmt_t& key, const pmt::pmt_t& value)
+    {
+        gr::tag_t tag;
+        tag.offset = offset;
+        tag.key = key;
+        tag.value = value;
+        d_input->add_item_tag(tag);
+    }
+
+    uint64_t nitems_read() const { return (d_reader) ? d_reader->nitems_read() : 0; }
+
+    // Call `work` once, returning how long it took.
+    clock_type::duration call(int noutput_items,
+                              gr_vector_const_void_star& input_items,
+                              gr_vector_void_star& output_items,
+                              int& nitems)
+    {
+        clock_type::time_point start = clock_type::now();
+        nitems = d_block->work(noutput_items, input_items, output_items);
+        clock_type::duration elapsed = clock_type::now() - start;
+
+        if (d_input) {
+            d_input->update_write_pointer(nitems);
+            d_detail->consume(0, nitems);
+            d_input->prune_tags(d_reader->nitems_read());
+        }
+        if (d_output) {
+            d_detail->produce(0, nitems);
+            d_output->prune_tags(d_output->nitems_written());
+        }
+        return elapsed;
+    }
+
+private:
+    std::shared_ptr<gr::sync_block> d_block;
+    gr::block_detail_sptr d_detail;
+    gr::buffer_sptr d_input;
+    gr::buffer_reader_sptr d_reader;
+    gr::buffer_sptr d_output;
+};
+
+void remove_files(const std::string& dir)
+{
+    for (const auto& entry : std::filesystem::directory_iterator(dir)) {
+        std::filesystem::remove_all(entry.path());
+    }
+}
+
+void print_header()
+{
+    std::printf("%-56s %14s %10s\n", "case", "items/s", "ns/item");
+}
+
+void print_result(const std::string& name, uint64_t nitems, clock_type::duration elapsed)
+{
+    double secs = std::chrono::duration<double>(elapsed).count();
+    std::printf(
+        "%-56s %14.0f %10.3f\n", name.c_str(), nitems / secs, 1e9 * secs / nitems);
+    std::fflush(stdout);
+}
+
+/*!
+ * Call `work` on the same synthetic buffers until it has taken at least `min_time`.
+ * Each call is handed `noutput_items`, and whatever isn't consumed is handed back on the
+ * next. If set, `before_call` is run outside of the timed calls, with the offset of the
+ * next input item.
+ */
+void run(const std::string& name,
+         const options& opts,
+         std::shared_ptr<gr::sync_block> block,
+         harness& h,
+         int noutput_items,
+         const std::vector<char>& input,
+         std::vector<char>& output,
+         size_t sizeof_input_item,
+         size_t sizeof_output_item,
+         const std::function<void(uint64_t)>& before_call = {})
+{
+    if (!block->start()) {
+        throw std::runtime_error("Failed to start " + name);
+    }
+    uint64_t ntotal_items = 0;
+    clock_type::duration elapsed{};
+    const auto min_time = std::chrono::duration<double>(opts.min_time);
+    int nremaining = noutput_items;
+    while (elapsed < min_time) {
+        if (before_call) {
+            before_call(h.nitems_read());
+        }
+        size_t done = noutput_items - nremaining;
+        gr_vector_const_void_star input_items;
+        gr_vector_void_star output_items;
+        if (sizeof_input_item > 0) {
+            input_items.push_back(input.data() + done * sizeof_input_item);
+        }
+        if (sizeof_output_item > 0) {
+            output_items.push_back(output.data() + done * sizeof_output_item);
+        }
+        int nitems = 0;
+        elapsed += h.call(nremaining, input_items, output_items, nitems);
+        ntotal_items += nitems;
+        nremaining -= nitems;
+        if (nremaining == 0) {
+            nremaining = noutput_items;
+        }
+    }
+    block->stop();
+    print_result(name, ntotal_items, elapsed);
+}
+
+bool is_selected(const options& opts, const std::string& name)
+{
+    return opts.filter.empty() || name.find(opts.filter) != std::string::npos;
+}
+
+// One case for the sink. Tags are recorded if there are any, one every `tag_interval`
+// items.
+void bench_batched_file_sink_case(const options& opts,
+                                  const std::string& name,
+                                  const std::string& input_type,
+                                  const std::vector<char>& input,
+                                  int noutput_items,
+                                  float batch_size,
+                                  int tag_interval)
+{
+    const size_t sizeof_item = get_sizeof_item(input_type);
+    const bool is_tagged = tag_interval > 0;
+    auto sink = gr::spectre::batched_file_sink::make(opts.dir,
+                                                     "bench",
+                                                     input_type,
+                                                     batch_size,
+                                                     SAMPLE_RATE,
+                                                     false,
+                                                     is_tagged,
+                                                     "freq",
+                                                     0);
+    harness h(sink, sizeof_item, 0);
+
+    // Tag the items for the next call, and clear out the files once too much has been
+    // written.
+    uint64_t next_tag = 0;
+    uint64_t last_cleared = 0;
+    double freq = 0;
+    auto before_call = [&](uint64_t nitems_read) {
+        uint64_t end = nitems_read + noutput_items;
+        for (; is_tagged && next_tag < end; next_tag += tag_interval) {
+            h.add_input_tag(next_tag, FREQ_KEY, pmt::from_double(freq));
+            freq += 1e6;
+        }
+        if ((nitems_read - last_cleared) * sizeof_item > MAX_BYTES_ON_DISK) {
+            remove_files(opts.dir);
+            last_cleared = nitems_read;
+        }
+    };
+    std::vector<char> output;
+    run(name, opts, sink, h, noutput_items, input, output, sizeof_item, 0, before_call);
+    remove_files(opts.dir);
+}
+
+// The sink, across input types, call sizes, batch sizes and tag densities.
+void bench_batched_file_sink(const options& opts)
+{
+    const std::vector<std::string> batch_sizes{ "0.01", "1" };
+    // The number of items between each tag, or zero for no tags.
+    const std::vector<int> tag_intervals{ 0, 10000, 100 };
+
+    std::filesystem::create_directories(opts.dir);
+    if (!is_tmpfs(opts.dir)) {
+        std::fprintf(stderr,
+                     "Warning: %s isn't on tmpfs, so the sink will be timed writing "
+                     "to disk.\n",
+                     opts.dir.c_str());
+    }
+
+    for (const std::string& input_type : INPUT_TYPES) {
+        std::vector<char> input = make_samples(input_type, MAX_NOUTPUT_ITEMS);
+        for (int noutput_items : NOUTPUT_ITEMS) {
+            for (const std::string& batch_size : batch_sizes) {
+                for (int tag_interval : tag_intervals) {
+                    std::string tags = (tag_interval > 0)
+                                           ? "1per" + std::to_string(tag_interval)
+                                           : "none";
+                    std::string name = "batched_file_sink/" + input_type +
+                                       "/n=" + std::to_string(noutput_items) +
+                                       "/batch=" + batch_size + "s/tags=" + tags;
+                    if (is_selected(opts, name)) {
+                        bench_batched_file_sink_case(opts,
+                                                     name,
+                                                     input_type,
+                                                     input,
+                                                     noutput_items,
+                                                     std::stof(batch_size),
+                                                     tag_interval);
+                    }
+                }
+            }
+        }
+    }
+    std::filesystem::remove_all(opts.dir);
+}
+
+// The sweeper, across input types, call sizes and how often it retunes.
+void bench_frequency_sweeper(const options& opts)
+{
+    const std::vector<int> nsamples_per_step{ 100000, 1000 };
+
+    for (const std::string& input_type : INPUT_TYPES) {
+        size_t sizeof_item = get_sizeof_item(input_type);
+        std::vector<char> input = make_samples(input_type, MAX_NOUTPUT_ITEMS);
+        std::vector<char> output;
+        for (int noutput_items : NOUTPUT_ITEMS) {
+            for (int nsamples : nsamples_per_step) {
+                std::string name = "frequency_sweeper/" + input_type +
+                                   "/n=" + std::to_string(noutput_items) +
+                                   "/step=" + std::to_string(nsamples);
+                if (!is_selected(opts, name)) {
+                    continue;
+                }
+                float dwell_time = nsamples / SAMPLE_RATE;
+                auto sweeper = gr::spectre::frequency_sweeper::make(
+                    90e6, 110e6, 2e6, dwell_time, SAMPLE_RATE, "freq", input_type);
+                harness h(sweeper, sizeof_item, 0);
+                run(name, opts, sweeper, h, noutput_items, input, output, sizeof_item, 0);
+            }
+        }
+    }
+}
+
+// The staircase, across call sizes and step lengths (so, how often it tags its output).
+void bench_tagged_staircase(const options& opts)
+{
+    const std::vector<int> nsamples_per_step{ 10000, 100 };
+    const size_t sizeof_item = sizeof(gr_complex);
+
+    std::vector<char> input;
+    std::vector<char> output(MAX_NOUTPUT_ITEMS * sizeof_item);
+    for (int noutput_items : NOUTPUT_ITEMS) {
+        for (int nsamples : nsamples_per_step) {
+            std::string name = "tagged_staircase/fc32/n=" +
+                               std::to_string(noutput_items) +
+                               "/step=" + std::to_string(nsamples);
+            if (!is_selected(opts, name)) {
+                continue;
+            }
+            auto staircase = gr::spectre::tagged_staircase::make(
+                nsamples, nsamples, 32000, 0, SAMPLE_RATE);
+            harness h(staircase, 0, sizeof_item);
+            run(name, opts, staircase, h, noutput_items, input, output, 0, sizeof_item);
+        }
+    }
+}
+
+options parse_args(int argc, char** argv)
+{
+    options opts;
+    for (int n = 1; n < argc; n++) {
+        std::string arg = argv[n];
+        if (n + 1 >= argc) {
+            throw std::invalid_argument("Expected a value after " + arg);
+        }
+        if (arg == "--dir") {
+            opts.dir = argv[++n];
+        } else if (arg == "--min-time") {
+            opts.min_time = std::atof(argv[++n]);
+        } else if (arg == "--filter") {
+            opts.filter = argv[++n];
+        } else {
+            throw std::invalid_argument("Unknown argument: " + arg);
+        }
+    }
+    return opts;
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+    try {
+        options opts = parse_args(argc, argv);
+        print_header();
+        bench_batched_file_sink(opts);
+        bench_frequency_sweeper(opts);
+        bench_tagged_staircase(opts);
+    } catch (const std::exception& e) {
+        std::fprintf(stderr, "%s\n", e.what());
+        return 1;
+    }
+    return 0;
+}
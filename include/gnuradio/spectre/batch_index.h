@@ -0,0 +1,149 @@
+/*
+ * Copyright 2024-2026 Jimmy Fitzpatrick.
+ * This file is part of SPECTRE
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef INCLUDED_SPECTRE_BATCH_INDEX_H
+#define INCLUDED_SPECTRE_BATCH_INDEX_H
+
+#include <gnuradio/spectre/api.h>
+#include <cstdint>
+#include <filesystem>
+#include <vector>
+
+namespace gr {
+namespace spectre {
+
+static constexpr char BATCH_INDEX_MAGIC[4] = { 'S', 'P', 'C', 'I' };
+static constexpr uint16_t BATCH_INDEX_VERSION = 1;
+
+// Set in the header once an entry starts earlier than the one before it.
+static constexpr uint32_t BATCH_INDEX_UNSORTED = 1 << 0;
+
+/*!
+ * \brief The fixed-size header at the start of every index file.
+ */
+struct batch_index_header {
+    char magic[4];
+    uint16_t version;
+    uint16_t entry_size;
+    uint32_t flags;
+    uint32_t reserved;
+};
+
+static_assert(sizeof(batch_index_header) == 16,
+              "The batch index header must have a fixed size.");
+
+/*!
+ * \brief A single entry in a batch index, describing where one batch was written.
+ *
+ * Batches with several data files (one per channel) have one entry per file, all
+ * sharing the same start time. All fields are in native (little-endian) byte order.
+ */
+struct batch_index_entry {
+    // The time the first sample in the batch was recorded, since the Unix epoch.
+    int64_t start_ns;
+    // The number of samples recorded before this batch, since the flowgraph started.
+    uint64_t sample_offset;
+    uint64_t nsamples;
+    // The byte offset of the file path in the index's path table.
+    uint64_t path_id;
+    // Where the (possibly compressed) data for the batch is found in the file.
+    uint64_t byte_offset;
+    uint64_t byte_size;
+    float sample_rate;
+    // The number of (tag value, number of samples) pairs recorded for the batch.
+    uint32_t ntags;
+};
+
+static_assert(sizeof(batch_index_entry) == 56,
+              "The batch index entry must have a fixed size.");
+
+/*!
+ * \brief The location of a batch which overlaps a requested time interval.
+ */
+struct batch_range {
+    std::filesystem::path path;
+    uint64_t byte_offset;
+    uint64_t byte_size;
+    int64_t start_ns;
+    uint64_t sample_offset;
+    uint64_t nsamples;
+    float sample_rate;
+    uint32_t ntags;
+};
+
+/*!
+ * \brief Looks up batches by time, in an index written by `batched_file_sink`.
+ * \ingroup spectre
+ *
+ * \details Every index is made up of two append-only files in the sink's directory:
+ *
+ *     <tag>.idx
+ *     <tag>.paths
+ *
+ * The first holds a `batch_index_header` followed by fixed-size `batch_index_entry`
+ * records, in the order the batches were recorded. The second holds newline-separated
+ * file paths (relative to the directory), which the entries refer to by byte offset.
+ *
+ * Entries are usually sorted by start time, in which case lookups binary search the index
+ * file directly, so neither file is read into memory. But start times can go backwards
+ * (e.g., the system clock is stepped back between recordings appended to the same index,
+ * or batch timestamps switch between the system clock and `rx_time` tags). When that
+ * happens, the writer sets `BATCH_INDEX_UNSORTED` in the header, and lookups fall back to
+ * scanning every entry instead.
+ */
+class SPECTRE_API batch_index
+{
+public:
+    /*!
+     * \param filename The path to the `.idx` file. The path table is expected alongside
+     * it, with the `.paths` extension.
+     */
+    explicit batch_index(const std::filesystem::path& filename);
+    ~batch_index();
+
+    batch_index(const batch_index&) = delete;
+    batch_index& operator=(const batch_index&) = delete;
+
+    /*!
+     * \brief The number of entries in the index, as of when it was opened.
+     */
+    size_t size() const;
+
+    /*!
+     * \brief Read the `n`th entry in the index.
+     */
+    batch_index_entry at(size_t n) const;
+
+    /*!
+     * \brief Whether the entries are sorted by start time, so lookups can binary search.
+     */
+    bool is_sorted() const;
+
+    /*!
+     * \brief Find every batch which overlaps the interval `[start_ns, end_ns)`.
+     *
+     * \param start_ns The start of the interval, in nanoseconds since the Unix epoch.
+     * \param end_ns The end of the interval, in nanoseconds since the Unix epoch.
+     * \return The matching batches, in the order they were recorded.
+     */
+    std::vector<batch_range> lookup(int64_t start_ns, int64_t end_ns) const;
+
+private:
+    size_t find_first_candidate(int64_t start_ns) const;
+    std::filesystem::path read_path(uint64_t path_id) const;
+
+    std::filesystem::path d_dir;
+    std::filesystem::path d_filename;
+    int d_fd;
+    int d_paths_fd;
+    size_t d_size;
+    bool d_is_sorted;
+};
+
+} // namespace spectre
+} // namespace gr
+
+#endif // INCLUDED_SPECTRE_BATCH_INDEX_H
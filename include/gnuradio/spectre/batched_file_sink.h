@@ -9,10 +9,83 @@
 
 #include <gnuradio/spectre/api.h>
 #include <gnuradio/sync_block.h>
+#include <string>
+#include <vector>
 
 namespace gr {
 namespace spectre {
 
+/*!
+ * \brief How a batched file sink writes, lays out and limits what it records.
+ *
+ * Every option defaults to the sink's original behaviour, so only those which differ
+ * need to be set. See the README for how each feature works in more detail.
+ */
+struct SPECTRE_API batched_file_sink_options {
+    // The maximum number of full batches waiting to be written by a writer thread. If
+    // zero, batches are written from within the scheduler thread. In the `direct` write
+    // mode, it's instead the maximum number of chunks being written at once.
+    int queue_depth = 0;
+    // `buffered` (hold each batch in memory until it's full), `streaming`, `mmap` or
+    // `direct`.
+    std::string write_mode = "buffered";
+    // If true, closing each file blocks until it's reached the disk. Ignored by the
+    // `buffered` write mode.
+    bool sync_on_close = false;
+
+    // The data type samples are converted to (`sc16` or `sc8`, from `fc32`), after being
+    // multiplied by `scale`. If empty, they're written as they arrive. If the scale is
+    // zero, it's the full scale of the output type (32767 for `sc16`, 127 for `sc8`), so
+    // samples in [-1, 1] use its whole range.
+    std::string output_type = "";
+    float scale = 0;
+    // `none`, `zstd` or `lz4`, at the codec's level (zero for its default).
+    std::string compression = "none";
+    int compression_level = 0;
+
+    // The number of input streams, recorded in lockstep, and whether they're interleaved
+    // into a single file.
+    int num_inputs = 1;
+    bool interleave = false;
+    // Further directories to stripe batches across, `round_robin` or `least_loaded`.
+    std::vector<std::string> stripe_dirs = {};
+    std::string stripe_policy = "round_robin";
+    // In container mode (if either is positive), the most each segment file holds, in
+    // MiB and seconds. Zero for no limit.
+    float segment_size = 0;
+    float segment_duration = 0;
+    // If true, each batch is added to a `<tag>.idx` index once it's been written.
+    bool write_index = false;
+
+    // If true, batch timestamps are derived from `rx_time` stream tags.
+    bool use_rx_time = false;
+    // The version of the `.hdr` format: 1 (float pairs) or 2 (see `tag_file.h`).
+    int hdr_version = 1;
+    // The keys of further stream tags to record in the JSON metadata file.
+    std::vector<std::string> metadata_tag_keys = {};
+
+    // Where each batch ends: `size`, `tag` (on tags with `tag_key`) or `wrap` (on tags
+    // whose value wraps around), and how many such boundaries are in each batch.
+    std::string batch_boundary = "size";
+    int boundaries_per_batch = 1;
+    // `continuous` or `triggered`. In triggered mode, captures are triggered by a
+    // `message` or on `power` above `trigger_threshold` dBFS, and start `pre_trigger`
+    // seconds before the trigger.
+    std::string capture_mode = "continuous";
+    std::string trigger_source = "message";
+    float trigger_threshold = -20;
+    float pre_trigger = 0;
+
+    // The most recorded data to keep on disk, in GiB. If zero, everything is kept.
+    // Incompatible with `write_index`.
+    float disk_quota = 0;
+    // What to do with a full batch when the queue is full: `block`, `drop_newest` or
+    // `drop_oldest`.
+    std::string backpressure = "block";
+    // How often to publish performance stats, in seconds. If zero, no stats are kept.
+    float stats_interval = 0;
+};
+
 /*!
  * \brief Writes the input stream to binary files in fixed-length batches.
  * \ingroup spectre
@@ -30,6 +103,11 @@ namespace spectre {
  *
  * which interleaves the tag values and the number of samples corresponding to that
  * tag, recording both as single precision floats.
+ *
+ * How batches are written, converted, split, laid out on disk and limited is set by
+ * `batched_file_sink_options`. Some settings can be changed while the flowgraph runs,
+ * through the `command` message port. Triggers are received on the `trigger` port,
+ * dropped batches are published on the `dropped` port, and stats on the `stats` port.
  */
 class SPECTRE_API batched_file_sink : virtual public gr::sync_block
 {
@@ -49,6 +127,7 @@ public:
      * recorded. \param tag_key Key used to extract values from stream tags if `is_tagged`
      * is true. \param initial_tag_value Default value used if no tag is present for the
      * first sample and `is_tagged` is true. 0 for not provided.
+     * \param options Everything else about how the batches are recorded.
      */
     static sptr make(const std::string& dir = ".",
                      const std::string& tag = "spectre",
@@ -58,7 +137,8 @@ public:
                      const bool group_by_date = false,
                      const bool is_tagged = false,
                      const std::string& tag_key = "freq",
-                     const float initial_tag_value = 0);
+                     const float initial_tag_value = 0,
+                     const batched_file_sink_options& options = {});
 };
 
 } // namespace spectre
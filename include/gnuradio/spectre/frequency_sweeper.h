@@ -19,6 +19,11 @@ namespace spectre {
  *
  * \details Periodically retunes compatible receiver blocks over a range of frequencies in
  * fixed increments using message passing. Dwell time is measured through sample counting.
+ *
+ * If `stats_interval` is set, the block counts the items it has read, its calls to
+ * `work` (and the time spent in them), and the retune commands it has issued. Every
+ * `stats_interval` seconds they're published on the `stats` message port as a
+ * dictionary, and they can be read at any time through ControlPort, if it's enabled.
  */
 class SPECTRE_API frequency_sweeper : virtual public gr::sync_block
 {
@@ -36,6 +41,8 @@ public:
      * \param retune_cmd_name The name of the retune command (please consult the
      * receiver block implementation).
      * \param input_type The data type of each sample in the input stream.
+     * \param stats_interval How often to publish performance stats, in seconds. If zero,
+     * no stats are kept.
      */
     static sptr make(float min_freq = 90e6,
                      float max_freq = 1106,
@@ -43,7 +50,8 @@ public:
                      float dwell_time = 200e-3,
                      float sample_rate = 2e6,
                      const std::string& retune_cmd_name = "freq",
-                     const std::string& input_type = "fc32");
+                     const std::string& input_type = "fc32",
+                     float stats_interval = 0);
 };
 
 } // namespace spectre
@@ -0,0 +1,61 @@
+/*
+ * Copyright 2024-2026 Jimmy Fitzpatrick.
+ * This file is part of SPECTRE
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef INCLUDED_SPECTRE_TAG_FILE_H
+#define INCLUDED_SPECTRE_TAG_FILE_H
+
+#include <cstdint>
+
+namespace gr {
+namespace spectre {
+
+/*
+ * The layout of the `.hdr` files written by `batched_file_sink`, in version 2 of the
+ * format. Version 1 (the legacy format) has no header, and is just interleaved (tag
+ * value, number of samples) pairs, each stored as a single precision float.
+ */
+
+static constexpr char TAG_FILE_MAGIC[4] = { 'S', 'P', 'C', 'T' };
+static constexpr uint16_t TAG_FILE_VERSION = 2;
+
+/*!
+ * \brief The fixed-size header at the start of a version 2 `.hdr` file.
+ *
+ * It's followed immediately by `nrecords` tag records. All fields are in native
+ * (little-endian) byte order, and naturally aligned, so the whole file can be mapped
+ * straight onto these structs (or an equivalent NumPy structured dtype).
+ */
+struct tag_file_header {
+    char magic[4];
+    uint16_t version;
+    uint16_t header_size;
+    uint32_t record_size;
+    uint32_t reserved;
+    uint64_t nrecords;
+    // The sample rate of the recording, in Hz.
+    double sample_rate;
+};
+
+static_assert(sizeof(tag_file_header) == 32,
+              "The tag file header must have a fixed size.");
+
+/*!
+ * \brief A run of consecutive samples in a batch which share the same tag value.
+ */
+struct tag_record {
+    // The index of the first sample in the run, relative to the start of the batch.
+    uint64_t offset;
+    // The number of samples in the run.
+    uint64_t count;
+    double value;
+};
+
+static_assert(sizeof(tag_record) == 24, "The tag record must have a fixed size.");
+
+} // namespace spectre
+} // namespace gr
+
+#endif // INCLUDED_SPECTRE_TAG_FILE_H
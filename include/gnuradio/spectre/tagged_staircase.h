@@ -27,6 +27,11 @@ namespace spectre {
  * comparison with analytical results. The constant value within each step allows explicit
  * evaluation of the DFT, while the variable step lengths reflect the behavior of a
  * receiver periodically retuned using message passing in GNU Radio.
+ *
+ * If `stats_interval` is set, the block counts the items it has produced, its calls to
+ * `work` (and the time spent in them), and the tags it has added. Every
+ * `stats_interval` seconds they're published on the `stats` message port as a
+ * dictionary, and they can be read at any time through ControlPort, if it's enabled.
  */
 class SPECTRE_API tagged_staircase : virtual public gr::sync_block
 {
@@ -43,12 +48,15 @@ public:
      * \param sample_rate The modelled sample rate of the output stream. According to this
      * value, the initial modelled center frequency is set such that on performing an FFT,
      * the edge of the spectrum will be at 0Hz
+     * \param stats_interval How often to publish performance stats, in seconds. If zero,
+     * no stats are kept.
      */
     static sptr make(int min_samples_per_step = 4000,
                      int max_samples_per_step = 5000,
                      float hop_freq = 32000,
                      int step_increment = 200,
-                     float sample_rate = 32000);
+                     float sample_rate = 32000,
+                     float stats_interval = 0);
 };
 
 } // namespace spectre
@@ -0,0 +1,44 @@
+/*
+ * Copyright 2024-2026 Jimmy Fitzpatrick.
+ * This file is part of SPECTRE
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef INCLUDED_SPECTRE_TRACE_H
+#define INCLUDED_SPECTRE_TRACE_H
+
+#include <gnuradio/spectre/api.h>
+#include <string>
+
+namespace gr {
+namespace spectre {
+
+/*!
+ * \brief Whether gr-spectre was built with `ENABLE_TRACING`.
+ *
+ * If it was, each block records trace events as it runs: spans for every call to
+ * `work`, for each tag scan, for opening, flushing and writing each batch in the
+ * batched file sink, and for each retune command published by the frequency sweeper.
+ * Each thread keeps its most recent events (65536 of them) in a ring buffer, which is
+ * handed on to a new thread once it exits (e.g., when the flowgraph is restarted).
+ */
+SPECTRE_API bool trace_enabled();
+
+/*!
+ * \brief Write every trace event recorded so far to a file, in the Chrome trace event
+ * JSON format, which can be opened with Perfetto (https://ui.perfetto.dev).
+ *
+ * Timestamps are in microseconds (to the nanosecond) on the monotonic clock
+ * (`CLOCK_MONOTONIC`), the same as `perf` and most kernel tracers, and each thread is
+ * identified by its kernel thread ID, so stalls can be lined up with disk and scheduler
+ * activity. Events carry on being recorded while the trace is dumped.
+ *
+ * \param filename Where to write the trace.
+ * \throws std::runtime_error If tracing isn't enabled, or the file can't be written.
+ */
+SPECTRE_API void dump_trace(const std::string& filename);
+
+} // namespace spectre
+} // namespace gr
+
+#endif /* INCLUDED_SPECTRE_TRACE_H */
@@ -0,0 +1,219 @@
+/*
+ * Copyright 2024-2026 Jimmy Fitzpatrick.
+ * This file is part of SPECTRE
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "batch_compressor.h"
+
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+
+#ifdef SPECTRE_HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef SPECTRE_HAVE_LZ4
+#include <lz4frame.h>
+#endif
+
+namespace {
+
+// Small enough to seek with a fine granularity, and large enough to compress well. It's
+// a multiple of every supported sample size, so samples never straddle two frames.
+static constexpr size_t FRAME_SIZE = 1 << 20;
+
+// As per the Zstandard seekable format.
+static constexpr uint32_t SKIPPABLE_MAGIC_NUMBER = 0x184D2A5E;
+static constexpr uint32_t SEEKABLE_MAGIC_NUMBER = 0x8F92EAB1;
+static constexpr size_t SKIPPABLE_HEADER_SIZE = 8;
+static constexpr size_t SEEK_TABLE_ENTRY_SIZE = 8;
+static constexpr size_t SEEK_TABLE_FOOTER_SIZE = 9;
+
+char* put_u32(char* p, uint32_t value)
+{
+    // The format is little-endian, regardless of the host.
+    for (int n = 0; n < 4; n++) {
+        *p++ = static_cast<char>((value >> (8 * n)) & 0xFF);
+    }
+    return p;
+}
+
+void shuffle(const char* src, char* dst, size_t nbytes, size_t typesize)
+{
+    // Transpose the bytes, so that byte `b` of every element is stored contiguously.
+    size_t nelements = nbytes / typesize;
+    for (size_t i = 0; i < nelements; i++) {
+        for (size_t b = 0; b < typesize; b++) {
+            dst[b * nelements + i] = src[i * typesize + b];
+        }
+    }
+}
+
+} // namespace
+
+namespace gr {
+namespace spectre {
+
+struct batch_compressor::context {
+#ifdef SPECTRE_HAVE_ZSTD
+    ZSTD_CCtx* zstd = nullptr;
+#endif
+};
+
+batch_compressor::batch_compressor(const std::string& codec, int level, size_t typesize)
+    : d_codec(codec),
+      d_level(level),
+      d_typesize(typesize),
+      d_context(std::make_unique<context>()),
+      d_shuffle_buffer(std::vector<char>(FRAME_SIZE, 0)),
+      d_output_buffer()
+{
+    check_codec(codec);
+#ifdef SPECTRE_HAVE_ZSTD
+    if (d_codec == "zstd") {
+        // Reusing the context across frames saves reallocating it every time.
+        d_context->zstd = ZSTD_createCCtx();
+        if (!d_context->zstd) {
+            throw std::bad_alloc();
+        }
+    }
+#endif
+}
+
+batch_compressor::~batch_compressor()
+{
+#ifdef SPECTRE_HAVE_ZSTD
+    ZSTD_freeCCtx(d_context->zstd);
+#endif
+}
+
+void batch_compressor::check_codec(const std::string& codec)
+{
+#ifdef SPECTRE_HAVE_ZSTD
+    if (codec == "zstd") {
+        return;
+    }
+#endif
+#ifdef SPECTRE_HAVE_LZ4
+    if (codec == "lz4") {
+        return;
+    }
+#endif
+    if (codec == "zstd" || codec == "lz4") {
+        throw std::invalid_argument("gr-spectre was built without support for: " + codec);
+    }
+    throw std::invalid_argument("Unsupported compression codec: " + codec);
+}
+
+std::string batch_compressor::get_extension(const std::string& codec)
+{
+    return (codec == "zstd") ? "zst" : codec;
+}
+
+size_t batch_compressor::frame_size() const { return FRAME_SIZE; }
+
+const char* batch_compressor::output() const { return d_output_buffer.data(); }
+
+size_t batch_compressor::compress(const char* data, size_t nbytes)
+{
+    size_t nframes = (nbytes + FRAME_SIZE - 1) / FRAME_SIZE;
+    size_t seek_table_size = nframes * SEEK_TABLE_ENTRY_SIZE + SEEK_TABLE_FOOTER_SIZE;
+
+    // Make sure there's enough space for the worst case up front, so we only ever
+    // allocate the first time (or if the batch size changes).
+    size_t capacity = SKIPPABLE_HEADER_SIZE + seek_table_size;
+    for (size_t offset = 0; offset < nbytes; offset += FRAME_SIZE) {
+        capacity += get_frame_bound(std::min(FRAME_SIZE, nbytes - offset));
+    }
+    if (d_output_buffer.size() < capacity) {
+        d_output_buffer.resize(capacity);
+    }
+
+    std::vector<uint32_t> compressed_sizes(nframes);
+    char* dst = d_output_buffer.data();
+    size_t ncompressed_bytes = 0;
+    for (size_t n = 0; n < nframes; n++) {
+        size_t offset = n * FRAME_SIZE;
+        size_t nframe_bytes = std::min(FRAME_SIZE, nbytes - offset);
+        const char* src = data + offset;
+        if (d_typesize > 1) {
+            shuffle(src, d_shuffle_buffer.data(), nframe_bytes, d_typesize);
+            src = d_shuffle_buffer.data();
+        }
+        size_t nframe_compressed_bytes = compress_frame(
+            src, nframe_bytes, dst + ncompressed_bytes, capacity - ncompressed_bytes);
+        compressed_sizes[n] = static_cast<uint32_t>(nframe_compressed_bytes);
+        ncompressed_bytes += nframe_compressed_bytes;
+    }
+
+    // Finally, append the seek table.
+    char* p = dst + ncompressed_bytes;
+    p = put_u32(p, SKIPPABLE_MAGIC_NUMBER);
+    p = put_u32(p, static_cast<uint32_t>(seek_table_size));
+    for (size_t n = 0; n < nframes; n++) {
+        size_t nframe_bytes = std::min(FRAME_SIZE, nbytes - n * FRAME_SIZE);
+        p = put_u32(p, compressed_sizes[n]);
+        p = put_u32(p, static_cast<uint32_t>(nframe_bytes));
+    }
+    p = put_u32(p, static_cast<uint32_t>(nframes));
+    // The seek table descriptor, indicating there are no checksums.
+    *p++ = 0;
+    p = put_u32(p, SEEKABLE_MAGIC_NUMBER);
+
+    return p - dst;
+}
+
+size_t batch_compressor::get_frame_bound(size_t nbytes) const
+{
+#ifdef SPECTRE_HAVE_ZSTD
+    if (d_codec == "zstd") {
+        return ZSTD_compressBound(nbytes);
+    }
+#endif
+#ifdef SPECTRE_HAVE_LZ4
+    if (d_codec == "lz4") {
+        LZ4F_preferences_t prefs;
+        std::memset(&prefs, 0, sizeof(prefs));
+        prefs.compressionLevel = d_level;
+        return LZ4F_compressFrameBound(nbytes, &prefs);
+    }
+#endif
+    throw std::logic_error("Unsupported compression codec: " + d_codec);
+}
+
+size_t batch_compressor::compress_frame(const char* src,
+                                        size_t nbytes,
+                                        char* dst,
+                                        size_t capacity)
+{
+#ifdef SPECTRE_HAVE_ZSTD
+    if (d_codec == "zstd") {
+        size_t ret =
+            ZSTD_compressCCtx(d_context->zstd, dst, capacity, src, nbytes, d_level);
+        if (ZSTD_isError(ret)) {
+            throw std::runtime_error(std::string("Failed to compress: ") +
+                                     ZSTD_getErrorName(ret));
+        }
+        return ret;
+    }
+#endif
+#ifdef SPECTRE_HAVE_LZ4
+    if (d_codec == "lz4") {
+        LZ4F_preferences_t prefs;
+        std::memset(&prefs, 0, sizeof(prefs));
+        prefs.compressionLevel = d_level;
+        prefs.frameInfo.contentSize = nbytes;
+        size_t ret = LZ4F_compressFrame(dst, capacity, src, nbytes, &prefs);
+        if (LZ4F_isError(ret)) {
+            throw std::runtime_error(std::string("Failed to compress: ") +
+                                     LZ4F_getErrorName(ret));
+        }
+        return ret;
+    }
+#endif
+    throw std::logic_error("Unsupported compression codec: " + d_codec);
+}
+
+} // namespace spectre
+} // namespace gr
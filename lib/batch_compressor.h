@@ -0,0 +1,89 @@
+/*
+ * Copyright 2024-2026 Jimmy Fitzpatrick.
+ * This file is part of SPECTRE
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef INCLUDED_SPECTRE_BATCH_COMPRESSOR_H
+#define INCLUDED_SPECTRE_BATCH_COMPRESSOR_H
+
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace gr {
+namespace spectre {
+
+/*!
+ * \brief Losslessly compresses batches into framed, seekable files.
+ *
+ * Each batch is split into fixed-size chunks, which are byte-shuffled and then
+ * compressed as independent frames, so any chunk can be decompressed without reading
+ * the ones before it. Shuffling groups together the bytes of each sample component
+ * which share the same significance (e.g., the sign and exponent bytes of each float),
+ * which typically makes I/Q data far more compressible.
+ *
+ * The frames are followed by a seek table, laid out as per the Zstandard seekable format:
+ * a skippable frame holding the compressed and decompressed size of each frame. Since
+ * both Zstandard and LZ4 ignore skippable frames, the whole file can also be decoded
+ * with the standard command line tools (though the output is still shuffled).
+ *
+ * Not thread-safe: each thread should use its own compressor.
+ */
+class batch_compressor
+{
+public:
+    /*!
+     * \param codec Either `zstd` or `lz4`.
+     * \param level The compression level, as understood by the codec.
+     * \param typesize The size of each sample component in bytes, used to shuffle the
+     * bytes in each chunk. If one, no shuffling is performed.
+     */
+    batch_compressor(const std::string& codec, int level, size_t typesize);
+    ~batch_compressor();
+
+    /*!
+     * \brief Compress `nbytes` from `data`, returning the size of the compressed file.
+     *
+     * The contents of the file are available through `output` until the next call.
+     */
+    size_t compress(const char* data, size_t nbytes);
+
+    /*!
+     * \brief The contents of the file produced by the last call to `compress`.
+     */
+    const char* output() const;
+
+    /*!
+     * \brief The size (in bytes) of each chunk, before compression.
+     */
+    size_t frame_size() const;
+
+    /*!
+     * \brief Throw if the codec isn't supported by this build.
+     */
+    static void check_codec(const std::string& codec);
+
+    /*!
+     * \brief The file extension conventionally used for the codec.
+     */
+    static std::string get_extension(const std::string& codec);
+
+private:
+    struct context;
+
+    const std::string d_codec;
+    const int d_level;
+    const size_t d_typesize;
+    std::unique_ptr<context> d_context;
+    std::vector<char> d_shuffle_buffer;
+    std::vector<char> d_output_buffer;
+
+    size_t compress_frame(const char* src, size_t nbytes, char* dst, size_t capacity);
+    size_t get_frame_bound(size_t nbytes) const;
+};
+
+} // namespace spectre
+} // namespace gr
+
+#endif
@@ -0,0 +1,171 @@
+/*
+ * Copyright 2024-2026 Jimmy Fitzpatrick.
+ * This file is part of SPECTRE
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "utils.h"
+#include <gnuradio/spectre/batch_index.h>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+namespace gr {
+namespace spectre {
+
+batch_index::batch_index(const std::filesystem::path& filename)
+    : d_dir(filename.parent_path()),
+      d_filename(filename),
+      d_fd(-1),
+      d_paths_fd(-1),
+      d_size(0),
+      d_is_sorted(true)
+{
+    d_fd = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+    if (d_fd < 0) {
+        throw make_system_error("Failed to open", filename);
+    }
+
+    std::filesystem::path paths_filename = filename;
+    paths_filename.replace_extension("paths");
+    d_paths_fd = ::open(paths_filename.c_str(), O_RDONLY | O_CLOEXEC);
+    if (d_paths_fd < 0) {
+        ::close(d_fd);
+        throw make_system_error("Failed to open", paths_filename);
+    }
+
+    try {
+        batch_index_header header;
+        pread_all(d_fd, reinterpret_cast<char*>(&header), sizeof(header), 0, filename);
+        if (std::memcmp(header.magic, BATCH_INDEX_MAGIC, sizeof(header.magic)) != 0 ||
+            header.entry_size != sizeof(batch_index_entry)) {
+            throw std::runtime_error("Unsupported batch index: " + filename.string());
+        }
+        d_is_sorted = (header.flags & BATCH_INDEX_UNSORTED) == 0;
+
+        struct stat st;
+        if (::fstat(d_fd, &st) < 0) {
+            throw make_system_error("Failed to stat", filename);
+        }
+        // Ignore a partially written entry at the end, if there is one.
+        d_size = (st.st_size - sizeof(header)) / sizeof(batch_index_entry);
+    } catch (...) {
+        ::close(d_fd);
+        ::close(d_paths_fd);
+        throw;
+    }
+}
+
+batch_index::~batch_index()
+{
+    ::close(d_fd);
+    ::close(d_paths_fd);
+}
+
+size_t batch_index::size() const { return d_size; }
+
+bool batch_index::is_sorted() const { return d_is_sorted; }
+
+batch_index_entry batch_index::at(size_t n) const
+{
+    if (n >= d_size) {
+        throw std::out_of_range("Batch index entry out of range: " + std::to_string(n));
+    }
+    batch_index_entry entry;
+    pread_all(d_fd,
+              reinterpret_cast<char*>(&entry),
+              sizeof(entry),
+              sizeof(batch_index_header) + n * sizeof(entry),
+              d_filename);
+    return entry;
+}
+
+std::vector<batch_range> batch_index::lookup(int64_t start_ns, int64_t end_ns) const
+{
+    // If the start times ever go backwards, any entry might overlap the interval, so
+    // every one of them has to be checked.
+    size_t first = (d_is_sorted) ? find_first_candidate(start_ns) : 0;
+
+    std::vector<batch_range> ranges;
+    for (size_t n = first; n < d_size; n++) {
+        batch_index_entry entry = at(n);
+        if (entry.start_ns >= end_ns) {
+            if (d_is_sorted) {
+                break;
+            }
+            continue;
+        }
+        if (get_end_ns(entry) <= start_ns) {
+            continue;
+        }
+        ranges.push_back(batch_range{ read_path(entry.path_id),
+                                      entry.byte_offset,
+                                      entry.byte_size,
+                                      entry.start_ns,
+                                      entry.sample_offset,
+                                      entry.nsamples,
+                                      entry.sample_rate,
+                                      entry.ntags });
+    }
+    return ranges;
+}
+
+size_t batch_index::find_first_candidate(int64_t start_ns) const
+{
+    // Find the first entry which starts after the interval does.
+    size_t lo = 0;
+    size_t hi = d_size;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (at(mid).start_ns <= start_ns) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    // The batch (or, with several channels, batches) just before it may still overlap.
+    if (lo > 0) {
+        int64_t previous_start_ns = at(lo - 1).start_ns;
+        while (lo > 0 && at(lo - 1).start_ns == previous_start_ns) {
+            lo--;
+        }
+    }
+    return lo;
+}
+
+std::filesystem::path batch_index::read_path(uint64_t path_id) const
+{
+    // Read in small chunks until the end of the line, since paths are usually short.
+    std::string path;
+    char chunk[256];
+    uint64_t offset = path_id;
+    while (true) {
+        ssize_t nread = ::pread(d_paths_fd, chunk, sizeof(chunk), offset);
+        if (nread < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw make_system_error("Failed to read the path table for", d_filename);
+        }
+        const char* end = static_cast<const char*>(std::memchr(chunk, '\n', nread));
+        if (end) {
+            path.append(chunk, end - chunk);
+            break;
+        }
+        if (nread == 0) {
+            throw std::runtime_error("Corrupt path table for: " + d_filename.string());
+        }
+        path.append(chunk, nread);
+        offset += nread;
+    }
+    return d_dir / path;
+}
+
+} // namespace spectre
+} // namespace gr
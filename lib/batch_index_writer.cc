@@ -0,0 +1,218 @@
+/*
+ * Copyright 2024-2026 Jimmy Fitzpatrick.
+ * This file is part of SPECTRE
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "batch_index_writer.h"
+#include "utils.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+namespace {
+
+uint64_t get_file_size(int fd, const std::filesystem::path& filename)
+{
+    struct stat st;
+    if (::fstat(fd, &st) < 0) {
+        throw gr::spectre::make_system_error("Failed to stat", filename);
+    }
+    return st.st_size;
+}
+
+std::filesystem::path get_paths_filename(std::filesystem::path filename)
+{
+    return filename.replace_extension("paths");
+}
+
+} // namespace
+
+namespace gr {
+namespace spectre {
+
+batch_index_writer::batch_index_writer(const std::filesystem::path& filename)
+    : d_filename(filename),
+      d_paths_filename(get_paths_filename(filename)),
+      d_fd(-1),
+      d_paths_fd(-1),
+      d_paths_size(0),
+      d_header(),
+      d_last_start_ns(),
+      d_next_sequence(0),
+      d_pending(),
+      d_last_path(),
+      d_last_path_id(0)
+{
+}
+
+batch_index_writer::~batch_index_writer()
+{
+    try {
+        close();
+    } catch (...) {
+        // There's no one left to report the error to.
+    }
+}
+
+void batch_index_writer::add(uint64_t sequence,
+                             batch_index_entry entry,
+                             const std::vector<file_range>& ranges)
+{
+    std::lock_guard<std::mutex> lock(d_mutex);
+    if (d_fd < 0) {
+        open();
+    }
+
+    d_pending.emplace(sequence, pending_batch{ entry, ranges });
+
+    // Write every batch we can, without leaving a gap.
+    auto it = d_pending.begin();
+    while (it != d_pending.end() && it->first == d_next_sequence) {
+        write(it->second);
+        it = d_pending.erase(it);
+        d_next_sequence++;
+    }
+}
+
+void batch_index_writer::close()
+{
+    std::lock_guard<std::mutex> lock(d_mutex);
+    if (d_fd < 0) {
+        return;
+    }
+
+    // Whatever is missing will never arrive, so keep what did.
+    for (const auto& [sequence, batch] : d_pending) {
+        write(batch);
+    }
+    d_pending.clear();
+    d_next_sequence = 0;
+    d_last_path.clear();
+
+    ::close(d_paths_fd);
+    d_paths_fd = -1;
+    int fd = d_fd;
+    d_fd = -1;
+    if (::close(fd) < 0) {
+        throw make_system_error("Failed to close", d_filename);
+    }
+}
+
+void batch_index_writer::open()
+{
+    d_fd = open_creating_parents(d_filename, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC);
+    if (d_fd < 0) {
+        throw make_system_error("Failed to open", d_filename);
+    }
+    d_paths_fd = open_creating_parents(d_paths_filename,
+                                       O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC);
+    if (d_paths_fd < 0) {
+        ::close(d_fd);
+        d_fd = -1;
+        throw make_system_error("Failed to open", d_paths_filename);
+    }
+
+    d_paths_size = get_file_size(d_paths_fd, d_paths_filename);
+
+    // Entries are only ever appended, so a new index just needs its header.
+    uint64_t size = get_file_size(d_fd, d_filename);
+    if (size == 0) {
+        d_header = batch_index_header{};
+        std::memcpy(d_header.magic, BATCH_INDEX_MAGIC, sizeof(d_header.magic));
+        d_header.version = BATCH_INDEX_VERSION;
+        d_header.entry_size = sizeof(batch_index_entry);
+        write_all(
+            d_fd, reinterpret_cast<const char*>(&d_header), sizeof(d_header), d_filename);
+        d_last_start_ns.reset();
+        return;
+    }
+
+    // Otherwise, carry on from the last entry, so we can tell if the next one starts
+    // before it.
+    pread_all(d_fd, reinterpret_cast<char*>(&d_header), sizeof(d_header), 0, d_filename);
+    if (std::memcmp(d_header.magic, BATCH_INDEX_MAGIC, sizeof(d_header.magic)) != 0 ||
+        d_header.entry_size != sizeof(batch_index_entry)) {
+        throw std::runtime_error("Unsupported batch index: " + d_filename.string());
+    }
+    uint64_t nentries = (size - sizeof(d_header)) / sizeof(batch_index_entry);
+    uint64_t entries_end = sizeof(d_header) + nentries * sizeof(batch_index_entry);
+    // Drop a partially written entry (e.g., left by a crash), so the next one lines up.
+    if (entries_end != size && ::ftruncate(d_fd, entries_end) < 0) {
+        throw make_system_error("Failed to truncate", d_filename);
+    }
+    d_last_start_ns.reset();
+    if (nentries > 0) {
+        batch_index_entry last;
+        pread_all(d_fd,
+                  reinterpret_cast<char*>(&last),
+                  sizeof(last),
+                  entries_end - sizeof(last),
+                  d_filename);
+        d_last_start_ns = last.start_ns;
+    }
+}
+
+void batch_index_writer::write(const pending_batch& batch)
+{
+    // Mark the index before the entry is written, so it's never left unsorted without
+    // saying so.
+    if (d_last_start_ns && batch.entry.start_ns < *d_last_start_ns &&
+        (d_header.flags & BATCH_INDEX_UNSORTED) == 0) {
+        mark_unsorted();
+    }
+    d_last_start_ns = batch.entry.start_ns;
+
+    for (const file_range& range : batch.ranges) {
+        batch_index_entry entry = batch.entry;
+        entry.path_id = get_path_id(range.path);
+        entry.byte_offset = range.offset;
+        entry.byte_size = range.size;
+        write_all(d_fd, reinterpret_cast<const char*>(&entry), sizeof(entry), d_filename);
+    }
+}
+
+void batch_index_writer::mark_unsorted()
+{
+    // Every write to the index's own descriptor is appended (even with `pwrite`, on
+    // Linux), so the header is updated through another.
+    int fd = ::open(d_filename.c_str(), O_WRONLY | O_CLOEXEC);
+    if (fd < 0) {
+        throw make_system_error("Failed to open", d_filename);
+    }
+    batch_index_header header = d_header;
+    header.flags |= BATCH_INDEX_UNSORTED;
+    try {
+        pwrite_all(
+            fd, reinterpret_cast<const char*>(&header), sizeof(header), 0, d_filename);
+    } catch (...) {
+        ::close(fd);
+        throw;
+    }
+    ::close(fd);
+    d_header = header;
+}
+
+uint64_t batch_index_writer::get_path_id(const std::filesystem::path& path)
+{
+    if (path == d_last_path) {
+        return d_last_path_id;
+    }
+
+    // Store paths relative to the index, so the whole directory can be moved.
+    std::string line = path.lexically_relative(d_filename.parent_path()).string() + "\n";
+    write_all(d_paths_fd, line.data(), line.size(), d_paths_filename);
+
+    d_last_path = path;
+    d_last_path_id = d_paths_size;
+    d_paths_size += line.size();
+    return d_last_path_id;
+}
+
+} // namespace spectre
+} // namespace gr
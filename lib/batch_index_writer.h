@@ -0,0 +1,99 @@
+/*
+ * Copyright 2024-2026 Jimmy Fitzpatrick.
+ * This file is part of SPECTRE
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef INCLUDED_SPECTRE_BATCH_INDEX_WRITER_H
+#define INCLUDED_SPECTRE_BATCH_INDEX_WRITER_H
+
+#include <gnuradio/spectre/batch_index.h>
+#include <cstdint>
+#include <filesystem>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <vector>
+
+namespace gr {
+namespace spectre {
+
+/*!
+ * \brief Where some (possibly compressed) data was written.
+ */
+struct file_range {
+    std::filesystem::path path;
+    uint64_t offset;
+    uint64_t size;
+};
+
+/*!
+ * \brief Appends entries to a batch index, as each batch is written.
+ *
+ * Batches may be written out of order (e.g., when several threads compress them), so
+ * each is numbered by the caller and entries are held back until every batch before it
+ * has been added. If an entry starts earlier than the one before it (including the last
+ * entry in an existing index), the index is marked as unsorted. Safe to call from several
+ * threads.
+ */
+class batch_index_writer
+{
+public:
+    /*!
+     * \param filename The path to the `.idx` file. The path table is written alongside
+     * it, with the `.paths` extension. Both are created if they don't already exist, and
+     * appended to otherwise.
+     */
+    batch_index_writer(const std::filesystem::path& filename);
+    ~batch_index_writer();
+
+    /*!
+     * \brief Add the entries for a batch, one per data file.
+     *
+     * \param sequence The number of batches added before this one.
+     * \param entry The entry for the batch. The path and byte range are filled in here.
+     * \param ranges Where the data for the batch was written.
+     */
+    void add(uint64_t sequence,
+             batch_index_entry entry,
+             const std::vector<file_range>& ranges);
+
+    /*!
+     * \brief Write any entries still held back (e.g., after a batch failed to be
+     * written), then close the index.
+     */
+    void close();
+
+private:
+    struct pending_batch {
+        batch_index_entry entry;
+        std::vector<file_range> ranges;
+    };
+
+    void open();
+    void write(const pending_batch& batch);
+    void mark_unsorted();
+    uint64_t get_path_id(const std::filesystem::path& path);
+
+    const std::filesystem::path d_filename;
+    const std::filesystem::path d_paths_filename;
+
+    std::mutex d_mutex;
+    int d_fd;
+    int d_paths_fd;
+    uint64_t d_paths_size;
+    batch_index_header d_header;
+    // The start time of the last entry written, if there is one.
+    std::optional<int64_t> d_last_start_ns;
+    uint64_t d_next_sequence;
+    std::map<uint64_t, pending_batch> d_pending;
+
+    // Consecutive batches often share a file (e.g., in container mode).
+    std::filesystem::path d_last_path;
+    uint64_t d_last_path_id;
+};
+
+} // namespace spectre
+} // namespace gr
+
+#endif
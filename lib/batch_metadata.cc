@@ -0,0 +1,189 @@
+/*
+ * Copyright 2024-2026 Jimmy Fitzpatrick.
+ * This file is part of SPECTRE
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "batch_metadata.h"
+
+#include <cmath>
+#include <iomanip>
+#include <limits>
+#include <sstream>
+
+namespace {
+
+std::string quote(const std::string& s)
+{
+    std::string quoted = "\"";
+    for (char c : s) {
+        if (c == '"' || c == '\\') {
+            quoted += '\\';
+        }
+        quoted += c;
+    }
+    return quoted + "\"";
+}
+
+std::string format_double(double value)
+{
+    // JSON has no infinities or NaNs.
+    if (!std::isfinite(value)) {
+        return "null";
+    }
+    // Write enough digits that the value is read back exactly.
+    std::ostringstream buffer;
+    buffer << std::setprecision(std::numeric_limits<double>::max_digits10) << value;
+    return buffer.str();
+}
+
+} // namespace
+
+namespace gr {
+namespace spectre {
+
+void batch_metadata::set(const std::string& key, const std::string& value)
+{
+    set_raw(key, quote(value));
+}
+
+void batch_metadata::set(const std::string& key, const char* value)
+{
+    set_raw(key, quote(value));
+}
+
+void batch_metadata::set(const std::string& key, double value)
+{
+    set_raw(key, format_double(value));
+}
+
+void batch_metadata::set(const std::string& key, int64_t value)
+{
+    set_raw(key, std::to_string(value));
+}
+
+void batch_metadata::set(const std::string& key, uint64_t value)
+{
+    set_raw(key, std::to_string(value));
+}
+
+void batch_metadata::set(const std::string& key, bool value)
+{
+    set_raw(key, (value) ? "true" : "false");
+}
+
+void batch_metadata::add_tag(const std::string& key,
+                             uint64_t offset,
+                             const std::string& value)
+{
+    add_tag_raw(key, "string", offset, quote(value));
+}
+
+void batch_metadata::add_tag(const std::string& key, uint64_t offset, const char* value)
+{
+    add_tag_raw(key, "string", offset, quote(value));
+}
+
+void batch_metadata::add_tag(const std::string& key, uint64_t offset, double value)
+{
+    add_tag_raw(key, "double", offset, format_double(value));
+}
+
+void batch_metadata::add_tag(const std::string& key, uint64_t offset, int64_t value)
+{
+    add_tag_raw(key, "int", offset, std::to_string(value));
+}
+
+void batch_metadata::add_tag(const std::string& key, uint64_t offset, bool value)
+{
+    add_tag_raw(key, "bool", offset, (value) ? "true" : "false");
+}
+
+void batch_metadata::add_dropped(int64_t start_ns,
+                                 int64_t end_ns,
+                                 uint64_t sample_offset,
+                                 uint64_t nsamples)
+{
+    d_dropped += (d_dropped.empty()) ? "[" : ", [";
+    d_dropped += std::to_string(start_ns) + ", " + std::to_string(end_ns) + ", " +
+                 std::to_string(sample_offset) + ", " + std::to_string(nsamples) + "]";
+    d_ndropped_batches++;
+    d_ndropped_samples += nsamples;
+}
+
+void batch_metadata::clear()
+{
+    d_entries.clear();
+    d_tag_streams.clear();
+    d_dropped.clear();
+    d_ndropped_batches = 0;
+    d_ndropped_samples = 0;
+}
+
+bool batch_metadata::empty() const
+{
+    return d_entries.empty() && d_tag_streams.empty() && d_dropped.empty();
+}
+
+std::string batch_metadata::to_json() const
+{
+    std::string json = "{";
+    for (size_t n = 0; n < d_entries.size(); n++) {
+        json += (n == 0) ? "" : ", ";
+        json += quote(d_entries[n].first) + ": " + d_entries[n].second;
+    }
+    if (!d_tag_streams.empty()) {
+        json += (d_entries.empty()) ? "" : ", ";
+        json += "\"tags\": {";
+        for (size_t n = 0; n < d_tag_streams.size(); n++) {
+            const tag_stream& stream = d_tag_streams[n];
+            json += (n == 0) ? "" : ", ";
+            json += quote(stream.key) + ": {\"type\": " + quote(stream.type) +
+                    ", \"records\": [" + stream.records + "]}";
+        }
+        json += "}";
+    }
+    if (!d_dropped.empty()) {
+        json += (d_entries.empty() && d_tag_streams.empty()) ? "" : ", ";
+        json += "\"dropped\": {\"nbatches\": " + std::to_string(d_ndropped_batches) +
+                ", \"nsamples\": " + std::to_string(d_ndropped_samples) +
+                ", \"ranges\": [" + d_dropped + "]}";
+    }
+    return json + "}\n";
+}
+
+void batch_metadata::set_raw(const std::string& key, std::string json_value)
+{
+    for (auto& entry : d_entries) {
+        if (entry.first == key) {
+            entry.second = std::move(json_value);
+            return;
+        }
+    }
+    d_entries.emplace_back(key, std::move(json_value));
+}
+
+void batch_metadata::add_tag_raw(const std::string& key,
+                                 const char* type,
+                                 uint64_t offset,
+                                 const std::string& json_value)
+{
+    tag_stream* stream = nullptr;
+    for (auto& s : d_tag_streams) {
+        if (s.key == key) {
+            stream = &s;
+            break;
+        }
+    }
+    if (!stream) {
+        stream = &d_tag_streams.emplace_back(tag_stream{ key, type, "" });
+    } else if (stream->type != type) {
+        stream->type = "mixed";
+    }
+
+    stream->records += (stream->records.empty()) ? "[" : ", [";
+    stream->records += std::to_string(offset) + ", " + json_value + "]";
+}
+
+} // namespace spectre
+} // namespace gr
@@ -0,0 +1,83 @@
+/*
+ * Copyright 2024-2026 Jimmy Fitzpatrick.
+ * This file is part of SPECTRE
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef INCLUDED_SPECTRE_BATCH_METADATA_H
+#define INCLUDED_SPECTRE_BATCH_METADATA_H
+
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace gr {
+namespace spectre {
+
+/*!
+ * \brief Key-value pairs describing a single batch, serialised as a flat JSON object.
+ *
+ * Keys are written in the order they were first set. Any stream tags added are grouped
+ * by key under `"tags"`, as `{"<key>": {"type": ..., "records": [[offset, value]]}}`,
+ * where each offset is relative to the start of the batch. Any batches dropped before
+ * this one are listed under `"dropped"`, as `{"nbatches": ..., "nsamples": ...,
+ * "ranges": [[start_ns, end_ns, sample_offset, nsamples]]}`.
+ */
+class batch_metadata
+{
+public:
+    void set(const std::string& key, const std::string& value);
+    void set(const std::string& key, const char* value);
+    void set(const std::string& key, double value);
+    void set(const std::string& key, int64_t value);
+    void set(const std::string& key, uint64_t value);
+    void set(const std::string& key, bool value);
+
+    // Add a stream tag attached to the sample `offset` samples into the batch. The type
+    // of each key is taken from its values, and is "mixed" if they don't agree.
+    void add_tag(const std::string& key, uint64_t offset, const std::string& value);
+    void add_tag(const std::string& key, uint64_t offset, const char* value);
+    void add_tag(const std::string& key, uint64_t offset, double value);
+    void add_tag(const std::string& key, uint64_t offset, int64_t value);
+    void add_tag(const std::string& key, uint64_t offset, bool value);
+
+    // Record a batch which was dropped rather than written, with its time range (in
+    // nanoseconds since the Unix epoch) and the absolute offset of its first sample.
+    void add_dropped(int64_t start_ns,
+                     int64_t end_ns,
+                     uint64_t sample_offset,
+                     uint64_t nsamples);
+
+    void clear();
+    bool empty() const;
+    std::string to_json() const;
+
+private:
+    struct tag_stream {
+        std::string key;
+        std::string type;
+        // The records so far, already encoded as JSON and separated by commas.
+        std::string records;
+    };
+
+    void set_raw(const std::string& key, std::string json_value);
+    void add_tag_raw(const std::string& key,
+                     const char* type,
+                     uint64_t offset,
+                     const std::string& json_value);
+
+    // Each value is stored already encoded as JSON.
+    std::vector<std::pair<std::string, std::string>> d_entries;
+    // In the order each key was first seen. There are only ever a handful of keys.
+    std::vector<tag_stream> d_tag_streams;
+    // The ranges of the dropped batches so far, encoded as for the tag records.
+    std::string d_dropped;
+    uint64_t d_ndropped_batches = 0;
+    uint64_t d_ndropped_samples = 0;
+};
+
+} // namespace spectre
+} // namespace gr
+
+#endif
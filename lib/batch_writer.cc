@@ -0,0 +1,455 @@
+/*
+ * Copyright 2024-2026 Jimmy Fitzpatrick.
+ * This file is part of SPECTRE
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "batch_writer.h"
+#include "tracer.h"
+#include "utils.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+namespace {
+
+void write_file(const std::filesystem::path& filename, const char* s, size_t num_chars)
+{
+    int fd = gr::spectre::open_creating_parents(filename,
+                                                O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC);
+    if (fd < 0) {
+        throw gr::spectre::make_system_error("Failed to open", filename);
+    }
+    try {
+        gr::spectre::write_all(fd, s, num_chars, filename);
+    } catch (...) {
+        ::close(fd);
+        throw;
+    }
+    if (::close(fd) < 0) {
+        throw gr::spectre::make_system_error("Failed to close", filename);
+    }
+}
+
+void overwrite_file(const std::filesystem::path& filename,
+                    const char* s,
+                    size_t num_chars)
+{
+    // Writing over an existing file reuses its blocks, rather than freeing them only to
+    // allocate new ones.
+    std::fstream f(filename.string(), std::ios::binary | std::ios::in | std::ios::out);
+    if (!f.is_open()) {
+        write_file(filename, s, num_chars);
+        return;
+    }
+    f.write(s, num_chars);
+    f.close();
+    if (!f) {
+        throw std::runtime_error("Failed to write: " + filename.string());
+    }
+    if (std::filesystem::file_size(filename) > num_chars) {
+        std::filesystem::resize_file(filename, num_chars);
+    }
+}
+
+void write_batch_file(const gr::spectre::batch_buffer& batch,
+                      const std::filesystem::path& filename,
+                      const char* s,
+                      size_t num_chars)
+{
+    if (batch.pool) {
+        overwrite_file(filename, s, num_chars);
+    } else {
+        write_file(filename, s, num_chars);
+    }
+}
+
+void recycle_files(const gr::spectre::batch_buffer& batch)
+{
+    std::vector<std::filesystem::path> paths = batch.data_paths;
+    for (const auto& path : { batch.tags_path, batch.metadata_path }) {
+        if (!path.empty()) {
+            paths.push_back(path);
+        }
+    }
+    const gr::spectre::batch_index_entry& entry = batch.index_entry;
+    batch.pool->acquire(paths, entry.start_ns, get_end_ns(entry));
+}
+
+std::vector<char> encode_tags(const gr::spectre::batch_buffer& batch)
+{
+    using namespace gr::spectre;
+
+    std::vector<char> out;
+    if (batch.tags_version == 1) {
+        // Interleaved (tag value, number of samples) pairs, as single precision floats.
+        out.resize(batch.tags.size() * 2 * sizeof(float));
+        float* pairs = reinterpret_cast<float*>(out.data());
+        for (const tag_record& record : batch.tags) {
+            *pairs++ = static_cast<float>(record.value);
+            *pairs++ = static_cast<float>(record.count);
+        }
+        return out;
+    }
+
+    tag_file_header header{};
+    std::memcpy(header.magic, TAG_FILE_MAGIC, sizeof(header.magic));
+    header.version = TAG_FILE_VERSION;
+    header.header_size = sizeof(tag_file_header);
+    header.record_size = sizeof(tag_record);
+    header.nrecords = batch.tags.size();
+    header.sample_rate = batch.sample_rate;
+
+    size_t nrecord_bytes = batch.tags.size() * sizeof(tag_record);
+    out.resize(sizeof(header) + nrecord_bytes);
+    std::memcpy(out.data(), &header, sizeof(header));
+    std::memcpy(out.data() + sizeof(header), batch.tags.data(), nrecord_bytes);
+    return out;
+}
+
+void record_compression_stats(gr::spectre::batch_metadata& metadata,
+                              size_t nbytes,
+                              size_t ncompressed_bytes,
+                              std::chrono::duration<double> elapsed)
+{
+    // Record how well the batch compressed, so the codec and level can be tuned.
+    double ratio = static_cast<double>(nbytes) / ncompressed_bytes;
+    metadata.set("compressed_size", static_cast<uint64_t>(ncompressed_bytes));
+    metadata.set("compression_ratio", ratio);
+    // A small batch can compress within a single tick of the clock.
+    if (elapsed.count() > 0) {
+        metadata.set("compression_throughput_mbps", nbytes / elapsed.count() / 1e6);
+    }
+}
+
+void compact_streams(gr::spectre::batch_buffer& batch)
+{
+    // Move each stream up against the one before it, so the filled data is contiguous.
+    const size_t stride = batch.data.size() / batch.nstreams;
+    const size_t nbytes_per_stream = batch.data_size / batch.nstreams;
+    for (size_t n = 1; n < batch.nstreams && nbytes_per_stream < stride; n++) {
+        std::memmove(batch.data.data() + n * nbytes_per_stream,
+                     batch.data.data() + n * stride,
+                     nbytes_per_stream);
+    }
+}
+
+void append_batch(gr::spectre::batch_buffer& batch,
+                  gr::spectre::batch_compressor* compressor)
+{
+    compact_streams(batch);
+    const char* data = batch.data.data();
+    size_t nbytes = batch.data_size;
+    if (compressor) {
+        // Compress the whole batch at once, whether or not it holds several channels.
+        using namespace std::chrono;
+        time_point<steady_clock> start = steady_clock::now();
+        nbytes = compressor->compress(data, nbytes);
+        duration<double> elapsed = steady_clock::now() - start;
+        data = compressor->output();
+        record_compression_stats(batch.metadata, batch.data_size, nbytes, elapsed);
+    }
+
+    // Untagged batches don't have any tags to append, in any format.
+    const std::vector<char> tags =
+        (batch.tags.empty()) ? std::vector<char>() : encode_tags(batch);
+    const std::string json = (batch.metadata.empty()) ? "" : batch.metadata.to_json();
+    gr::spectre::file_range range = batch.segment->append(batch.segment_path,
+                                                          batch.record,
+                                                          data,
+                                                          nbytes,
+                                                          tags.data(),
+                                                          tags.size(),
+                                                          json);
+    gr::spectre::index_batch(batch, { range });
+}
+
+} // namespace
+
+namespace gr {
+namespace spectre {
+
+batch_buffer::batch_buffer(size_t data_size)
+    : data(std::vector<char>(data_size, 0)),
+      data_size(data_size),
+      nstreams(1),
+      tags(),
+      tags_version(1),
+      sample_rate(0),
+      metadata(),
+      segment(nullptr),
+      segment_path(),
+      record(),
+      index(nullptr),
+      index_sequence(0),
+      index_entry(),
+      pool(nullptr),
+      dropped()
+{
+}
+
+void write_batch(batch_buffer& batch, batch_compressor* compressor)
+{
+    SPECTRE_TRACE_SCOPE("write_batch", batch.index_entry.sample_offset);
+    for (const dropped_batch& d : batch.dropped) {
+        batch.metadata.add_dropped(d.start_ns, d.end_ns, d.sample_offset, d.nsamples);
+    }
+
+    if (batch.segment) {
+        append_batch(batch, compressor);
+        return;
+    }
+
+    if (batch.pool) {
+        recycle_files(batch);
+    }
+
+    const size_t nfiles = batch.data_paths.size();
+    const size_t stride = (nfiles > 0) ? batch.data.size() / nfiles : 0;
+    const size_t nbytes_per_file = (nfiles > 0) ? batch.data_size / nfiles : 0;
+
+    std::vector<file_range> ranges;
+    if (!compressor) {
+        // Write everything recorded in the batch, which is usually the full buffer.
+        for (size_t n = 0; n < nfiles; n++) {
+            const char* s = batch.data.data() + n * stride;
+            write_batch_file(batch, batch.data_paths[n], s, nbytes_per_file);
+            ranges.push_back(file_range{ batch.data_paths[n], 0, nbytes_per_file });
+        }
+        write_metadata(batch);
+        index_batch(batch, ranges);
+        return;
+    }
+
+    using namespace std::chrono;
+    duration<double> elapsed{ 0 };
+    size_t ncompressed_bytes = 0;
+    for (size_t n = 0; n < nfiles; n++) {
+        const char* s = batch.data.data() + n * stride;
+        time_point<steady_clock> start = steady_clock::now();
+        size_t nbytes = compressor->compress(s, nbytes_per_file);
+        elapsed += steady_clock::now() - start;
+        write_batch_file(batch, batch.data_paths[n], compressor->output(), nbytes);
+        ranges.push_back(file_range{ batch.data_paths[n], 0, nbytes });
+        ncompressed_bytes += nbytes;
+    }
+
+    record_compression_stats(batch.metadata, batch.data_size, ncompressed_bytes, elapsed);
+    write_metadata(batch);
+    index_batch(batch, ranges);
+}
+
+void index_batch(const batch_buffer& batch,
+                 const std::vector<file_range>& ranges)
+{
+    if (batch.index) {
+        batch_index_entry entry = batch.index_entry;
+        entry.ntags = batch.tags.size();
+        batch.index->add(batch.index_sequence, entry, ranges);
+    }
+}
+
+void write_metadata(const batch_buffer& batch)
+{
+    if (!batch.tags_path.empty()) {
+        const std::vector<char> tags = encode_tags(batch);
+        write_batch_file(batch, batch.tags_path, tags.data(), tags.size());
+    }
+
+    if (!batch.metadata_path.empty()) {
+        const std::string json = batch.metadata.to_json();
+        write_batch_file(batch, batch.metadata_path, json.data(), json.size());
+    }
+}
+
+backpressure_policy get_backpressure_policy(const std::string& name)
+{
+    if (name == "block") {
+        return backpressure_policy::block;
+    }
+    if (name == "drop_newest") {
+        return backpressure_policy::drop_newest;
+    }
+    if (name == "drop_oldest") {
+        return backpressure_policy::drop_oldest;
+    }
+    throw std::invalid_argument("Unexpected backpressure policy: " + name);
+}
+
+batch_writer::batch_writer(size_t queue_depth,
+                           size_t data_size,
+                           size_t num_threads,
+                           compressor_factory make_compressor,
+                           backpressure_policy policy,
+                           latency_histogram* write_latency)
+    : d_queue_depth(queue_depth),
+      d_policy(policy),
+      d_write_latency(write_latency),
+      d_stopping(false),
+      d_make_compressor(make_compressor)
+{
+    // Allocate every buffer up front, so nothing is allocated while the flowgraph runs.
+    for (size_t n = 0; n < queue_depth; n++) {
+        d_empty_buffers.push_back(std::make_unique<batch_buffer>(data_size));
+    }
+    for (size_t n = 0; n < num_threads; n++) {
+        d_threads.emplace_back(&batch_writer::run, this);
+    }
+}
+
+batch_writer::~batch_writer()
+{
+    try {
+        stop();
+    } catch (...) {
+        // Errors are reported by `submit` and `stop`, there's no one left to tell here.
+    }
+}
+
+std::unique_ptr<batch_buffer> batch_writer::submit(std::unique_ptr<batch_buffer> batch)
+{
+    std::unique_lock<std::mutex> lock(d_mutex);
+    if (d_error) {
+        std::rethrow_exception(d_error);
+    }
+
+    // Rather than block, make room by dropping a batch. If every other batch is already
+    // being written, the only one left to drop is the full one.
+    std::unique_ptr<batch_buffer> dropped;
+    if (d_empty_buffers.empty() && d_policy != backpressure_policy::block) {
+        if (d_policy == backpressure_policy::drop_oldest && !d_full_buffers.empty()) {
+            dropped = std::move(d_full_buffers.front());
+            d_full_buffers.pop_front();
+        } else {
+            dropped = std::move(batch);
+        }
+        // Keep hold of any batches it was carrying, so they're recorded by the next one.
+        d_unrecorded.insert(
+            d_unrecorded.end(), dropped->dropped.begin(), dropped->dropped.end());
+        dropped->dropped.clear();
+
+        const batch_index_entry& entry = dropped->index_entry;
+        dropped_batch d{
+            entry.start_ns, get_end_ns(entry), entry.sample_offset, entry.nsamples
+        };
+        d_unrecorded.push_back(d);
+        d_untaken.push_back(d);
+    }
+
+    if (batch) {
+        batch->dropped.swap(d_unrecorded);
+        d_full_buffers.push_back(std::move(batch));
+        d_queued.notify_one();
+    }
+
+    if (dropped) {
+        // Don't hold up the index waiting for a batch which will never be written.
+        lock.unlock();
+        index_batch(*dropped, {});
+        return dropped;
+    }
+
+    // Block until the writer thread has an empty buffer to give back.
+    d_freed.wait(lock, [this] { return !d_empty_buffers.empty() || d_error; });
+    if (d_error) {
+        std::rethrow_exception(d_error);
+    }
+    std::unique_ptr<batch_buffer> empty = std::move(d_empty_buffers.back());
+    d_empty_buffers.pop_back();
+    return empty;
+}
+
+size_t batch_writer::pending()
+{
+    // Every buffer which isn't empty is either queued, or being written.
+    std::lock_guard<std::mutex> lock(d_mutex);
+    return d_queue_depth - d_empty_buffers.size();
+}
+
+void batch_writer::take_dropped(std::vector<dropped_batch>& dropped)
+{
+    std::lock_guard<std::mutex> lock(d_mutex);
+    dropped.insert(dropped.end(), d_untaken.begin(), d_untaken.end());
+    d_untaken.clear();
+}
+
+void batch_writer::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(d_mutex);
+        d_stopping = true;
+    }
+    d_queued.notify_all();
+    for (auto& thread : d_threads) {
+        if (thread.joinable()) {
+            thread.join();
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(d_mutex);
+    if (d_error) {
+        std::rethrow_exception(d_error);
+    }
+}
+
+void batch_writer::run()
+{
+    std::unique_ptr<batch_compressor> compressor;
+    std::exception_ptr setup_error;
+    try {
+        if (d_make_compressor) {
+            compressor = d_make_compressor();
+        }
+    } catch (...) {
+        setup_error = std::current_exception();
+    }
+
+    std::unique_lock<std::mutex> lock(d_mutex);
+    if (setup_error) {
+        // Leave the queued batches to the other threads, if there are any left.
+        d_error = (d_error) ? d_error : setup_error;
+        d_freed.notify_one();
+        return;
+    }
+    while (true) {
+        d_queued.wait(lock, [this] { return !d_full_buffers.empty() || d_stopping; });
+
+        // Only stop once every queued batch has been written.
+        if (d_full_buffers.empty()) {
+            return;
+        }
+        std::unique_ptr<batch_buffer> batch = std::move(d_full_buffers.front());
+        d_full_buffers.pop_front();
+
+        // Don't hold the lock while writing, so the caller can keep queueing batches.
+        lock.unlock();
+        std::exception_ptr error;
+        // The clock is only read if the latency is recorded.
+        std::chrono::steady_clock::time_point start;
+        if (d_write_latency) {
+            start = std::chrono::steady_clock::now();
+        }
+        try {
+            write_batch(*batch, compressor.get());
+        } catch (...) {
+            error = std::current_exception();
+        }
+        if (d_write_latency) {
+            d_write_latency->record(std::chrono::steady_clock::now() - start);
+        }
+        lock.lock();
+
+        if (error && !d_error) {
+            d_error = error;
+        }
+        batch->dropped.clear();
+        d_empty_buffers.push_back(std::move(batch));
+        d_freed.notify_one();
+    }
+}
+
+} // namespace spectre
+} // namespace gr
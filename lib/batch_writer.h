@@ -0,0 +1,209 @@
+/*
+ * Copyright 2024-2026 Jimmy Fitzpatrick.
+ * This file is part of SPECTRE
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef INCLUDED_SPECTRE_BATCH_WRITER_H
+#define INCLUDED_SPECTRE_BATCH_WRITER_H
+
+#include "batch_compressor.h"
+#include "batch_index_writer.h"
+#include "batch_metadata.h"
+#include "block_stats.h"
+#include "file_pool.h"
+#include "segment_writer.h"
+#include <gnuradio/spectre/tag_file.h>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace gr {
+namespace spectre {
+
+/*!
+ * \brief A batch which was dropped, rather than written, because the queue was full.
+ */
+struct dropped_batch {
+    // Nanoseconds since the Unix epoch.
+    int64_t start_ns;
+    int64_t end_ns;
+    // The absolute offset of the first sample in the batch.
+    uint64_t sample_offset;
+    uint64_t nsamples;
+};
+
+/*!
+ * \brief Holds the data, tags and metadata for a single batch, along with where they
+ * belong.
+ */
+struct batch_buffer {
+    batch_buffer(size_t data_size);
+
+    std::vector<std::filesystem::path> data_paths;
+    std::filesystem::path tags_path;
+    // The data buffer is split evenly between each stream (one per data file, or per
+    // channel in a segment), in order. If the batch was cut short, only the first
+    // `data_size / nstreams` bytes of each stream are filled.
+    std::vector<char> data;
+    size_t data_size;
+    size_t nstreams;
+    // One record per run of samples with the same tag value. It only grows as tags
+    // arrive, and keeps its capacity when cleared so it can be reused for the next batch.
+    std::vector<tag_record> tags;
+    // The version of the `.hdr` format the tags are written in, and the sample rate
+    // recorded in its header.
+    uint16_t tags_version;
+    double sample_rate;
+
+    std::filesystem::path metadata_path;
+    batch_metadata metadata;
+
+    // Only set in container mode, in which case the data, tags and metadata are
+    // appended to a segment instead of written to their own files. The segment path is
+    // only used if this batch starts a new segment.
+    segment_writer* segment;
+    std::filesystem::path segment_path;
+    segment_record_header record;
+
+    // Only set if the batch is added to an index once it's written. The sequence
+    // number orders batches which are written out of order.
+    batch_index_writer* index;
+    uint64_t index_sequence;
+    batch_index_entry index_entry;
+
+    // Only set if the number of batches on disk is capped, in which case the files of
+    // the oldest batch are recycled for this one. The time range of the batch is taken
+    // from the index entry, which is always filled in.
+    file_pool* pool;
+
+    // The batches dropped since the last one was queued, which are added to the metadata
+    // of this one when it's written.
+    std::vector<dropped_batch> dropped;
+};
+
+/*!
+ * \brief Write a full batch to file, creating any missing parent directories.
+ *
+ * If the batch belongs to a segment, it's appended as a single record. Otherwise, the
+ * tags and metadata are only written if their paths are non-empty. If the batch belongs
+ * to a pool, its files are recycled from the oldest batch in the pool and overwritten in
+ * place. If a compressor is provided, the data is compressed first, and the compression
+ * statistics are added to the metadata, along with any batches dropped before this one.
+ */
+void write_batch(batch_buffer& batch, batch_compressor* compressor = nullptr);
+
+/*!
+ * \brief Write only the tags and metadata for a batch to file, if their paths are
+ * non-empty.
+ */
+void write_metadata(const batch_buffer& batch);
+
+/*!
+ * \brief Add a written batch to its index, if it has one.
+ */
+void index_batch(const batch_buffer& batch, const std::vector<file_range>& ranges);
+
+/*!
+ * \brief Makes a new compressor, for each writer thread to use independently.
+ */
+using compressor_factory = std::function<std::unique_ptr<batch_compressor>()>;
+
+/*!
+ * \brief What to do with a full batch when every buffer in the queue is in use.
+ */
+enum class backpressure_policy {
+    // Wait for a writer thread to free up a buffer.
+    block,
+    // Drop the full batch, and reuse its buffer for the next one.
+    drop_newest,
+    // Drop the oldest batch still waiting in the queue, to make room for the full batch.
+    drop_oldest,
+};
+
+backpressure_policy get_backpressure_policy(const std::string& name);
+
+/*!
+ * \brief Writes full batches to file on a pool of dedicated threads.
+ *
+ * Batches are exchanged through a bounded queue of pre-allocated buffers, so that the
+ * caller only has to swap a full buffer for an empty one. If the queue is full, the
+ * caller either blocks until a writer thread frees up a buffer, or a batch is dropped,
+ * depending on the backpressure policy. Dropped batches are skipped in the index, and
+ * recorded in the metadata of the next batch to be queued.
+ */
+class batch_writer
+{
+public:
+    /*!
+     * \param queue_depth The number of pre-allocated buffers in the queue.
+     * \param data_size The size of the data buffer in each batch, in bytes.
+     * \param num_threads The number of writer threads, each writing one batch at a time.
+     * \param make_compressor If set, each thread compresses batches before writing them.
+     * \param policy What to do with a full batch when the queue is full.
+     * \param write_latency If set, how long each batch takes to write is recorded here.
+     */
+    batch_writer(size_t queue_depth,
+                 size_t data_size,
+                 size_t num_threads = 1,
+                 compressor_factory make_compressor = nullptr,
+                 backpressure_policy policy = backpressure_policy::block,
+                 latency_histogram* write_latency = nullptr);
+    ~batch_writer();
+
+    /*!
+     * \brief Queue a full batch to be written, and return an empty one to fill.
+     *
+     * Rethrows the first error raised by a writer thread, if any.
+     */
+    std::unique_ptr<batch_buffer> submit(std::unique_ptr<batch_buffer> batch);
+
+    /*!
+     * \brief The number of batches which are queued or being written.
+     */
+    size_t pending();
+
+    /*!
+     * \brief Move the batches dropped since the last call onto the end of `dropped`.
+     */
+    void take_dropped(std::vector<dropped_batch>& dropped);
+
+    /*!
+     * \brief Write all queued batches, then stop the writer threads.
+     *
+     * Rethrows the first error raised by a writer thread, if any.
+     */
+    void stop();
+
+private:
+    void run();
+
+    const size_t d_queue_depth;
+    const backpressure_policy d_policy;
+    latency_histogram* const d_write_latency;
+    std::mutex d_mutex;
+    std::condition_variable d_queued;
+    std::condition_variable d_freed;
+    std::deque<std::unique_ptr<batch_buffer>> d_full_buffers;
+    std::vector<std::unique_ptr<batch_buffer>> d_empty_buffers;
+    // Dropped batches waiting to be recorded in the next batch queued, and to be taken by
+    // the caller.
+    std::vector<dropped_batch> d_unrecorded;
+    std::vector<dropped_batch> d_untaken;
+    bool d_stopping;
+    std::exception_ptr d_error;
+    compressor_factory d_make_compressor;
+    std::vector<std::thread> d_threads;
+};
+
+} // namespace spectre
+} // namespace gr
+
+#endif
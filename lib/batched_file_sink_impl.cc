@@ -5,19 +5,101 @@
  */
 
 #include "batched_file_sink_impl.h"
+#include "tracer.h"
 #include "utils.h"
 
+#include <volk/volk.h>
 #include <algorithm>
 #include <chrono>
+#include <cmath>
 #include <filesystem>
-#include <iomanip>
 #include <iostream>
+#include <limits>
 #include <optional>
 
 namespace {
 
-static constexpr int NUM_DIGITS_MICROSECONDS = 6;
 static constexpr int INPUT_PORT = 0;
+static const pmt::pmt_t RX_TIME_KEY = pmt::string_to_symbol("rx_time");
+static const pmt::pmt_t TRIGGER_PORT = pmt::string_to_symbol("trigger");
+static const pmt::pmt_t DROPPED_PORT = pmt::string_to_symbol("dropped");
+static const pmt::pmt_t COMMAND_PORT = pmt::string_to_symbol("command");
+static const pmt::pmt_t STATS_PORT = pmt::string_to_symbol("stats");
+
+// The stats kept for each sink, indexing the names below.
+enum sink_counter {
+    NITEMS = 0,
+    NBYTES,
+    NWORK_CALLS,
+    WORK_TIME_NS,
+    NTAGS,
+    NBATCHES,
+    QUEUE_OCCUPANCY,
+    NDROPPED_SAMPLES,
+};
+enum sink_histogram {
+    OPEN_LATENCY = 0,
+    FLUSH_LATENCY,
+    WRITE_LATENCY,
+};
+static const std::vector<std::string> COUNTER_NAMES{
+    "items", "bytes",   "work_calls",      "work_time_ns",
+    "tags",  "batches", "queue_occupancy", "dropped_samples"
+};
+static const std::vector<std::string> COUNTER_UNITS{
+    "items", "bytes", "calls", "ns", "tags", "batches", "batches", "samples"
+};
+static const std::vector<std::string> HISTOGRAM_NAMES{ "open_latency",
+                                                       "flush_latency",
+                                                       "write_latency" };
+
+// In triggered mode, the most samples taken from the input in one go, on top of the
+// pre-trigger samples held back in the ring.
+static constexpr size_t RING_HEADROOM = 1 << 16;
+
+// Space on disk is allocated a block at a time.
+static constexpr size_t DISK_BLOCK_SIZE = 4096;
+
+std::vector<pmt::pmt_t> get_tag_symbols(const std::vector<std::string>& keys)
+{
+    std::vector<pmt::pmt_t> symbols;
+    for (const std::string& key : keys) {
+        symbols.push_back(pmt::string_to_symbol(key));
+    }
+    return symbols;
+}
+
+void add_tag_to_metadata(gr::spectre::batch_metadata& metadata,
+                         const std::string& key,
+                         uint64_t offset,
+                         const pmt::pmt_t& value)
+{
+    // Keep the type of the value, where JSON has an equivalent.
+    if (pmt::is_bool(value)) {
+        metadata.add_tag(key, offset, pmt::to_bool(value));
+    } else if (pmt::is_integer(value)) {
+        metadata.add_tag(key, offset, static_cast<int64_t>(pmt::to_long(value)));
+    } else if (pmt::is_uint64(value)) {
+        metadata.add_tag(key, offset, static_cast<int64_t>(pmt::to_uint64(value)));
+    } else if (pmt::is_real(value)) {
+        metadata.add_tag(key, offset, pmt::to_double(value));
+    } else if (pmt::is_symbol(value)) {
+        metadata.add_tag(key, offset, pmt::symbol_to_string(value));
+    } else {
+        metadata.add_tag(key, offset, pmt::write_string(value));
+    }
+}
+
+int64_t get_unix_time_ns(const gr::spectre::batch_time& time)
+{
+    return time.unix_s * 1000000000 + static_cast<int64_t>(time.us) * 1000;
+}
+
+double get_trigger_power(const float threshold_db)
+{
+    // The threshold is in dB relative to a full-scale sample, with magnitude one.
+    return std::pow(10.0, threshold_db / 10.0);
+}
 
 int get_num_samples_per_batch(const float batch_size, const float sample_rate)
 {
@@ -27,21 +109,145 @@ int get_num_samples_per_batch(const float batch_size, const float sample_rate)
     return std::floor(batch_size * sample_rate);
 }
 
+size_t get_nblocks(const size_t nbytes)
+{
+    return (nbytes + DISK_BLOCK_SIZE - 1) / DISK_BLOCK_SIZE;
+}
+
+size_t get_sizeof_data_buffer(const gr::spectre::write_mode mode,
+                              const int nsamples_per_batch,
+                              const int num_inputs,
+                              const size_t sizeof_output_item)
+{
+    // Only the buffered write mode holds the whole batch in memory.
+    return (mode == gr::spectre::write_mode::buffered)
+               ? nsamples_per_batch * num_inputs * sizeof_output_item
+               : 0;
+}
+
+std::string get_data_extension(const std::string& output_type,
+                               const std::string& compression)
+{
+    return (compression == "none")
+               ? output_type
+               : output_type + "." +
+                     gr::spectre::batch_compressor::get_extension(compression);
+}
+
+std::vector<std::string> get_stream_tags(const std::string& tag, int nstreams)
+{
+    // Only distinguish the files by input if there's more than one.
+    if (nstreams == 1) {
+        return { tag };
+    }
+    std::vector<std::string> tags;
+    for (int n = 0; n < nstreams; n++) {
+        tags.push_back(tag + "_ch" + std::to_string(n));
+    }
+    return tags;
+}
+
+std::vector<std::string> get_dirs(const std::string& dir,
+                                  const std::vector<std::string>& stripe_dirs)
+{
+    std::vector<std::string> dirs{ dir };
+    dirs.insert(dirs.end(), stripe_dirs.begin(), stripe_dirs.end());
+    return dirs;
+}
+
+std::string get_output_type(const std::string& input_type, const std::string& output_type)
+{
+    return (output_type.empty()) ? input_type : output_type;
+}
+
+float get_scale(const float scale, const std::string& output_type)
+{
+    if (scale < 0) {
+        throw std::invalid_argument("The scale must be non-negative.");
+    }
+    if (scale > 0) {
+        return scale;
+    }
+    if (output_type == "sc16") {
+        return std::numeric_limits<int16_t>::max();
+    }
+    if (output_type == "sc8") {
+        return std::numeric_limits<int8_t>::max();
+    }
+    return 1.0;
+}
+
 std::filesystem::path generate_file_path(const std::string& dir,
+                                         const std::string& timestamp,
                                          const std::string& tag,
-                                         const std::string& extension,
-                                         const bool group_by_date,
-                                         std::tm utc_tm,
-                                         int us)
+                                         const std::string& extension)
 {
-    // Make the file path, using date-based subdirectories if it's required.
-    std::ostringstream buffer;
-    std::string fmt = (group_by_date) ? "%Y/%m/%d/" : "";
-    buffer << std::put_time(&utc_tm, fmt.data())
-           << std::put_time(&utc_tm, "%Y-%m-%dT%H:%M:%S.")
-           << std::setw(NUM_DIGITS_MICROSECONDS) << std::setfill('0') << us << "Z_" << tag
-           << "." << extension;
-    return dir / std::filesystem::path(buffer.str());
+    // The timestamp includes any date-based subdirectories.
+    std::string filename;
+    filename.reserve(timestamp.size() + tag.size() + extension.size() + 2);
+    filename.append(timestamp).append("_").append(tag).append(".").append(extension);
+    return std::filesystem::path(dir) / filename;
+}
+
+gr::spectre::stripe_policy get_stripe_policy(const std::string& name)
+{
+    if (name == "round_robin") {
+        return gr::spectre::stripe_policy::round_robin;
+    }
+    if (name == "least_loaded") {
+        return gr::spectre::stripe_policy::least_loaded;
+    }
+    throw std::invalid_argument("Unsupported stripe policy: " + name);
+}
+
+gr::spectre::batch_boundary get_batch_boundary(const std::string& name)
+{
+    if (name == "size") {
+        return gr::spectre::batch_boundary::size;
+    }
+    if (name == "tag") {
+        return gr::spectre::batch_boundary::tag;
+    }
+    if (name == "wrap") {
+        return gr::spectre::batch_boundary::wrap;
+    }
+    throw std::invalid_argument("Unsupported batch boundary: " + name);
+}
+
+gr::spectre::capture_mode get_capture_mode(const std::string& name)
+{
+    if (name == "continuous") {
+        return gr::spectre::capture_mode::continuous;
+    }
+    if (name == "triggered") {
+        return gr::spectre::capture_mode::triggered;
+    }
+    throw std::invalid_argument("Unsupported capture mode: " + name);
+}
+
+gr::spectre::trigger_source get_trigger_source(const std::string& name)
+{
+    if (name == "message") {
+        return gr::spectre::trigger_source::message;
+    }
+    if (name == "power") {
+        return gr::spectre::trigger_source::power;
+    }
+    throw std::invalid_argument("Unsupported trigger source: " + name);
+}
+
+void stop_resources(gr::spectre::sink_resources& resources)
+{
+    // Wait for any batches still queued, before closing what they're written to.
+    for (auto& writer : resources.writers) {
+        writer->stop();
+    }
+    for (auto& segment_writer : resources.segment_writers) {
+        segment_writer->close();
+    }
+    for (auto& index_writer : resources.index_writers) {
+        index_writer->close();
+    }
 }
 
 } // namespace
@@ -50,15 +256,17 @@ namespace gr {
 namespace spectre {
 
 
-batched_file_sink::sptr batched_file_sink::make(const std::string& dir,
-                                                const std::string& tag,
-                                                const std::string& input_type,
-                                                const float batch_size,
-                                                const float sample_rate,
-                                                const bool group_by_date,
-                                                const bool is_tagged,
-                                                const std::string& tag_key,
-                                                const float initial_tag_value)
+batched_file_sink::sptr
+batched_file_sink::make(const std::string& dir,
+                        const std::string& tag,
+                        const std::string& input_type,
+                        const float batch_size,
+                        const float sample_rate,
+                        const bool group_by_date,
+                        const bool is_tagged,
+                        const std::string& tag_key,
+                        const float initial_tag_value,
+                        const batched_file_sink_options& options)
 {
     return gnuradio::make_block_sptr<batched_file_sink_impl>(dir,
                                                              tag,
@@ -68,155 +276,1084 @@ batched_file_sink::sptr batched_file_sink::make(const std::string& dir,
                                                              group_by_date,
                                                              is_tagged,
                                                              tag_key,
-                                                             initial_tag_value);
+                                                             initial_tag_value,
+                                                             options);
 };
 
 
-batched_file_sink_impl::batched_file_sink_impl(const std::string& dir,
-                                               const std::string& tag,
-                                               const std::string& input_type,
-                                               const float batch_size,
-                                               const float sample_rate,
-                                               const bool group_by_date,
-                                               const bool is_tagged,
-                                               const std::string& tag_key,
-                                               const float initial_tag_value)
-    : gr::sync_block("batched_file_sink",
-                     gr::io_signature::make(1, 1, get_sizeof_stream_item(input_type)),
-                     gr::io_signature::make(0, 0, 0)),
-      d_dir(dir),
+batched_file_sink_impl::batched_file_sink_impl(
+    const std::string& dir,
+    const std::string& tag,
+    const std::string& input_type,
+    const float batch_size,
+    const float sample_rate,
+    const bool group_by_date,
+    const bool is_tagged,
+    const std::string& tag_key,
+    const float initial_tag_value,
+    const batched_file_sink_options& options)
+    : gr::sync_block(
+          "batched_file_sink",
+          gr::io_signature::make(options.num_inputs,
+                                 options.num_inputs,
+                                 get_sizeof_stream_item(input_type)),
+          gr::io_signature::make(0, 0, 0)),
+      d_dirs(get_dirs(dir, options.stripe_dirs)),
+      d_stripe_policy(get_stripe_policy(options.stripe_policy)),
       d_tag(tag),
       d_input_type(input_type),
+      d_output_type(get_output_type(input_type, options.output_type)),
       d_sizeof_stream_item(get_sizeof_stream_item(input_type)),
+      d_sizeof_output_item(get_sizeof_stream_item(d_output_type)),
+      d_sample_rate(sample_rate),
       d_nsamples_per_batch(get_num_samples_per_batch(batch_size, sample_rate)),
+      d_num_inputs(options.num_inputs),
+      d_interleave(options.interleave && options.num_inputs > 1),
+      d_nstreams((d_interleave) ? 1 : options.num_inputs),
+      d_nitems_per_stream(static_cast<size_t>(d_nsamples_per_batch) *
+                          options.num_inputs / d_nstreams),
       d_is_tagged(is_tagged),
       d_group_by_date(group_by_date),
       d_tag_key(pmt::string_to_symbol(tag_key)),
       d_initial_tag_value(initial_tag_value),
-      d_batch_time(batch_time{ std::tm{}, 0 }),
+      d_queue_depth(options.queue_depth),
+      d_backpressure(get_backpressure_policy(options.backpressure)),
+      d_write_mode(get_write_mode(options.write_mode)),
+      d_scale(get_scale(options.scale, d_output_type)),
+      d_converter(get_sample_converter(input_type, d_output_type)),
+      d_compression(options.compression),
+      d_compression_level(options.compression_level),
+      d_data_extension(get_data_extension(d_output_type, options.compression)),
+      d_stream_tags(get_stream_tags(tag, d_nstreams)),
+      d_segment_size(static_cast<uint64_t>(options.segment_size * (1 << 20))),
+      d_segment_duration(options.segment_duration),
+      d_write_index(options.write_index),
+      d_use_rx_time(options.use_rx_time),
+      d_hdr_version(options.hdr_version),
+      d_metadata_tag_keys(options.metadata_tag_keys),
+      d_metadata_tag_symbols(get_tag_symbols(options.metadata_tag_keys)),
+      d_batch_boundary(get_batch_boundary(options.batch_boundary)),
+      d_boundaries_per_batch(options.boundaries_per_batch),
+      d_capture_mode(get_capture_mode(options.capture_mode)),
+      d_trigger_source(get_trigger_source(options.trigger_source)),
+      d_trigger_power(get_trigger_power(options.trigger_threshold)),
+      d_npretrigger(static_cast<size_t>(
+          std::floor(std::max(0.0f, options.pre_trigger) * sample_rate))),
+      d_pending_settings(),
+      d_retiring(),
+      d_read_offset(0),
+      d_batch_time(batch_time{ 0, 0 }),
+      d_time_reference(),
+      d_timestamp_formatter(group_by_date),
       d_buffer_state(buffer_state::EMPTY),
       d_nbuffered_samples(0),
-      d_data_buffer(std::vector<char>(d_nsamples_per_batch * d_sizeof_stream_item, 0)),
-      d_fdata(nullptr),
-      d_nbuffered_tags(0),
-      // The `d_tags_buffer` is generously sized to handle the maximum possible number of
-      // tags (one per sample), but the actual number of tags per batch may vary due to
-      // the nature of the GNU Radio runtime. So practically, it's unlikely this will ever
-      // fill entirely.
-      d_tags_buffer(std::vector<float>(d_nsamples_per_batch * 2, 0)),
-      d_ftags(nullptr),
-      d_active_tag()
+      d_batch(std::make_unique<batch_buffer>(
+          get_sizeof_data_buffer(d_write_mode,
+                                 d_nsamples_per_batch,
+                                 options.num_inputs,
+                                 d_sizeof_output_item))),
+      d_active_tag(),
+      d_tags(),
+      d_nboundaries(0),
+      d_next_boundary_check(0),
+      d_last_boundary_value(),
+      d_active_dir(0),
+      d_next_dir(0),
+      d_writers(),
+      d_dropped(),
+      d_ndropped_batches(0),
+      d_ndropped_samples(0),
+      d_stats(COUNTER_NAMES, HISTOGRAM_NAMES, options.stats_interval),
+      d_index_writers(),
+      d_nindexed_batches(),
+      d_file_pools(),
+      d_sample_offset(0),
+      d_ring(options.num_inputs,
+             get_sizeof_stream_item(input_type),
+             (d_capture_mode == capture_mode::triggered) ? d_npretrigger + RING_HEADROOM
+                                                          : 0),
+      d_ring_items(),
+      d_ring_tags(),
+      d_capture_starts(),
+      d_next_capture_offset(0),
+      d_trigger_requested(false),
+      d_power_buffer(),
+      d_segment_writers(),
+      d_compressor(nullptr),
+      d_stream_writers(),
+      d_conversion_buffer(),
+      d_interleave_buffer()
+{
+    if (d_queue_depth < 0) {
+        throw std::invalid_argument("The queue depth must be non-negative.");
+    }
+
+    if (d_num_inputs < 1) {
+        throw std::invalid_argument("There must be at least one input.");
+    }
+
+    if (d_hdr_version != 1 && d_hdr_version != 2) {
+        throw std::invalid_argument("Unsupported .hdr version: " +
+                                    std::to_string(d_hdr_version));
+    }
+
+    if (d_boundaries_per_batch < 1) {
+        throw std::invalid_argument("There must be at least one boundary per batch.");
+    }
+
+    if (d_capture_mode == capture_mode::triggered) {
+        if (d_trigger_source == trigger_source::power && d_input_type != "fc32") {
+            throw std::invalid_argument(
+                "The power trigger only supports fc32 samples.");
+        }
+        if (options.pre_trigger < 0 ||
+            d_npretrigger >= static_cast<size_t>(d_nsamples_per_batch)) {
+            throw std::invalid_argument("The pre-trigger duration must be non-negative, "
+                                        "and shorter than a batch.");
+        }
+        if (splits_on_tags()) {
+            throw std::invalid_argument(
+                "Triggered capture doesn't support splitting batches on tags.");
+        }
+    }
+
+    // Any message triggers a capture, whatever it holds.
+    message_port_register_in(TRIGGER_PORT);
+    set_msg_handler(TRIGGER_PORT,
+                    [this](const pmt::pmt_t&) { d_trigger_requested = true; });
+
+    if (d_backpressure != backpressure_policy::block &&
+        (d_write_mode != write_mode::buffered || d_queue_depth == 0)) {
+        throw std::invalid_argument("Batches can only be dropped from the queue, in the "
+                                    "buffered write mode.");
+    }
+
+    // Each dropped batch is published as it's dropped.
+    message_port_register_out(DROPPED_PORT);
+
+    message_port_register_out(STATS_PORT);
+
+    message_port_register_in(COMMAND_PORT);
+    set_msg_handler(COMMAND_PORT,
+                    [this](const pmt::pmt_t& msg) { handle_command(msg); });
+
+    if (d_write_mode != write_mode::buffered) {
+        if (d_queue_depth > 0 && d_write_mode != write_mode::direct) {
+            throw std::invalid_argument(
+                "A queue is only supported by the buffered and direct write modes.");
+        }
+        for (int n = 0; n < d_nstreams; n++) {
+            d_stream_writers.push_back(
+                make_stream_writer(d_write_mode, options.sync_on_close, d_queue_depth));
+        }
+    }
+
+    if (options.segment_size < 0 || options.segment_duration < 0) {
+        throw std::invalid_argument(
+            "The segment size and duration must be non-negative.");
+    }
+
+    if (is_segmented()) {
+        if (d_write_mode != write_mode::buffered) {
+            throw std::invalid_argument(
+                "Container mode is only supported by the buffered write mode.");
+        }
+        d_segment_writers = make_segment_writers();
+    }
+
+    if (d_write_index) {
+        d_index_writers = make_index_writers(d_dirs, d_tag);
+        d_nindexed_batches.resize(d_dirs.size(), 0);
+    }
+
+    if (options.disk_quota < 0) {
+        throw std::invalid_argument("The disk quota must be non-negative.");
+    }
+
+    if (options.disk_quota > 0) {
+        if (d_write_mode != write_mode::buffered || is_segmented()) {
+            throw std::invalid_argument("A disk quota is only supported by the buffered "
+                                        "write mode, outside of container mode.");
+        }
+        // The index would keep growing, and point at batches which have been recycled.
+        if (d_write_index) {
+            throw std::invalid_argument("A disk quota can't be used with an index.");
+        }
+        // Split the quota evenly between the directories, counting each batch at its
+        // full, uncompressed size. Every file takes up whole blocks on disk, and the
+        // metadata and tags files are expected to fit in a single block each.
+        size_t nbytes_per_file = d_nitems_per_stream * d_sizeof_output_item;
+        double nbytes_per_batch =
+            (d_nstreams * get_nblocks(nbytes_per_file) + 2) * DISK_BLOCK_SIZE;
+        size_t nslots = static_cast<size_t>(options.disk_quota * (1 << 30) /
+                                            d_dirs.size() / nbytes_per_batch);
+        if (nslots == 0) {
+            throw std::invalid_argument("The disk quota is smaller than a single batch.");
+        }
+        for (const std::string& dir : d_dirs) {
+            d_file_pools.push_back(std::make_unique<file_pool>(
+                std::filesystem::path(dir) / (d_tag + ".pool"),
+                nslots,
+                d_nstreams,
+                nbytes_per_file));
+        }
+    }
+
+    if (is_compressed()) {
+        if (d_write_mode != write_mode::buffered) {
+            throw std::invalid_argument(
+                "Compression is only supported by the buffered write mode.");
+        }
+        batch_compressor::check_codec(d_compression);
+        if (d_queue_depth == 0) {
+            d_compressor = make_compressor();
+        }
+    }
+}
+
+batched_file_sink_impl::~batched_file_sink_impl()
 {
+    // Don't leave anything running on another thread, which might still use the block.
+    if (d_pending_settings && d_pending_settings->resources.valid()) {
+        d_pending_settings->resources.wait();
+    }
+    for (const auto& retiring : d_retiring) {
+        retiring.wait();
+    }
 }
 
-batched_file_sink_impl::~batched_file_sink_impl() { close_fstreams(); }
+bool batched_file_sink_impl::start()
+{
+    d_time_reference.reset();
+    d_sample_offset = 0;
+    d_nboundaries = 0;
+    d_next_boundary_check = 0;
+    d_last_boundary_value.reset();
+    d_ring.clear();
+    d_ring_tags.clear();
+    d_capture_starts.clear();
+    d_next_capture_offset = 0;
+    d_trigger_requested = false;
+    std::fill(d_nindexed_batches.begin(), d_nindexed_batches.end(), 0);
+    d_ndropped_batches = 0;
+    d_ndropped_samples = 0;
+
+    if (d_queue_depth > 0 && d_write_mode == write_mode::buffered) {
+        d_writers = make_writers(d_batch->data.size());
+    }
+    // Allocate the whole pool up front, rather than as the first batches are written.
+    for (auto& pool : d_file_pools) {
+        pool->open();
+    }
+    // Settings which were pending when the flowgraph stopped need new writers.
+    if (d_pending_settings && !d_pending_settings->resources.valid()) {
+        sink_settings settings = d_pending_settings->settings;
+        prepare_settings(settings);
+    }
+    return true;
+}
+
+std::vector<std::unique_ptr<batch_writer>>
+batched_file_sink_impl::make_writers(size_t data_size)
+{
+    // Give each directory its own writer, so that the disks are written in parallel.
+    std::vector<std::unique_ptr<batch_writer>> writers;
+    for (size_t n = 0; n < d_dirs.size(); n++) {
+        // Compressing is slow enough that it's worth spreading batches over several
+        // threads. Otherwise, we'd only have the threads contending for the disk.
+        // Records are appended to segments in order, so there's only one thread
+        // per segment in container mode.
+        if (is_compressed()) {
+            size_t num_threads = (is_segmented()) ? 1 : d_queue_depth;
+            writers.push_back(std::make_unique<batch_writer>(
+                d_queue_depth,
+                data_size,
+                num_threads,
+                [this]() { return make_compressor(); },
+                d_backpressure,
+                d_stats.histogram(WRITE_LATENCY)));
+        } else {
+            writers.push_back(
+                std::make_unique<batch_writer>(d_queue_depth,
+                                               data_size,
+                                               1,
+                                               nullptr,
+                                               d_backpressure,
+                                               d_stats.histogram(WRITE_LATENCY)));
+        }
+    }
+    return writers;
+}
+
+std::vector<std::unique_ptr<batch_index_writer>>
+batched_file_sink_impl::make_index_writers(const std::vector<std::string>& dirs,
+                                           const std::string& tag) const
+{
+    std::vector<std::unique_ptr<batch_index_writer>> index_writers;
+    for (const std::string& dir : dirs) {
+        index_writers.push_back(std::make_unique<batch_index_writer>(
+            std::filesystem::path(dir) / (tag + ".idx")));
+    }
+    return index_writers;
+}
+
+std::vector<std::unique_ptr<segment_writer>>
+batched_file_sink_impl::make_segment_writers() const
+{
+    std::vector<std::unique_ptr<segment_writer>> segment_writers;
+    for (size_t n = 0; n < d_dirs.size(); n++) {
+        segment_writers.push_back(
+            std::make_unique<segment_writer>(d_segment_size, d_segment_duration));
+    }
+    return segment_writers;
+}
+
+bool batched_file_sink_impl::stop()
+{
+    try {
+        // New settings still apply after a restart, but their resources are made
+        // afresh.
+        if (d_pending_settings && d_pending_settings->resources.valid()) {
+            retire(std::move(d_pending_settings->resources));
+        }
+        // A batch cut short by stopping is finished if its samples have already been
+        // streamed to file, and dropped otherwise. Either way, the next batch starts
+        // afresh when the flowgraph is restarted.
+        if (d_buffer_state == buffer_state::FILLING) {
+            if (!d_stream_writers.empty() && d_nbuffered_samples > 0) {
+                finish_streamed_batch();
+            }
+            d_buffer_state = buffer_state::EMPTY;
+            d_nbuffered_samples = 0;
+            d_nboundaries = 0;
+        }
+        // Wait for any queued batches to be written to file.
+        reap_retired(true);
+        for (auto& writer : d_writers) {
+            writer->stop();
+        }
+        d_writers.clear();
+        // Start a new segment when the flowgraph is restarted.
+        for (auto& segment_writer : d_segment_writers) {
+            segment_writer->close();
+        }
+        // Close anything left open, and remove the files preopened for the next batch.
+        for (auto& stream_writer : d_stream_writers) {
+            stream_writer->close();
+            stream_writer->discard_preopened();
+        }
+        for (auto& index_writer : d_index_writers) {
+            index_writer->close();
+        }
+        for (auto& pool : d_file_pools) {
+            pool->close();
+        }
+    } catch (const std::exception& e) {
+        d_logger->error(e.what());
+        return false;
+    }
+    return true;
+}
 
 void batched_file_sink_impl::init()
 {
+    SPECTRE_TRACE_SCOPE("batched_file_sink::init", d_read_offset);
+    block_stats::time_point start = d_stats.start();
+    d_sample_offset = d_read_offset;
     set_batch_time();
-    
-    // If the fstreams are open, close them first.
-    close_fstreams();
-    
-    open_fstreams();
+    d_active_dir = select_dir();
+    if (is_segmented()) {
+        set_segment();
+    } else {
+        set_file_paths();
+    }
+    set_metadata();
+    set_index_entry();
+
+    d_batch->nstreams = d_nstreams;
+    for (int n = 0; n < static_cast<int>(d_stream_writers.size()); n++) {
+        size_t nbytes = d_nitems_per_stream * d_sizeof_output_item;
+        d_stream_writers[n]->open(d_batch->data_paths[n], nbytes);
+
+        // Create the file for the next batch in the background, while this one is being
+        // recorded, so that opening it only costs a rename. It's placed in the directory
+        // the next batch is expected to use, to keep it on the same file system.
+        std::filesystem::path next_path = std::filesystem::path(d_dirs[d_next_dir]) /
+                                          ("." + d_stream_tags[n] + ".next");
+        d_stream_writers[n]->preopen(next_path, nbytes);
+    }
 
     if (d_is_tagged) {
+        // Reuse the tag buffer from the previous batch, without releasing its memory.
+        d_batch->tags.clear();
+        d_batch->tags_version = d_hdr_version;
+        d_batch->sample_rate = d_sample_rate;
         set_initial_active_tag();
     }
+    d_stats.record_elapsed(OPEN_LATENCY, start);
 }
 
 void batched_file_sink_impl::flush()
 {
-    flush_data_buffer();
-    flush_tag_buffer();
-    close_fstreams();
+    SPECTRE_TRACE_SCOPE("batched_file_sink::flush", d_sample_offset);
+    block_stats::time_point start = d_stats.start();
+    // Batches split on tags are usually cut short, as is one finished by stopping.
+    d_batch->data_size = static_cast<size_t>(d_nbuffered_samples) * d_num_inputs *
+                         d_sizeof_output_item;
+    d_batch->record.nsamples = d_nbuffered_samples;
+    d_batch->index_entry.nsamples = d_nbuffered_samples;
+    if (splits_on_tags() || d_nbuffered_samples < d_nsamples_per_batch) {
+        d_batch->metadata.set("nsamples", static_cast<uint64_t>(d_nbuffered_samples));
+    }
+
+    if (!d_stream_writers.empty()) {
+        // The data has already been written, so just the tags and metadata are left.
+        std::vector<file_range> ranges;
+        for (int n = 0; n < static_cast<int>(d_stream_writers.size()); n++) {
+            d_stream_writers[n]->close();
+            ranges.push_back(
+                file_range{ d_batch->data_paths[n], 0, d_batch->data_size / d_nstreams });
+        }
+        write_metadata(*d_batch);
+        index_batch(*d_batch, ranges);
+    } else if (!d_writers.empty()) {
+        // Hand the full batch over to the writer thread, and carry on with an empty one.
+        d_batch = d_writers[d_active_dir]->submit(std::move(d_batch));
+        publish_dropped();
+    } else {
+        write_batch(*d_batch, d_compressor.get());
+    }
+    d_nbuffered_samples = 0;
+    d_nboundaries = 0;
+
+    d_stats.record_elapsed(FLUSH_LATENCY, start);
+    d_stats.add(NBATCHES, 1);
+    if (d_stats.enabled() && !d_writers.empty()) {
+        size_t npending = 0;
+        for (auto& writer : d_writers) {
+            npending += writer->pending();
+        }
+        d_stats.set(QUEUE_OCCUPANCY, npending);
+    }
+}
+
+void batched_file_sink_impl::finish_streamed_batch()
+{
+    if (d_is_tagged) {
+        // As when a batch fills up, the active tag runs to the last sample recorded.
+        double tag_value = pmt::to_double(d_active_tag.value);
+        uint64_t abs_end = d_sample_offset + d_nbuffered_samples;
+        record_tag(tag_value, abs_end - d_active_tag.offset);
+    }
+    flush();
+}
+
+void batched_file_sink_impl::publish_dropped()
+{
+    d_writers[d_active_dir]->take_dropped(d_dropped);
+    for (const dropped_batch& dropped : d_dropped) {
+        d_ndropped_batches++;
+        d_ndropped_samples += dropped.nsamples;
+        d_stats.add(NDROPPED_SAMPLES, dropped.nsamples);
+
+        pmt::pmt_t msg = pmt::make_dict();
+        msg = pmt::dict_add(
+            msg, pmt::mp("start_ns"), pmt::from_long(dropped.start_ns));
+        msg = pmt::dict_add(msg, pmt::mp("end_ns"), pmt::from_long(dropped.end_ns));
+        msg = pmt::dict_add(
+            msg, pmt::mp("sample_offset"), pmt::from_uint64(dropped.sample_offset));
+        msg = pmt::dict_add(msg, pmt::mp("nsamples"), pmt::from_uint64(dropped.nsamples));
+        msg = pmt::dict_add(
+            msg, pmt::mp("total_nbatches"), pmt::from_uint64(d_ndropped_batches));
+        msg = pmt::dict_add(
+            msg, pmt::mp("total_nsamples"), pmt::from_uint64(d_ndropped_samples));
+        message_port_pub(DROPPED_PORT, msg);
+    }
+    d_dropped.clear();
+}
+
+void batched_file_sink_impl::setup_rpc()
+{
+    d_stats.setup_rpc(*this, COUNTER_UNITS, "batches");
+}
+
+void batched_file_sink_impl::handle_command(const pmt::pmt_t& msg)
+{
+    try {
+        reap_retired(false);
+
+        if (!pmt::is_dict(msg)) {
+            throw std::invalid_argument("A command must be a dictionary.");
+        }
+        // Settings which have yet to be applied carry over, unless they're changed again.
+        sink_settings settings =
+            (d_pending_settings) ? d_pending_settings->settings : get_settings();
+        pmt::pmt_t keys = pmt::dict_keys(msg);
+        for (size_t n = 0; n < pmt::length(keys); n++) {
+            pmt::pmt_t key = pmt::nth(n, keys);
+            pmt::pmt_t value = pmt::dict_ref(msg, key, pmt::PMT_NIL);
+            const std::string name = pmt::symbol_to_string(key);
+            if (name == "batch_size") {
+                settings.nsamples_per_batch =
+                    get_num_samples_per_batch(pmt::to_double(value), d_sample_rate);
+            } else if (name == "dir") {
+                settings.dir = pmt::symbol_to_string(value);
+            } else if (name == "tag") {
+                settings.tag = pmt::symbol_to_string(value);
+            } else if (name == "is_tagged") {
+                settings.is_tagged = pmt::to_bool(value);
+            } else {
+                throw std::invalid_argument("Unsupported setting: " + name);
+            }
+        }
+        check_settings(settings);
+        prepare_settings(settings);
+    } catch (const std::exception& e) {
+        d_logger->error("Ignoring command: {}", e.what());
+    }
+}
+
+sink_settings batched_file_sink_impl::get_settings() const
+{
+    return sink_settings{ d_dirs[0], d_tag, d_nsamples_per_batch, d_is_tagged };
+}
+
+void batched_file_sink_impl::check_settings(const sink_settings& settings) const
+{
+    if (settings.nsamples_per_batch < 1) {
+        throw std::invalid_argument("The batch size must be at least one sample.");
+    }
+    if (settings.dir.empty()) {
+        throw std::invalid_argument("The directory must not be empty.");
+    }
+    bool moved = settings.dir != d_dirs[0] || settings.tag != d_tag;
+    bool resized = settings.nsamples_per_batch != d_nsamples_per_batch;
+    if (!d_file_pools.empty() && (moved || resized)) {
+        throw std::invalid_argument(
+            "The batch size, directory and tag are fixed by the disk quota.");
+    }
+    if (d_capture_mode == capture_mode::triggered) {
+        if (settings.is_tagged != d_is_tagged) {
+            throw std::invalid_argument(
+                "Tags can't be turned on or off in triggered mode.");
+        }
+        if (d_npretrigger >= static_cast<size_t>(settings.nsamples_per_batch)) {
+            throw std::invalid_argument(
+                "The pre-trigger duration must be shorter than a batch.");
+        }
+    }
+    // Tags aren't followed while they're off, so there's nothing else to start from.
+    if (settings.is_tagged && !d_is_tagged && !d_initial_tag_value) {
+        throw std::invalid_argument(
+            "Tags can only be turned on if there's an initial tag value.");
+    }
+}
+
+void batched_file_sink_impl::prepare_settings(const sink_settings& settings)
+{
+    // Anything made for settings which were never applied is no longer needed.
+    if (d_pending_settings && d_pending_settings->resources.valid()) {
+        retire(std::move(d_pending_settings->resources));
+    }
+    d_pending_settings.reset();
+
+    // Work out what's needed here, so that the other thread only reads what's fixed.
+    bool moved = settings.dir != d_dirs[0] || settings.tag != d_tag;
+    bool resized = settings.nsamples_per_batch != d_nsamples_per_batch;
+    size_t batch_size = (resized && d_write_mode == write_mode::buffered)
+                            ? get_sizeof_data_buffer(d_write_mode,
+                                                     settings.nsamples_per_batch,
+                                                     d_num_inputs,
+                                                     d_sizeof_output_item)
+                            : 0;
+    // Batches still queued when the settings change are written by the old writers, to
+    // the old segments.
+    bool replace_writers = (moved || resized) && !d_writers.empty();
+    size_t data_size = (batch_size > 0) ? batch_size : d_batch->data.size();
+    bool replace_segments = (moved || resized) && is_segmented();
+
+    // Only replace the indexes which move, so that no two writers share an index.
+    std::vector<std::string> index_dirs;
+    if (moved && d_write_index) {
+        index_dirs = d_dirs;
+        index_dirs[0] = settings.dir;
+        if (settings.tag == d_tag) {
+            index_dirs.resize(1);
+        }
+    }
+
+    std::vector<std::shared_future<void>> retiring = d_retiring;
+    std::future<sink_resources> resources = std::async(
+        std::launch::async,
+        [this,
+         retiring,
+         batch_size,
+         replace_writers,
+         data_size,
+         replace_segments,
+         index_dirs,
+         tag = settings.tag]() {
+            for (const auto& previous : retiring) {
+                previous.wait();
+            }
+            sink_resources resources;
+            if (batch_size > 0) {
+                resources.batch = std::make_unique<batch_buffer>(batch_size);
+            }
+            if (replace_writers) {
+                resources.writers = make_writers(data_size);
+            }
+            if (replace_segments) {
+                resources.segment_writers = make_segment_writers();
+            }
+            if (!index_dirs.empty()) {
+                resources.index_writers = make_index_writers(index_dirs, tag);
+            }
+            return resources;
+        });
+    d_pending_settings = pending_settings{ settings, std::move(resources) };
+}
+
+bool batched_file_sink_impl::settings_ready() const
+{
+    return d_pending_settings && d_pending_settings->resources.valid() &&
+           d_pending_settings->resources.wait_for(std::chrono::seconds(0)) ==
+               std::future_status::ready;
+}
+
+void batched_file_sink_impl::apply_settings()
+{
+    pending_settings pending = std::move(*d_pending_settings);
+    d_pending_settings.reset();
+    sink_resources resources;
+    try {
+        resources = pending.resources.get();
+    } catch (const std::exception& e) {
+        d_logger->error("Ignoring command: {}", e.what());
+        return;
+    }
+    const sink_settings& settings = pending.settings;
+    bool moved = settings.dir != d_dirs[0] || settings.tag != d_tag;
+    bool resized = settings.nsamples_per_batch != d_nsamples_per_batch;
+
+    sink_resources retired;
+    if (resources.batch) {
+        retired.batch = std::move(d_batch);
+        d_batch = std::move(resources.batch);
+    }
+    if ((moved || resized) && !d_writers.empty()) {
+        retired.writers = std::move(d_writers);
+        d_writers = std::move(resources.writers);
+    }
+    if ((moved || resized) && is_segmented()) {
+        retired.segment_writers = std::move(d_segment_writers);
+        d_segment_writers = std::move(resources.segment_writers);
+    }
+    for (size_t n = 0; n < resources.index_writers.size(); n++) {
+        retired.index_writers.push_back(std::move(d_index_writers[n]));
+        d_index_writers[n] = std::move(resources.index_writers[n]);
+        d_nindexed_batches[n] = 0;
+    }
+    retire(std::move(retired));
+
+    d_dirs[0] = settings.dir;
+    d_tag = settings.tag;
+    d_stream_tags = get_stream_tags(d_tag, d_nstreams);
+    d_nsamples_per_batch = settings.nsamples_per_batch;
+    d_nitems_per_stream =
+        static_cast<size_t>(d_nsamples_per_batch) * d_num_inputs / d_nstreams;
+
+    if (settings.is_tagged && !d_is_tagged) {
+        // Start from the initial value, unless the first sample of the batch is tagged.
+        d_active_tag = tag_t();
+        d_active_tag.offset = d_read_offset;
+        d_active_tag.key = d_tag_key;
+        d_active_tag.value = pmt::from_float(d_initial_tag_value);
+        d_active_tag.srcid = pmt::intern(alias());
+    }
+    d_is_tagged = settings.is_tagged;
+
+    if (resized && d_capture_mode == capture_mode::triggered) {
+        respace_captures();
+    }
+}
+
+void batched_file_sink_impl::retire(sink_resources resources)
+{
+    d_retiring.push_back(std::async(std::launch::async,
+                                    [resources = std::move(resources)]() mutable {
+                                        stop_resources(resources);
+                                    })
+                             .share());
+}
+
+void batched_file_sink_impl::retire(std::future<sink_resources> resources)
+{
+    // Wait for them to be made, if they haven't been already.
+    d_retiring.push_back(std::async(std::launch::async,
+                                    [resources = std::move(resources)]() mutable {
+                                        sink_resources made = resources.get();
+                                        stop_resources(made);
+                                    })
+                             .share());
+}
+
+void batched_file_sink_impl::reap_retired(bool wait)
+{
+    auto it = d_retiring.begin();
+    while (it != d_retiring.end()) {
+        if (!wait &&
+            it->wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+            ++it;
+            continue;
+        }
+        try {
+            it->get();
+        } catch (const std::exception& e) {
+            d_logger->error("Failed to stop what a command replaced: {}", e.what());
+        }
+        it = d_retiring.erase(it);
+    }
+}
+
+void batched_file_sink_impl::respace_captures()
+{
+    // The captures queued after this one were spaced for the old batch size. Captures
+    // are only ever moved later, since it isn't known where their triggers were.
+    uint64_t end = d_read_offset + d_nsamples_per_batch;
+    for (uint64_t& start : d_capture_starts) {
+        start = std::max(start, end);
+        end = start + d_nsamples_per_batch;
+    }
+    d_next_capture_offset = end;
 }
 
 void batched_file_sink_impl::set_batch_time()
 {
     using namespace std::chrono;
 
-    // Get the current system time.
-    time_point<system_clock, nanoseconds> now = system_clock::now();
+    if (d_use_rx_time) {
+        // Pick up a tag attached to the first sample in the batch.
+        uint64_t abs_start = d_read_offset;
+        update_time_reference(abs_start, abs_start + 1);
+    }
 
-    // Convert this to UTC (to seconds precision).
-    std::time_t now_c = system_clock::to_time_t(now);
-    std::tm* utc_now = std::gmtime(&now_c);
+    if (d_time_reference) {
+        // Count on from the reference, at the sample rate.
+        double nsamples_since = d_read_offset - d_time_reference->offset;
+        double frac_secs = d_time_reference->frac_secs + nsamples_since / d_sample_rate;
+        double full_secs = std::floor(frac_secs);
+        d_batch_time.unix_s =
+            d_time_reference->full_secs + static_cast<int64_t>(full_secs);
+        d_batch_time.us =
+            std::min(static_cast<int>((frac_secs - full_secs) * 1e6), 999999);
+    } else {
+        // Get the current system time, split into whole seconds and microseconds. In
+        // triggered mode, the batch starts with samples held back in the ring, so count
+        // back to when the first of them arrived.
+        int64_t us_since_epoch =
+            duration_cast<microseconds>(system_clock::now().time_since_epoch()).count();
+        int64_t nsamples_behind = static_cast<int64_t>(d_ring.offset() + d_ring.size()) -
+                                  static_cast<int64_t>(d_read_offset);
+        if (d_capture_mode == capture_mode::triggered && nsamples_behind > 0) {
+            us_since_epoch -= static_cast<int64_t>(nsamples_behind * 1e6 / d_sample_rate);
+        }
+        d_batch_time.unix_s = us_since_epoch / 1000000;
+        d_batch_time.us = static_cast<int>(us_since_epoch % 1000000);
+    }
+    d_timestamp_formatter.format(d_batch_time.unix_s, d_batch_time.us);
+}
 
-    // Then, extract the millisecond component.
-    microseconds us =
-        duration_cast<microseconds>(now.time_since_epoch() - seconds(now_c));
+void batched_file_sink_impl::update_time_reference(uint64_t abs_start,
+                                                   uint64_t abs_end,
+                                                   std::optional<uint64_t> skip_offset)
+{
+    // Only the most recent tag matters. Each is a (full seconds, fractional seconds)
+    // tuple, so skip any which aren't.
+    for (auto it = d_tags.rbegin(); it != d_tags.rend(); it++) {
+        if (it->offset < abs_start || it->offset >= abs_end ||
+            it->offset == skip_offset || !pmt::eq(it->key, RX_TIME_KEY) ||
+            !pmt::is_tuple(it->value)) {
+            continue;
+        }
+        uint64_t full_secs = pmt::to_uint64(pmt::tuple_ref(it->value, 0));
+        double frac_secs = pmt::to_double(pmt::tuple_ref(it->value, 1));
+        d_time_reference =
+            time_reference{ it->offset, static_cast<int64_t>(full_secs), frac_secs };
+        return;
+    }
+}
+
+size_t batched_file_sink_impl::select_dir()
+{
+    size_t selected = d_next_dir;
+    if (d_stripe_policy == stripe_policy::least_loaded && !d_writers.empty()) {
+        // Search in turn, starting from the next directory, so that ties are broken
+        // round robin.
+        size_t min_pending = d_writers[selected]->pending();
+        for (size_t i = 1; i < d_dirs.size() && min_pending > 0; i++) {
+            size_t n = (d_next_dir + i) % d_dirs.size();
+            size_t pending = d_writers[n]->pending();
+            if (pending < min_pending) {
+                selected = n;
+                min_pending = pending;
+            }
+        }
+    }
+    d_next_dir = (selected + 1) % d_dirs.size();
+    return selected;
+}
 
-    d_batch_time.utc_tm = *utc_now;
-    d_batch_time.us = static_cast<int>(us.count());
+bool batched_file_sink_impl::is_compressed() const { return d_compression != "none"; }
+
+bool batched_file_sink_impl::is_segmented() const
+{
+    return d_segment_size > 0 || d_segment_duration > 0;
 }
 
-void batched_file_sink_impl::open_fstream(std::ofstream& f, const std::string& extension)
+bool batched_file_sink_impl::has_metadata() const
 {
-    using namespace std::filesystem;
+    return d_converter || is_compressed() || d_num_inputs > 1 || d_use_rx_time ||
+           !d_metadata_tag_keys.empty() || splits_on_tags() ||
+           d_backpressure != backpressure_policy::block;
+}
 
-    path filename = generate_file_path(
-        d_dir, d_tag, extension, d_group_by_date, d_batch_time.utc_tm, d_batch_time.us);
+bool batched_file_sink_impl::splits_on_tags() const
+{
+    return d_batch_boundary != batch_boundary::size;
+}
 
-    path parent_dir{ filename.parent_path() };
-    if (!exists(parent_dir)) {
-        create_directories(parent_dir);
+std::unique_ptr<batch_compressor> batched_file_sink_impl::make_compressor() const
+{
+    // Shuffle the bytes of each real and imaginary component separately.
+    return std::make_unique<batch_compressor>(
+        d_compression, d_compression_level, d_sizeof_output_item / 2);
+}
+
+void batched_file_sink_impl::set_file_paths()
+{
+    const std::string& dir = d_dirs[d_active_dir];
+    const std::string& timestamp = d_timestamp_formatter.str();
+    d_batch->data_paths.clear();
+    for (int n = 0; n < d_nstreams; n++) {
+        d_batch->data_paths.push_back(
+            generate_file_path(dir, timestamp, d_stream_tags[n], d_data_extension));
     }
+    d_batch->tags_path = (d_is_tagged)
+                             ? generate_file_path(dir, timestamp, d_tag, "hdr")
+                             : std::filesystem::path();
+    d_batch->metadata_path = (has_metadata())
+                                 ? generate_file_path(dir, timestamp, d_tag, "json")
+                                 : std::filesystem::path();
+}
+
+void batched_file_sink_impl::set_segment()
+{
+    d_batch->segment = d_segment_writers[d_active_dir].get();
+    d_batch->segment_path = generate_file_path(d_dirs[d_active_dir],
+                                               d_timestamp_formatter.str(),
+                                               d_tag,
+                                               d_data_extension + ".seg");
+
+    d_batch->record.timestamp_s = d_batch_time.unix_s;
+    d_batch->record.timestamp_us = d_batch_time.us;
+    d_batch->record.num_channels = d_num_inputs;
+}
+
+void batched_file_sink_impl::set_index_entry()
+{
+    // The file pool also needs the time range of the batch, even if it's not indexed.
+    d_batch->index_entry.start_ns = get_unix_time_ns(d_batch_time);
+    d_batch->index_entry.sample_offset = d_sample_offset;
+    d_batch->index_entry.sample_rate = d_sample_rate;
+    d_batch->pool = (d_file_pools.empty()) ? nullptr : d_file_pools[d_active_dir].get();
 
-    f.open(filename.string(), std::ios::binary);
-    if (!f.is_open()) {
-        const std::string msg = "Failed to open: " + filename.string();
-        d_logger->error(msg);
-        throw std::runtime_error(msg);
+    if (!d_write_index) {
+        d_batch->index = nullptr;
+        return;
     }
+    d_batch->index = d_index_writers[d_active_dir].get();
+    d_batch->index_sequence = d_nindexed_batches[d_active_dir]++;
 }
 
-void batched_file_sink_impl::open_fstreams()
+void batched_file_sink_impl::set_metadata()
 {
-    open_fstream(d_fdata, d_input_type);
-    if (d_is_tagged) {
-        open_fstream(d_ftags, "hdr");
+    d_batch->metadata.clear();
+    if (d_converter) {
+        d_batch->metadata.set("input_type", d_input_type);
+        d_batch->metadata.set("output_type", d_output_type);
+        d_batch->metadata.set("scale", static_cast<double>(d_scale));
+    }
+    if (is_compressed()) {
+        d_batch->metadata.set("compression", d_compression);
+        d_batch->metadata.set("compression_level",
+                              static_cast<int64_t>(d_compression_level));
+        d_batch->metadata.set("shuffle_typesize",
+                              static_cast<uint64_t>(d_sizeof_output_item / 2));
+    }
+    if (d_use_rx_time) {
+        d_batch->metadata.set("time_source",
+                              (d_time_reference) ? "rx_time" : "system_clock");
+    }
+    if (d_num_inputs > 1) {
+        d_batch->metadata.set("num_channels", static_cast<int64_t>(d_num_inputs));
+        d_batch->metadata.set("interleaved", d_interleave);
     }
 }
 
-void batched_file_sink_impl::close_fstreams()
+std::optional<int> batched_file_sink_impl::find_boundary(int nitems)
 {
-    if (d_fdata.is_open()) {
-        d_fdata.close();
+    // Only look as far as the batch can go, so that every tag checked here is either
+    // consumed into this batch or starts the next one.
+    uint64_t abs_start = d_read_offset;
+    uint64_t abs_end = abs_start + nitems;
+
+    for (const tag_t& tag : d_tags) {
+        if (tag.offset < d_next_boundary_check || !pmt::eq(tag.key, d_tag_key)) {
+            continue;
+        }
+        if (tag.offset >= abs_end) {
+            break;
+        }
+
+        // A batch which didn't start on a boundary (e.g., the first, or one after the
+        // size limit was reached) ends at the next one, so the batches after it line up.
+        bool is_boundary = is_boundary_tag(tag);
+        if (is_boundary && tag.offset > d_sample_offset &&
+            (d_nboundaries == 0 || d_nboundaries == d_boundaries_per_batch)) {
+            // Leave the tag to be checked again, as the first sample of the next batch.
+            return static_cast<int>(tag.offset - abs_start);
+        }
+        if (is_boundary) {
+            d_nboundaries++;
+        }
+        if (pmt::is_number(tag.value)) {
+            d_last_boundary_value = pmt::to_double(tag.value);
+        }
+        d_next_boundary_check = tag.offset + 1;
     }
-    if (d_ftags.is_open()) {
-        d_ftags.close();
+    return std::nullopt;
+}
+
+bool batched_file_sink_impl::is_boundary_tag(const tag_t& tag) const
+{
+    if (d_batch_boundary == batch_boundary::tag) {
+        return true;
     }
+    // Otherwise, a sweep restarts whenever the tag value (e.g., the frequency) wraps
+    // back around.
+    return pmt::is_number(tag.value) && d_last_boundary_value &&
+           pmt::to_double(tag.value) < *d_last_boundary_value;
 }
 
-int batched_file_sink_impl::fill_data_buffer(int noutput_items, const char* in)
+int batched_file_sink_impl::fill_data_buffer(int noutput_items,
+                                             const gr_vector_const_void_star& input_items)
 {
     // Fill the buffer with as many samples as possible, without exceeding its fixed size.
     // Keep a record of how many we've consumed, so we can report back to gnuradio
     // runtime.
     int nconsumed_items =
         std::min(noutput_items, d_nsamples_per_batch - d_nbuffered_samples);
-    std::memcpy(d_data_buffer.data() + d_nbuffered_samples * d_sizeof_stream_item,
-                in,
-                nconsumed_items * d_sizeof_stream_item);
+
+    if (d_interleave) {
+        // Interleaved inputs are treated as a single stream, with one item per input.
+        fill_stream(0,
+                    interleave(input_items, nconsumed_items),
+                    nconsumed_items * d_num_inputs,
+                    d_nbuffered_samples * d_num_inputs);
+    } else {
+        for (int n = 0; n < d_num_inputs; n++) {
+            fill_stream(n,
+                        static_cast<const char*>(input_items[n]),
+                        nconsumed_items,
+                        d_nbuffered_samples);
+        }
+    }
     d_nbuffered_samples += nconsumed_items;
     return nconsumed_items;
 }
 
-void batched_file_sink_impl::flush_data_buffer()
+void batched_file_sink_impl::fill_stream(int nstream,
+                                         const char* in,
+                                         size_t nitems,
+                                         size_t offset)
 {
-    // Always flush the entire buffer to file.
-    d_fdata.write(d_data_buffer.data(), d_sizeof_stream_item * d_nsamples_per_batch);
-    d_nbuffered_samples = 0;
+    size_t nbytes = nitems * d_sizeof_output_item;
+    char* out = (d_stream_writers.empty())
+                    ? d_batch->data.data() +
+                          (nstream * d_nitems_per_stream + offset) * d_sizeof_output_item
+                    : nullptr;
+
+    if (d_converter) {
+        // Convert straight into the batch if it's held in memory, otherwise go through an
+        // intermediate buffer on the way to file.
+        if (!out) {
+            if (d_conversion_buffer.size() < nbytes) {
+                d_conversion_buffer.resize(nbytes);
+            }
+            out = d_conversion_buffer.data();
+        }
+        d_converter(out, in, d_scale, nitems);
+        in = out;
+    }
+
+    if (!d_stream_writers.empty()) {
+        d_stream_writers[nstream]->write(in, nbytes);
+    } else if (!d_converter) {
+        std::memcpy(out, in, nbytes);
+    }
+}
+
+const char*
+batched_file_sink_impl::interleave(const gr_vector_const_void_star& input_items,
+                                   int nitems)
+{
+    size_t nbytes = nitems * d_num_inputs * d_sizeof_stream_item;
+    if (d_interleave_buffer.size() < nbytes) {
+        d_interleave_buffer.resize(nbytes);
+    }
+
+    char* out = d_interleave_buffer.data();
+    for (int i = 0; i < nitems; i++) {
+        for (int n = 0; n < d_num_inputs; n++) {
+            const char* in = static_cast<const char*>(input_items[n]);
+            std::memcpy(out, in + i * d_sizeof_stream_item, d_sizeof_stream_item);
+            out += d_sizeof_stream_item;
+        }
+    }
+    return d_interleave_buffer.data();
+}
+
+bool batched_file_sink_impl::needs_tags() const
+{
+    return d_is_tagged || d_use_rx_time || !d_metadata_tag_keys.empty() ||
+           splits_on_tags();
+}
+
+void batched_file_sink_impl::scan_tags(uint64_t abs_start, int noutput_items)
+{
+    SPECTRE_TRACE_SCOPE("batched_file_sink::scan_tags", noutput_items);
+    // Collect the tags for every key at once, so recording more keys doesn't mean
+    // searching the tag buffer again. The vector keeps its capacity between calls.
+    get_tags_in_range(d_tags, INPUT_PORT, abs_start, abs_start + noutput_items);
+    d_stats.add(NTAGS, d_tags.size());
 }
 
 std::optional<tag_t> batched_file_sink_impl::get_tag_from_first_sample()
 {
-    std::vector<tag_t> tags;
-    uint64_t rel_start{ 0 };
-    uint64_t rel_end{ 1 };
-    get_tags_in_window(tags, INPUT_PORT, rel_start, rel_end, d_tag_key);
-    return (tags.empty()) ? std::nullopt : std::optional<tag_t>(tags[0]);
+    uint64_t abs_start = d_read_offset;
+    for (const tag_t& tag : d_tags) {
+        if (tag.offset < abs_start) {
+            continue;
+        }
+        if (tag.offset > abs_start) {
+            break;
+        }
+        if (pmt::eq(tag.key, d_tag_key)) {
+            return tag;
+        }
+    }
+    return std::nullopt;
 }
 
 bool batched_file_sink_impl::tag_is_set() const
@@ -239,13 +1376,13 @@ void batched_file_sink_impl::set_initial_active_tag()
     // call to work have already been recorded in the previous batch.
     // So, we can simply update the offset and start afresh.
     if (tag_is_set()) {
-        d_active_tag.offset = nitems_read(INPUT_PORT);
+        d_active_tag.offset = d_read_offset;
         return;
     }
 
     // As a fallback, use the user-defined tag value if it's provided to initialise the
     // active tag. This should only really be reached at the first call to work.
-    bool is_first_work_call = nitems_read(INPUT_PORT) == 0;
+    bool is_first_work_call = d_read_offset == 0;
     if (d_initial_tag_value && is_first_work_call) {
         // Use zero here, to indicate the tag is attached to the first item
         // in the stream.
@@ -266,23 +1403,25 @@ void batched_file_sink_impl::fill_tag_buffer(int nconsumed_items)
     // Find all tags between (and excluding) the active tag and however many samples have
     // been consumed by the current call to work. Remember, the active tag may be attached
     // to a sample in a previous call to work.
-    std::vector<tag_t> tags;
     uint64_t abs_start = d_active_tag.offset + 1;
-    uint64_t abs_end = nitems_read(INPUT_PORT) + nconsumed_items;
-    get_tags_in_range(tags, INPUT_PORT, abs_start, abs_end, d_tag_key);
-    size_t num_tags = tags.size();
+    uint64_t abs_end = d_read_offset + nconsumed_items;
+
+    for (const tag_t& tag : d_tags) {
+        if (tag.offset < abs_start || !pmt::eq(tag.key, d_tag_key)) {
+            continue;
+        }
+        if (tag.offset >= abs_end) {
+            break;
+        }
 
-    for (size_t n = 0; n < num_tags; n++) {
         // Compute the number of samples associated with the active tag, by comparing its
         // offset to the next tag.
-        tag_t next_tag{ tags[n] };
-        float tag_value = pmt::to_float(d_active_tag.value);
-        float num_samples = static_cast<float>(next_tag.offset - d_active_tag.offset);
+        const tag_t& next_tag = tag;
+        double tag_value = pmt::to_double(d_active_tag.value);
+        uint64_t num_samples = next_tag.offset - d_active_tag.offset;
 
         // Record the tag value, along with the number of samples at that value.
-        d_tags_buffer[2 * d_nbuffered_tags] = tag_value;
-        d_tags_buffer[2 * d_nbuffered_tags + 1] = num_samples;
-        d_nbuffered_tags++;
+        record_tag(tag_value, num_samples);
 
         // Finally, update the active tag.
         d_active_tag = next_tag;
@@ -295,42 +1434,254 @@ void batched_file_sink_impl::fill_tag_buffer(int nconsumed_items)
         // simply compute the number of samples remaining. There may be samples belonging
         // to that tag at the next call to work. But they'll be recorded in the next
         // batch.
-        float tag_value = pmt::to_float(d_active_tag.value);
-        float num_samples_remaining = static_cast<float>(abs_end - d_active_tag.offset);
-        d_tags_buffer[2 * d_nbuffered_tags] = tag_value;
-        d_tags_buffer[2 * d_nbuffered_tags + 1] = num_samples_remaining;
-        d_nbuffered_tags++;
+        double tag_value = pmt::to_double(d_active_tag.value);
+        uint64_t num_samples_remaining = abs_end - d_active_tag.offset;
+        record_tag(tag_value, num_samples_remaining);
     }
 }
 
-void batched_file_sink_impl::flush_tag_buffer()
+void batched_file_sink_impl::record_tag(double tag_value, uint64_t num_samples)
 {
-    const char* s = reinterpret_cast<const char*>(d_tags_buffer.data());
-    // Flush the tag buffer, avoiding garbage values. In contrast to the data buffer, it's
-    // (almost certainly) only partially filled.
-    size_t num_chars = 2 * d_nbuffered_tags * sizeof(float);
-    d_ftags.write(s, num_chars);
-    d_nbuffered_tags = 0;
-};
+    // Each run of samples starts where the previous one ended.
+    uint64_t offset = 0;
+    if (!d_batch->tags.empty()) {
+        offset = d_batch->tags.back().offset + d_batch->tags.back().count;
+    }
+    d_batch->tags.push_back(tag_record{ offset, num_samples, tag_value });
+}
+
+void batched_file_sink_impl::record_metadata_tags(int nconsumed_items)
+{
+    uint64_t abs_end = d_read_offset + nconsumed_items;
+    for (const tag_t& tag : d_tags) {
+        if (tag.offset < d_read_offset) {
+            continue;
+        }
+        if (tag.offset >= abs_end) {
+            break;
+        }
+        for (size_t n = 0; n < d_metadata_tag_symbols.size(); n++) {
+            if (pmt::eq(tag.key, d_metadata_tag_symbols[n])) {
+                add_tag_to_metadata(d_batch->metadata,
+                                    d_metadata_tag_keys[n],
+                                    tag.offset - d_sample_offset,
+                                    tag.value);
+                break;
+            }
+        }
+    }
+}
+
+void batched_file_sink_impl::detect_triggers(const gr_vector_const_void_star& input_items,
+                                             int nitems)
+{
+    uint64_t abs_start = nitems_read(INPUT_PORT);
+    if (d_trigger_requested) {
+        d_trigger_requested = false;
+        add_trigger(abs_start);
+    }
+    if (d_trigger_source != trigger_source::power) {
+        return;
+    }
+
+    // Samples already due to be captured can't start another capture, so skip them.
+    size_t n =
+        (d_next_capture_offset > abs_start) ? d_next_capture_offset - abs_start : 0;
+    if (n >= static_cast<size_t>(nitems)) {
+        return;
+    }
+    if (d_power_buffer.size() < static_cast<size_t>(nitems)) {
+        d_power_buffer.resize(nitems);
+    }
+    volk_32fc_magnitude_squared_32f(d_power_buffer.data() + n,
+                                    static_cast<const gr_complex*>(input_items[0]) + n,
+                                    nitems - n);
+
+    float threshold = static_cast<float>(d_trigger_power);
+    auto end = d_power_buffer.begin() + nitems;
+    while (n < static_cast<size_t>(nitems)) {
+        auto it = std::find_if(d_power_buffer.begin() + n, end, [threshold](float power) {
+            return power > threshold;
+        });
+        if (it == end) {
+            break;
+        }
+        add_trigger(abs_start + (it - d_power_buffer.begin()));
+        n = d_next_capture_offset - abs_start;
+    }
+}
 
+void batched_file_sink_impl::add_trigger(uint64_t offset)
+{
+    // Ignore triggers during a capture that's already due.
+    if (offset < d_next_capture_offset) {
+        return;
+    }
+
+    // Start as far back as the ring allows, without overlapping the last capture.
+    uint64_t start = (offset > d_npretrigger) ? offset - d_npretrigger : 0;
+    start = std::max({ start, d_ring.offset(), d_next_capture_offset });
+    d_capture_starts.push_back(start);
+    d_next_capture_offset = start + d_nsamples_per_batch;
+}
+
+int batched_file_sink_impl::capture(int noutput_items,
+                                    const gr_vector_const_void_star& input_items)
+{
+    // Hold back the pre-trigger samples in the ring, and take in as many more as fit.
+    int nitems = std::min(noutput_items,
+                          static_cast<int>(d_ring.capacity() - d_npretrigger));
+    if (needs_tags()) {
+        scan_tags(nitems_read(INPUT_PORT), nitems);
+        d_ring_tags.insert(d_ring_tags.end(), d_tags.begin(), d_tags.end());
+    }
+    detect_triggers(input_items, nitems);
+    d_ring.push(input_items, nitems);
+
+    // Samples leaving the ring are either recorded, if they belong to a capture, or
+    // dropped.
+    while (d_ring.size() > d_npretrigger) {
+        size_t n = std::min(d_ring.size() - d_npretrigger, d_ring.front(d_ring_items));
+        replay(static_cast<int>(n));
+        d_ring.pop(n);
+    }
+    return nitems;
+}
+
+void batched_file_sink_impl::replay(int nitems)
+{
+    d_read_offset = d_ring.offset();
+    uint64_t abs_end = d_read_offset + nitems;
+
+    // Hand over the tags for these samples, as if they'd just arrived.
+    d_tags.clear();
+    while (!d_ring_tags.empty() && d_ring_tags.front().offset < abs_end) {
+        d_tags.push_back(d_ring_tags.front());
+        d_ring_tags.pop_front();
+    }
+
+    while (nitems > 0) {
+        int n;
+        if (d_buffer_state == buffer_state::EMPTY &&
+            (d_capture_starts.empty() || d_capture_starts.front() > d_read_offset)) {
+            n = (d_capture_starts.empty())
+                    ? nitems
+                    : static_cast<int>(std::min<uint64_t>(
+                          nitems, d_capture_starts.front() - d_read_offset));
+            skip(n);
+        } else {
+            if (d_buffer_state == buffer_state::EMPTY) {
+                d_capture_starts.pop_front();
+                if (settings_ready()) {
+                    apply_settings();
+                }
+            }
+            n = record_samples(nitems, d_ring_items);
+        }
+
+        for (const void*& item : d_ring_items) {
+            item = static_cast<const char*>(item) + n * d_sizeof_stream_item;
+        }
+        d_read_offset += n;
+        nitems -= n;
+    }
+}
+
+void batched_file_sink_impl::skip(int nitems)
+{
+    // Keep up with the tags, so the next capture starts with the right tag value and
+    // time.
+    uint64_t abs_end = d_read_offset + nitems;
+    if (d_is_tagged) {
+        if (d_read_offset == 0) {
+            set_initial_active_tag();
+        }
+        for (const tag_t& tag : d_tags) {
+            if (tag.offset >= d_read_offset && tag.offset < abs_end &&
+                pmt::eq(tag.key, d_tag_key)) {
+                d_active_tag = tag;
+            }
+        }
+    }
+    if (d_use_rx_time) {
+        update_time_reference(d_read_offset, abs_end);
+    }
+}
 
 int batched_file_sink_impl::work(int noutput_items,
                                  gr_vector_const_void_star& input_items,
                                  gr_vector_void_star& output_items)
 {
+    SPECTRE_TRACE_SCOPE("batched_file_sink::work", noutput_items);
+    block_stats::time_point start = d_stats.start();
+    int nconsumed_items = (d_capture_mode == capture_mode::triggered)
+                              ? capture(noutput_items, input_items)
+                              : record(noutput_items, input_items);
+
+    if (d_stats.enabled()) {
+        d_stats.add(NITEMS, nconsumed_items);
+        d_stats.add(NBYTES, static_cast<uint64_t>(nconsumed_items) * d_num_inputs *
+                                d_sizeof_stream_item);
+        d_stats.add(NWORK_CALLS, 1);
+        d_stats.add_elapsed(WORK_TIME_NS, start);
+        if (d_stats.is_publish_due()) {
+            message_port_pub(STATS_PORT, d_stats.to_pmt());
+        }
+    }
+    return nconsumed_items;
+}
+
+int batched_file_sink_impl::record(int noutput_items,
+                                   const gr_vector_const_void_star& input_items)
+{
+    d_read_offset = nitems_read(INPUT_PORT);
+    if (d_buffer_state == buffer_state::EMPTY && settings_ready()) {
+        // Apply any new settings before the tags are searched, in case they're needed.
+        apply_settings();
+    }
+    if (needs_tags()) {
+        scan_tags(d_read_offset, noutput_items);
+    }
+    return record_samples(noutput_items, input_items);
+}
 
+int batched_file_sink_impl::record_samples(int noutput_items,
+                                           const gr_vector_const_void_star& input_items)
+{
     // If the data buffer is empty, initialise a new batch.
     if (d_buffer_state == buffer_state::EMPTY) {
         init();
         d_buffer_state = buffer_state::FILLING;
     }
 
-    const char* in = reinterpret_cast<const char*>(input_items[0]);
-    int nconsumed_items = fill_data_buffer(noutput_items, in);
+    // End the batch early if a boundary tag arrives before it's full.
+    bool at_boundary = false;
+    if (splits_on_tags()) {
+        std::optional<int> nitems = find_boundary(
+            std::min(noutput_items, d_nsamples_per_batch - d_nbuffered_samples));
+        if (nitems) {
+            noutput_items = *nitems;
+            at_boundary = true;
+        }
+    }
+
+    int nconsumed_items = fill_data_buffer(noutput_items, input_items);
+
+    if (d_use_rx_time) {
+        // Keep track of the sample clock, ready for the next batch. A tag on the first
+        // sample of the batch has already been picked up, but one on the first sample of
+        // any later call hasn't.
+        update_time_reference(
+            d_read_offset, d_read_offset + nconsumed_items, d_sample_offset);
+    }
+
+    if (!d_metadata_tag_keys.empty()) {
+        record_metadata_tags(nconsumed_items);
+    }
 
     // Check if the data buffer is full now, as we'll need to know when we're
     // filling the tag buffer if we're about to flush.
-    if (d_nbuffered_samples == d_nsamples_per_batch) {
+    if (d_nbuffered_samples == d_nsamples_per_batch || at_boundary) {
         d_buffer_state = buffer_state::FULL;
     }
 
@@ -7,27 +7,91 @@
 #ifndef INCLUDED_SPECTRE_BATCHED_FILE_SINK_IMPL_H
 #define INCLUDED_SPECTRE_BATCHED_FILE_SINK_IMPL_H
 
+#include "batch_writer.h"
+#include "block_stats.h"
+#include "sample_ring.h"
+#include "stream_writer.h"
+#include "utils.h"
 #include <gnuradio/spectre/batched_file_sink.h>
 
 #include <gnuradio/types.h>
-#include <filesystem>
-#include <fstream>
+#include <deque>
+#include <future>
+#include <memory>
 #include <optional>
 
 namespace gr {
 namespace spectre {
 
 struct batch_time {
-    std::tm utc_tm;
+    // Since the Unix epoch.
+    int64_t unix_s;
     int us;
 };
 
+// The time of a single sample, as given by an `rx_time` tag.
+struct time_reference {
+    uint64_t offset;
+    int64_t full_secs;
+    double frac_secs;
+};
+
 enum buffer_state {
     EMPTY = 0,
     FILLING,
     FULL,
 };
 
+// Each of these is parsed from the option of the same name, when the sink is made.
+enum class stripe_policy {
+    round_robin,
+    least_loaded,
+};
+
+enum class batch_boundary {
+    // Every batch holds the same number of samples.
+    size,
+    // Batches are split on tags with the tag key.
+    tag,
+    // Batches are split whenever the tag value wraps back around.
+    wrap,
+};
+
+enum class capture_mode {
+    continuous,
+    triggered,
+};
+
+enum class trigger_source {
+    message,
+    power,
+};
+
+// The settings which can be changed by a command while the flowgraph is running.
+struct sink_settings {
+    std::string dir;
+    std::string tag;
+    int nsamples_per_batch;
+    bool is_tagged;
+};
+
+// Whatever has to be replaced to apply new settings, or was replaced by them. Each is
+// only set if it's needed.
+struct sink_resources {
+    std::unique_ptr<batch_buffer> batch;
+    std::vector<std::unique_ptr<batch_writer>> writers;
+    std::vector<std::unique_ptr<batch_index_writer>> index_writers;
+    std::vector<std::unique_ptr<segment_writer>> segment_writers;
+};
+
+// New settings, waiting for the next batch to start. Their resources are made on
+// another thread, and the settings are only applied once they're ready. If the future
+// isn't valid, they're made again when the flowgraph starts.
+struct pending_settings {
+    sink_settings settings;
+    std::future<sink_resources> resources;
+};
+
 class batched_file_sink_impl : public batched_file_sink
 {
 public:
@@ -39,55 +103,208 @@ public:
                            const bool group_by_date,
                            const bool is_tagged,
                            const std::string& tag_key,
-                           const float initial_tag_value);
+                           const float initial_tag_value,
+                           const batched_file_sink_options& options);
     ~batched_file_sink_impl();
+    bool start() override;
+    bool stop() override;
+    void setup_rpc() override;
     int work(int noutput_items,
              gr_vector_const_void_star& in,
              gr_vector_void_star& out) override;
 
 private:
-    const std::string d_dir;
-    const std::string d_tag;
+    // Batches are striped across each of these directories. The first directory, the
+    // tag, the batch size and whether tags are recorded can be changed by a command,
+    // taking effect when the next batch starts.
+    std::vector<std::string> d_dirs;
+    const stripe_policy d_stripe_policy;
+    std::string d_tag;
     const std::string d_input_type;
+    const std::string d_output_type;
     const size_t d_sizeof_stream_item;
-    const int d_nsamples_per_batch;
-    const bool d_is_tagged;
+    const size_t d_sizeof_output_item;
+    const float d_sample_rate;
+    int d_nsamples_per_batch;
+    const int d_num_inputs;
+    const bool d_interleave;
+    // The number of data files per batch, and how many items are written to each.
+    const int d_nstreams;
+    size_t d_nitems_per_stream;
+    bool d_is_tagged;
     const bool d_group_by_date;
     const pmt::pmt_t d_tag_key;
     const float d_initial_tag_value;
+    const int d_queue_depth;
+    const backpressure_policy d_backpressure;
+    const write_mode d_write_mode;
+    const float d_scale;
+    const sample_converter d_converter;
+    const std::string d_compression;
+    const int d_compression_level;
+    // The extension and tag for each data file, which are the same for every batch.
+    const std::string d_data_extension;
+    std::vector<std::string> d_stream_tags;
+    const uint64_t d_segment_size;
+    const double d_segment_duration;
+    const bool d_write_index;
+    const bool d_use_rx_time;
+    const int d_hdr_version;
+    // Every tag with one of these keys is recorded in the metadata.
+    const std::vector<std::string> d_metadata_tag_keys;
+    const std::vector<pmt::pmt_t> d_metadata_tag_symbols;
+    // Batches are split on tags with `d_tag_key`, unless the boundary is by size.
+    const batch_boundary d_batch_boundary;
+    const int d_boundaries_per_batch;
+    // In triggered mode, each batch starts `d_npretrigger` samples before a trigger.
+    const capture_mode d_capture_mode;
+    const trigger_source d_trigger_source;
+    const double d_trigger_power;
+    const size_t d_npretrigger;
+
+    // Message handlers run on the same thread as `work`, between calls, so nothing
+    // which blocks is done there. Resources are made for new settings, and whatever they
+    // replace is stopped, on other threads. Each of those waits for the last to finish,
+    // in case they share a file.
+    std::optional<pending_settings> d_pending_settings;
+    std::vector<std::shared_future<void>> d_retiring;
+
+    // The absolute offset of the next sample to be recorded. It lags behind the input by
+    // the samples held back in the ring, in triggered mode.
+    uint64_t d_read_offset;
 
     batch_time d_batch_time;
+    // Only set once an `rx_time` tag has been seen, if batch times are derived from them.
+    std::optional<time_reference> d_time_reference;
+    timestamp_formatter d_timestamp_formatter;
     buffer_state d_buffer_state;
 
-    // Data buffer.
+    // The batch currently being filled.
     int d_nbuffered_samples;
-    std::vector<char> d_data_buffer;
-    std::ofstream d_fdata;
-
-    // Tag buffer.
-    int d_nbuffered_tags;
-    std::vector<float> d_tags_buffer;
-    std::ofstream d_ftags;
+    std::unique_ptr<batch_buffer> d_batch;
     tag_t d_active_tag;
+    // The tags attached to the samples in the current call to work, for every key.
+    std::vector<tag_t> d_tags;
+
+    // Only used if batches are split on tags. The number of boundaries in the batch so
+    // far, the offset of the first tag yet to be checked for a boundary, and the value of
+    // the last tag checked.
+    int d_nboundaries;
+    uint64_t d_next_boundary_check;
+    std::optional<double> d_last_boundary_value;
+
+    // The directory the current batch is written to, and the next in turn.
+    size_t d_active_dir;
+    size_t d_next_dir;
+
+    // Only populated if full batches are written from dedicated threads, one per
+    // directory.
+    std::vector<std::unique_ptr<batch_writer>> d_writers;
+
+    // The batches dropped by the writers, which have yet to be published, and the number
+    // of samples dropped since the flowgraph started.
+    std::vector<dropped_batch> d_dropped;
+    uint64_t d_ndropped_batches;
+    uint64_t d_ndropped_samples;
+
+    block_stats d_stats;
+
+    // Only populated if batches are indexed, one per directory. Each index numbers its
+    // batches in the order they're recorded.
+    std::vector<std::unique_ptr<batch_index_writer>> d_index_writers;
+    std::vector<uint64_t> d_nindexed_batches;
+
+    // Only populated if there's a disk quota, one per directory.
+    std::vector<std::unique_ptr<file_pool>> d_file_pools;
 
+    // The absolute offset of the first sample in the current batch.
+    uint64_t d_sample_offset;
+
+    // Only used in triggered mode. The most recent samples, and their tags, are held
+    // back in the ring until it's known whether they belong to a capture. Each capture
+    // is queued by the offset it starts at.
+    sample_ring d_ring;
+    gr_vector_const_void_star d_ring_items;
+    std::deque<tag_t> d_ring_tags;
+    std::deque<uint64_t> d_capture_starts;
+    uint64_t d_next_capture_offset;
+    bool d_trigger_requested;
+    std::vector<float> d_power_buffer;
+
+    // Only populated in container mode, one per directory.
+    std::vector<std::unique_ptr<segment_writer>> d_segment_writers;
+
+    // Only set if batches are compressed from within the scheduler thread.
+    std::unique_ptr<batch_compressor> d_compressor;
+
+    // Only populated if samples are written to file as they arrive, one per data file.
+    std::vector<std::unique_ptr<stream_writer>> d_stream_writers;
+
+    // Holds converted samples, if they can't be converted straight into the batch.
+    std::vector<char> d_conversion_buffer;
+
+    // Holds samples from every input, interleaved, if they're written to the same file.
+    std::vector<char> d_interleave_buffer;
 
     void init();
     void flush();
+    void finish_streamed_batch();
+    void publish_dropped();
+
+    void handle_command(const pmt::pmt_t& msg);
+    sink_settings get_settings() const;
+    void check_settings(const sink_settings& settings) const;
+    void prepare_settings(const sink_settings& settings);
+    bool settings_ready() const;
+    void apply_settings();
+    void retire(sink_resources resources);
+    void retire(std::future<sink_resources> resources);
+    void reap_retired(bool wait);
+    std::vector<std::unique_ptr<batch_writer>> make_writers(size_t data_size);
+    std::vector<std::unique_ptr<batch_index_writer>>
+    make_index_writers(const std::vector<std::string>& dirs,
+                       const std::string& tag) const;
+    std::vector<std::unique_ptr<segment_writer>> make_segment_writers() const;
+    void respace_captures();
 
     void set_batch_time();
+    void update_time_reference(uint64_t abs_start,
+                               uint64_t abs_end,
+                               std::optional<uint64_t> skip_offset = std::nullopt);
+    size_t select_dir();
+    bool is_compressed() const;
+    bool is_segmented() const;
+    bool has_metadata() const;
+    bool splits_on_tags() const;
+    std::unique_ptr<batch_compressor> make_compressor() const;
 
-    void open_fstream(std::ofstream& f, const std::string& extension);
-    void open_fstreams();
-    void close_fstreams();
+    void set_file_paths();
+    void set_segment();
+    void set_index_entry();
+    void set_metadata();
 
-    int fill_data_buffer(int noutput_items, const char* in);
-    void flush_data_buffer();
+    std::optional<int> find_boundary(int nitems);
+    bool is_boundary_tag(const tag_t& tag) const;
+    int fill_data_buffer(int noutput_items, const gr_vector_const_void_star& input_items);
+    void fill_stream(int nstream, const char* in, size_t nitems, size_t offset);
+    const char* interleave(const gr_vector_const_void_star& input_items, int nitems);
 
+    bool needs_tags() const;
+    void scan_tags(uint64_t abs_start, int noutput_items);
     std::optional<tag_t> get_tag_from_first_sample();
     bool tag_is_set() const;
     void set_initial_active_tag();
     void fill_tag_buffer(int nconsumed);
-    void flush_tag_buffer();
+    void record_tag(double tag_value, uint64_t num_samples);
+    void record_metadata_tags(int nconsumed_items);
+
+    int record(int noutput_items, const gr_vector_const_void_star& input_items);
+    int record_samples(int noutput_items, const gr_vector_const_void_star& input_items);
+    int capture(int noutput_items, const gr_vector_const_void_star& input_items);
+    void detect_triggers(const gr_vector_const_void_star& input_items, int nitems);
+    void add_trigger(uint64_t offset);
+    void replay(int nitems);
+    void skip(int nitems);
 };
 
 } // namespace spectre
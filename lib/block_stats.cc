@@ -0,0 +1,216 @@
+/*
+ * Copyright 2024-2026 Jimmy Fitzpatrick.
+ * This file is part of SPECTRE
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "block_stats.h"
+
+#include <gnuradio/config.h>
+#include <algorithm>
+
+#ifdef GR_CTRLPORT
+#include <gnuradio/basic_block.h>
+#include <gnuradio/rpcregisterhelpers.h>
+#endif
+
+namespace gr {
+namespace spectre {
+
+#ifdef GR_CTRLPORT
+namespace {
+
+// Reads a single counter or histogram on behalf of ControlPort. It owns its
+// registration, and is itself owned by the block, so it lives as long as the block.
+class stats_variable : public rpcbasic_base
+{
+public:
+    stats_variable(const block_stats& stats, size_t index)
+        : d_stats(stats), d_index(index)
+    {
+    }
+
+    uint64_t get_counter() const { return d_stats.get(d_index); }
+    std::vector<float> get_histogram() const
+    {
+        std::vector<uint64_t> counts = d_stats.get_histogram(d_index);
+        return std::vector<float>(counts.begin(), counts.end());
+    }
+
+    void register_counter(const std::string& alias,
+                          const std::string& name,
+                          const std::string& units)
+    {
+        d_registration =
+            rpcbasic_sptr(new rpcbasic_register_get<stats_variable, uint64_t>(
+                alias,
+                name.c_str(),
+                this,
+                &stats_variable::get_counter,
+                pmt::from_uint64(0),
+                pmt::from_uint64(0),
+                pmt::from_uint64(0),
+                units.c_str(),
+                name.c_str(),
+                RPC_PRIVLVL_MIN,
+                DISPTIME));
+    }
+
+    void register_histogram(const std::string& alias,
+                            const std::string& name,
+                            const std::string& units)
+    {
+        d_registration = rpcbasic_sptr(
+            new rpcbasic_register_get<stats_variable, std::vector<float>>(
+                alias,
+                name.c_str(),
+                this,
+                &stats_variable::get_histogram,
+                pmt::make_f32vector(1, 0),
+                pmt::make_f32vector(1, 0),
+                pmt::make_f32vector(1, 0),
+                units.c_str(),
+                name.c_str(),
+                RPC_PRIVLVL_MIN,
+                DISPOPTSTRIP));
+    }
+
+private:
+    const block_stats& d_stats;
+    const size_t d_index;
+    rpcbasic_sptr d_registration;
+};
+
+} // namespace
+#endif
+
+void latency_histogram::record(std::chrono::steady_clock::duration latency)
+{
+    using namespace std::chrono;
+
+    // The bucket is the number of bits needed to hold the latency, in microseconds.
+    uint64_t us = std::max<int64_t>(0, duration_cast<microseconds>(latency).count());
+    size_t bucket = 0;
+    while (us > 0 && bucket < NUM_BUCKETS - 1) {
+        us >>= 1;
+        bucket++;
+    }
+    d_counts[bucket].fetch_add(1, std::memory_order_relaxed);
+}
+
+std::vector<uint64_t> latency_histogram::counts() const
+{
+    std::vector<uint64_t> counts(NUM_BUCKETS);
+    for (size_t n = 0; n < NUM_BUCKETS; n++) {
+        counts[n] = d_counts[n].load(std::memory_order_relaxed);
+    }
+    return counts;
+}
+
+block_stats::block_stats(const std::vector<std::string>& counter_names,
+                         const std::vector<std::string>& histogram_names,
+                         float interval)
+    : d_enabled(interval > 0),
+      d_interval(std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+          std::chrono::duration<float>(interval))),
+      d_next_publish(std::chrono::steady_clock::now() + d_interval),
+      d_counter_names(counter_names),
+      d_histogram_names(histogram_names),
+      d_counters(new std::atomic<uint64_t>[counter_names.size()]()),
+      d_histograms()
+{
+    for (size_t n = 0; n < histogram_names.size(); n++) {
+        d_histograms.push_back(std::make_unique<latency_histogram>());
+    }
+}
+
+void block_stats::set(size_t counter, uint64_t value)
+{
+    if (d_enabled) {
+        d_counters[counter].store(value, std::memory_order_relaxed);
+    }
+}
+
+void block_stats::add_elapsed(size_t counter, time_point start)
+{
+    if (d_enabled) {
+        using namespace std::chrono;
+        auto elapsed = steady_clock::now() - start;
+        add(counter, duration_cast<nanoseconds>(elapsed).count());
+    }
+}
+
+void block_stats::record_elapsed(size_t histogram, time_point start)
+{
+    if (d_enabled) {
+        d_histograms[histogram]->record(std::chrono::steady_clock::now() - start);
+    }
+}
+
+uint64_t block_stats::get(size_t counter) const
+{
+    return d_counters[counter].load(std::memory_order_relaxed);
+}
+
+std::vector<uint64_t> block_stats::get_histogram(size_t histogram) const
+{
+    return d_histograms[histogram]->counts();
+}
+
+latency_histogram* block_stats::histogram(size_t histogram)
+{
+    return (d_enabled) ? d_histograms[histogram].get() : nullptr;
+}
+
+bool block_stats::is_publish_due()
+{
+    if (!d_enabled) {
+        return false;
+    }
+    time_point now = std::chrono::steady_clock::now();
+    if (now < d_next_publish) {
+        return false;
+    }
+    d_next_publish = now + d_interval;
+    return true;
+}
+
+pmt::pmt_t block_stats::to_pmt() const
+{
+    pmt::pmt_t stats = pmt::make_dict();
+    for (size_t n = 0; n < d_counter_names.size(); n++) {
+        stats = pmt::dict_add(
+            stats, pmt::intern(d_counter_names[n]), pmt::from_uint64(get(n)));
+    }
+    for (size_t n = 0; n < d_histogram_names.size(); n++) {
+        std::vector<uint64_t> counts = get_histogram(n);
+        stats = pmt::dict_add(stats,
+                              pmt::intern(d_histogram_names[n]),
+                              pmt::init_u64vector(counts.size(), counts.data()));
+    }
+    return stats;
+}
+
+void block_stats::setup_rpc(gr::basic_block& block,
+                            const std::vector<std::string>& counter_units,
+                            const std::string& histogram_units) const
+{
+#ifdef GR_CTRLPORT
+    for (size_t n = 0; n < d_counter_names.size(); n++) {
+        auto variable = std::make_shared<stats_variable>(*this, n);
+        variable->register_counter(block.alias(), d_counter_names[n], counter_units[n]);
+        block.add_rpc_variable(variable);
+    }
+    // Each bucket counts latencies up to twice as long as the one before (see
+    // `latency_histogram`).
+    for (size_t n = 0; n < d_histogram_names.size(); n++) {
+        auto variable = std::make_shared<stats_variable>(*this, n);
+        variable->register_histogram(
+            block.alias(), d_histogram_names[n], histogram_units);
+        block.add_rpc_variable(variable);
+    }
+#endif
+}
+
+} // namespace spectre
+} // namespace gr
@@ -0,0 +1,126 @@
+/*
+ * Copyright 2024-2026 Jimmy Fitzpatrick.
+ * This file is part of SPECTRE
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef INCLUDED_SPECTRE_BLOCK_STATS_H
+#define INCLUDED_SPECTRE_BLOCK_STATS_H
+
+#include <pmt/pmt.h>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace gr {
+
+class basic_block;
+
+namespace spectre {
+
+/*!
+ * \brief Counts how long something took, in power-of-two buckets of microseconds.
+ *
+ * Bucket 0 counts anything under 1 us, and bucket `n` anything from 2^(n-1) us up to
+ * 2^n us. The last bucket also counts anything longer. Safe to update and read from any
+ * thread.
+ */
+class latency_histogram
+{
+public:
+    static constexpr size_t NUM_BUCKETS = 28;
+
+    void record(std::chrono::steady_clock::duration latency);
+    std::vector<uint64_t> counts() const;
+
+private:
+    std::array<std::atomic<uint64_t>, NUM_BUCKETS> d_counts{};
+};
+
+/*!
+ * \brief Named counters and latency histograms describing how a block is keeping up.
+ *
+ * Every update is a single relaxed atomic operation, so the counters can be updated from
+ * `work` (or a writer thread) and read from anywhere else, e.g., by ControlPort. If the
+ * stats are disabled, every update returns straight away, and no clocks are read.
+ */
+class block_stats
+{
+public:
+    using time_point = std::chrono::steady_clock::time_point;
+
+    /*!
+     * \param counter_names The name of each counter, in the order they're indexed.
+     * \param histogram_names The name of each latency histogram, likewise.
+     * \param interval How often the stats are due to be published, in seconds. If zero,
+     * the stats are disabled.
+     */
+    block_stats(const std::vector<std::string>& counter_names,
+                const std::vector<std::string>& histogram_names,
+                float interval);
+
+    bool enabled() const { return d_enabled; }
+
+    // Inlined, since they're called from the hot path whether or not stats are enabled.
+    void add(size_t counter, uint64_t n)
+    {
+        if (d_enabled) {
+            d_counters[counter].fetch_add(n, std::memory_order_relaxed);
+        }
+    }
+    time_point start() const
+    {
+        return (d_enabled) ? std::chrono::steady_clock::now() : time_point{};
+    }
+
+    // Set a counter which measures a level (e.g., how full a queue is), not a total.
+    void set(size_t counter, uint64_t value);
+    // Add the time since `start`, in nanoseconds.
+    void add_elapsed(size_t counter, time_point start);
+    void record_elapsed(size_t histogram, time_point start);
+    uint64_t get(size_t counter) const;
+    std::vector<uint64_t> get_histogram(size_t histogram) const;
+
+    // Only set if the stats are enabled.
+    latency_histogram* histogram(size_t histogram);
+
+    /*!
+     * \brief Whether the stats are due to be published again. Only call from one thread.
+     */
+    bool is_publish_due();
+
+    /*!
+     * \brief Every counter by name, along with each histogram as a `u64vector`.
+     */
+    pmt::pmt_t to_pmt() const;
+
+    /*!
+     * \brief Make every counter and histogram readable by ControlPort, as variables of
+     * `block`. Call once, from the block's `setup_rpc`. Does nothing if ControlPort is
+     * disabled.
+     *
+     * \param counter_units The units of each counter, in the order they're indexed.
+     * \param histogram_units What each histogram counts (e.g., "batches").
+     */
+    void setup_rpc(gr::basic_block& block,
+                   const std::vector<std::string>& counter_units,
+                   const std::string& histogram_units = "") const;
+
+private:
+    const bool d_enabled;
+    const std::chrono::steady_clock::duration d_interval;
+    time_point d_next_publish;
+    const std::vector<std::string> d_counter_names;
+    const std::vector<std::string> d_histogram_names;
+    std::unique_ptr<std::atomic<uint64_t>[]> d_counters;
+    std::vector<std::unique_ptr<latency_histogram>> d_histograms;
+};
+
+} // namespace spectre
+} // namespace gr
+
+#endif
@@ -0,0 +1,237 @@
+/*
+ * Copyright 2024-2026 Jimmy Fitzpatrick.
+ * This file is part of SPECTRE
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "file_pool.h"
+#include "utils.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+namespace {
+
+// Unlike `pread_all`, a short read isn't an error, since the pool is simply started
+// afresh.
+bool try_pread_all(int fd, char* s, size_t nbytes, uint64_t offset)
+{
+    while (nbytes > 0) {
+        ssize_t nread = ::pread(fd, s, nbytes, offset);
+        if (nread < 0 && errno == EINTR) {
+            continue;
+        }
+        if (nread <= 0) {
+            return false;
+        }
+        s += nread;
+        nbytes -= nread;
+        offset += nread;
+    }
+    return true;
+}
+
+uint64_t get_slot_offset(size_t n)
+{
+    using namespace gr::spectre;
+    return sizeof(file_pool_header) + n * sizeof(file_pool_slot);
+}
+
+} // namespace
+
+namespace gr {
+namespace spectre {
+
+file_pool::file_pool(const std::filesystem::path& filename,
+                     size_t nslots,
+                     size_t nfiles,
+                     size_t file_size)
+    : d_filename(filename),
+      d_dir(filename.parent_path()),
+      d_nslots(nslots),
+      d_nfiles(nfiles),
+      d_file_size(file_size),
+      d_fd(-1),
+      d_slots(),
+      d_next_slot(0)
+{
+    if (d_nslots == 0) {
+        throw std::invalid_argument("A file pool must have at least one slot.");
+    }
+}
+
+file_pool::~file_pool() { close(); }
+
+void file_pool::open()
+{
+    std::lock_guard<std::mutex> lock(d_mutex);
+    if (d_fd < 0) {
+        load();
+    }
+}
+
+void file_pool::acquire(const std::vector<std::filesystem::path>& paths,
+                        int64_t start_ns,
+                        int64_t end_ns)
+{
+    std::lock_guard<std::mutex> lock(d_mutex);
+    if (d_fd < 0) {
+        load();
+    }
+
+    slot& s = d_slots[d_next_slot];
+    for (size_t n = 0; n < s.paths.size(); n++) {
+        if (n >= paths.size()) {
+            ::unlink(s.paths[n].c_str());
+            continue;
+        }
+        // A file which has gone missing is simply created afresh.
+        if (rename_creating_parents(s.paths[n], paths[n]) < 0 && errno != ENOENT) {
+            throw make_system_error("Failed to recycle", s.paths[n]);
+        }
+    }
+
+    s.start_ns = start_ns;
+    s.end_ns = end_ns;
+    s.paths = paths;
+    write_slot(d_next_slot);
+    d_next_slot = (d_next_slot + 1) % d_nslots;
+}
+
+void file_pool::close()
+{
+    std::lock_guard<std::mutex> lock(d_mutex);
+    if (d_fd >= 0) {
+        ::close(d_fd);
+        d_fd = -1;
+    }
+}
+
+void file_pool::load()
+{
+    d_fd = open_creating_parents(d_filename, O_RDWR | O_CREAT | O_CLOEXEC);
+    if (d_fd < 0) {
+        throw make_system_error("Failed to open", d_filename);
+    }
+
+    // Pick up the slots from a previous recording, if there are any.
+    d_slots.assign(d_nslots, slot{ 0, 0, {} });
+    file_pool_header header;
+    bool is_valid =
+        try_pread_all(d_fd, reinterpret_cast<char*>(&header), sizeof(header), 0) &&
+        std::memcmp(header.magic, FILE_POOL_MAGIC, sizeof(header.magic)) == 0 &&
+        header.slot_size == sizeof(file_pool_slot);
+    uint32_t nslots = (is_valid) ? header.nslots : 0;
+    for (size_t n = 0; n < nslots; n++) {
+        file_pool_slot record;
+        char* buffer = reinterpret_cast<char*>(&record);
+        if (!try_pread_all(d_fd, buffer, sizeof(record), get_slot_offset(n))) {
+            break;
+        }
+        slot s{ record.start_ns, record.end_ns, {} };
+        const char* begin = record.paths;
+        const char* end = record.paths + std::min<size_t>(record.paths_size,
+                                                          sizeof(record.paths));
+        while (begin < end) {
+            const char* newline = std::find(begin, end, '\n');
+            s.paths.push_back(d_dir / std::string(begin, newline));
+            begin = newline + 1;
+        }
+
+        if (n < d_nslots) {
+            d_slots[n] = std::move(s);
+        } else {
+            // The pool has shrunk, so these batches are over the quota.
+            for (const auto& path : s.paths) {
+                ::unlink(path.c_str());
+            }
+        }
+    }
+
+    for (size_t n = 0; n < d_nslots; n++) {
+        if (d_slots[n].paths.empty()) {
+            preallocate(n);
+        }
+    }
+
+    // Carry on from the oldest batch. Slots which have yet to hold one start at zero,
+    // so they're claimed first.
+    d_next_slot = 0;
+    for (size_t n = 0; n < d_nslots; n++) {
+        if (d_slots[n].start_ns < d_slots[d_next_slot].start_ns) {
+            d_next_slot = n;
+        }
+    }
+
+    header = file_pool_header{};
+    std::memcpy(header.magic, FILE_POOL_MAGIC, sizeof(header.magic));
+    header.version = FILE_POOL_VERSION;
+    header.header_size = sizeof(file_pool_header);
+    header.slot_size = sizeof(file_pool_slot);
+    header.nslots = d_nslots;
+    pwrite_all(
+        d_fd, reinterpret_cast<const char*>(&header), sizeof(header), 0, d_filename);
+    for (size_t n = 0; n < d_nslots; n++) {
+        write_slot(n);
+    }
+    if (::ftruncate(d_fd, get_slot_offset(d_nslots)) < 0) {
+        throw make_system_error("Failed to truncate", d_filename);
+    }
+}
+
+void file_pool::preallocate(size_t n)
+{
+    slot& s = d_slots[n];
+    s.start_ns = 0;
+    s.end_ns = 0;
+    for (size_t i = 0; i < d_nfiles; i++) {
+        std::filesystem::path path = d_filename;
+        path += "." + std::to_string(n) + "." + std::to_string(i);
+        int fd = open_creating_parents(path, O_WRONLY | O_CREAT | O_CLOEXEC);
+        if (fd < 0) {
+            throw make_system_error("Failed to open", path);
+        }
+        // Unlike `fallocate`, this falls back to writing zeros if the file system can't
+        // allocate space up front.
+        int err = ::posix_fallocate(fd, 0, d_file_size);
+        ::close(fd);
+        if (err != 0) {
+            errno = err;
+            throw make_system_error("Failed to preallocate", path);
+        }
+        s.paths.push_back(path);
+    }
+}
+
+void file_pool::write_slot(size_t n)
+{
+    file_pool_slot record{};
+    record.start_ns = d_slots[n].start_ns;
+    record.end_ns = d_slots[n].end_ns;
+    std::string paths;
+    for (const auto& path : d_slots[n].paths) {
+        paths += path.lexically_relative(d_dir).string() + "\n";
+    }
+    if (paths.size() > sizeof(record.paths)) {
+        throw std::runtime_error("The file paths are too long for the file pool: " +
+                                 d_filename.string());
+    }
+    record.npaths = d_slots[n].paths.size();
+    record.paths_size = paths.size();
+    std::memcpy(record.paths, paths.data(), paths.size());
+    pwrite_all(d_fd,
+               reinterpret_cast<const char*>(&record),
+               sizeof(record),
+               get_slot_offset(n),
+               d_filename);
+}
+
+} // namespace spectre
+} // namespace gr
@@ -0,0 +1,132 @@
+/*
+ * Copyright 2024-2026 Jimmy Fitzpatrick.
+ * This file is part of SPECTRE
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef INCLUDED_SPECTRE_FILE_POOL_H
+#define INCLUDED_SPECTRE_FILE_POOL_H
+
+#include <cstdint>
+#include <filesystem>
+#include <mutex>
+#include <vector>
+
+namespace gr {
+namespace spectre {
+
+static constexpr char FILE_POOL_MAGIC[4] = { 'S', 'P', 'C', 'P' };
+static constexpr uint16_t FILE_POOL_VERSION = 1;
+
+/*!
+ * \brief The fixed-size header at the start of every pool file.
+ */
+struct file_pool_header {
+    char magic[4];
+    uint16_t version;
+    uint16_t header_size;
+    uint32_t slot_size;
+    uint32_t nslots;
+};
+
+static_assert(sizeof(file_pool_header) == 16,
+              "The file pool header must have a fixed size.");
+
+/*!
+ * \brief What a single slot in the pool holds, as recorded in the pool file.
+ *
+ * The paths of the batch's files are relative to the pool file, each terminated by a
+ * newline. All fields are in native (little-endian) byte order. A slot which has yet to
+ * hold a batch has a start and end time of zero, and the paths of its preallocated
+ * files.
+ */
+struct file_pool_slot {
+    // The time range covered by the batch, since the Unix epoch.
+    int64_t start_ns;
+    int64_t end_ns;
+    uint32_t npaths;
+    uint32_t paths_size;
+    char paths[1000];
+};
+
+static_assert(sizeof(file_pool_slot) == 1024,
+              "The file pool slot must have a fixed size.");
+
+/*!
+ * \brief Keeps a fixed number of batches on disk, by recycling the files of the oldest.
+ *
+ * When the pool is opened, the data files for every empty slot are preallocated
+ * alongside the pool file (e.g., `<tag>.pool.<slot>.<file>`). Each new batch takes over
+ * the files of the oldest slot, which are renamed to those of the batch to be
+ * overwritten in place, so that recording doesn't allocate or unlink anything. The pool
+ * file (e.g., `<tag>.pool`) records the time range each slot holds, so the pool carries
+ * on where it left off after a restart. Safe to call from several threads.
+ */
+class file_pool
+{
+public:
+    /*!
+     * \param filename The path to the pool file. It's created if it doesn't already
+     * exist. If it holds more slots than `nslots`, the files of the extra slots are
+     * removed.
+     * \param nslots The number of batches kept on disk.
+     * \param nfiles The number of data files in each batch.
+     * \param file_size The size of each data file, in bytes.
+     */
+    file_pool(const std::filesystem::path& filename,
+              size_t nslots,
+              size_t nfiles,
+              size_t file_size);
+    ~file_pool();
+
+    /*!
+     * \brief Open the pool file, and preallocate the files of any empty slots.
+     *
+     * This is done on the first call to `acquire`, if the pool isn't already open.
+     */
+    void open();
+
+    /*!
+     * \brief Claim the oldest slot for a new batch, recycling its files.
+     *
+     * Each of the slot's files is renamed to the corresponding file in `paths`, in
+     * order, ready to be overwritten. Any left over are removed.
+     */
+    void acquire(const std::vector<std::filesystem::path>& paths,
+                 int64_t start_ns,
+                 int64_t end_ns);
+
+    /*!
+     * \brief Close the pool file.
+     */
+    void close();
+
+private:
+    struct slot {
+        int64_t start_ns;
+        int64_t end_ns;
+        std::vector<std::filesystem::path> paths;
+    };
+
+    // Each of these expects the mutex to be held.
+    void load();
+    void preallocate(size_t n);
+    void write_slot(size_t n);
+
+    const std::filesystem::path d_filename;
+    const std::filesystem::path d_dir;
+    const size_t d_nslots;
+    const size_t d_nfiles;
+    const size_t d_file_size;
+
+    std::mutex d_mutex;
+    int d_fd;
+    std::vector<slot> d_slots;
+    // The slot to be claimed next, which holds the oldest batch (or none at all).
+    size_t d_next_slot;
+};
+
+} // namespace spectre
+} // namespace gr
+
+#endif
@@ -5,16 +5,42 @@
  */
 
 #include "frequency_sweeper_impl.h"
+#include "tracer.h"
 #include "utils.h"
 #include <gnuradio/io_signature.h>
+#include <cmath>
+#include <limits>
 
 namespace {
-int get_num_samples_per_step(float dwell_time, float sample_rate)
+
+static const pmt::pmt_t STATS_PORT = pmt::string_to_symbol("stats");
+
+// The stats kept for each sweeper, indexing the names below.
+enum sweeper_counter {
+    NITEMS = 0,
+    NWORK_CALLS,
+    WORK_TIME_NS,
+    NRETUNES,
+};
+const std::vector<std::string> COUNTER_NAMES{
+    "items", "work_calls", "work_time_ns", "retunes"
+};
+const std::vector<std::string> COUNTER_UNITS{ "items", "calls", "ns", "commands" };
+
+uint64_t get_num_samples_per_step(float dwell_time, float sample_rate)
 {
     // Naturally, we can't have a non-integral number of samples per step,
     // so we floor to ensure that the elapsed time per step doesn't surpass the
-    // user-configured dwell time.
-    return std::floor(dwell_time * sample_rate);
+    // user-configured dwell time. Work in double precision, since a float only holds
+    // sample counts exactly up to 2^24. The arguments are only as precise as a float,
+    // though, so a product within their rounding error of a whole number (e.g., 0.7 s
+    // at 1 kHz) is taken to be exact.
+    double product = static_cast<double>(dwell_time) * static_cast<double>(sample_rate);
+    double nearest = std::round(product);
+    double tolerance = 2 * std::numeric_limits<float>::epsilon() * std::abs(product);
+    double nsamples = (std::abs(product - nearest) <= tolerance) ? nearest
+                                                                 : std::floor(product);
+    return (nsamples > 0) ? static_cast<uint64_t>(nsamples) : 0;
 }
 } // namespace
 
@@ -28,7 +54,8 @@ frequency_sweeper::sptr frequency_sweeper::make(float min_freq,
                                                 float dwell_time,
                                                 float sample_rate,
                                                 const std::string& retune_cmd_name,
-                                                const std::string& input_type)
+                                                const std::string& input_type,
+                                                float stats_interval)
 {
     return gnuradio::make_block_sptr<frequency_sweeper_impl>(min_freq,
                                                              max_freq,
@@ -36,7 +63,8 @@ frequency_sweeper::sptr frequency_sweeper::make(float min_freq,
                                                              dwell_time,
                                                              sample_rate,
                                                              retune_cmd_name,
-                                                             input_type);
+                                                             input_type,
+                                                             stats_interval);
 }
 
 
@@ -46,7 +74,8 @@ frequency_sweeper_impl::frequency_sweeper_impl(float min_freq,
                                                float dwell_time,
                                                float sample_rate,
                                                const std::string& retune_cmd_name,
-                                               const std::string& input_type)
+                                               const std::string& input_type,
+                                               float stats_interval)
     : gr::sync_block("frequency_sweeper",
                      gr::io_signature::make(1, 1, get_sizeof_stream_item(input_type)),
                      gr::io_signature::make(0, 0, 0)),
@@ -56,31 +85,44 @@ frequency_sweeper_impl::frequency_sweeper_impl(float min_freq,
       d_nsamples_per_step(get_num_samples_per_step(dwell_time, sample_rate)),
       d_retune_cmd_name(pmt::string_to_symbol(retune_cmd_name)),
       d_nsamples(0),
-      d_active_freq(min_freq)
+      d_active_freq(min_freq),
+      d_stats(COUNTER_NAMES, {}, stats_interval)
 {
     message_port_register_out(OUTPUT_PORT);
+    message_port_register_out(STATS_PORT);
 }
 
 frequency_sweeper_impl::~frequency_sweeper_impl() {}
 
+void frequency_sweeper_impl::setup_rpc()
+{
+    d_stats.setup_rpc(*this, COUNTER_UNITS);
+}
+
 void frequency_sweeper_impl::publish_retune_command()
 {
+    SPECTRE_TRACE_SCOPE("frequency_sweeper::publish_retune_command", d_active_freq);
     pmt::pmt_t retune_command = pmt::make_dict();
     retune_command =
         pmt::dict_add(retune_command, d_retune_cmd_name, pmt::from_float(d_active_freq));
     message_port_pub(OUTPUT_PORT, retune_command);
+    d_stats.add(NRETUNES, 1);
 }
 
 int frequency_sweeper_impl::work(int noutput_items,
                                  gr_vector_const_void_star& input_items,
                                  gr_vector_void_star& output_items)
 {
-    for (int n = 0; n < noutput_items; n++) {
-        // Measure elapsed time by counting samples.
-        d_nsamples++;
-        if (d_nsamples == d_nsamples_per_step) {
-            // If we've reached the dwell time, increment the center frequency, resetting
-            // it if it's out of range
+    SPECTRE_TRACE_SCOPE("frequency_sweeper::work", noutput_items);
+    block_stats::time_point start = d_stats.start();
+    // Measure elapsed time by counting samples. Rather than counting them one by one,
+    // work out how many times the dwell time is reached within this call.
+    uint64_t nsamples = d_nsamples + static_cast<uint64_t>(noutput_items);
+    if (d_nsamples_per_step > 0) {
+        const uint64_t nsteps = nsamples / d_nsamples_per_step;
+        for (uint64_t n = 0; n < nsteps; n++) {
+            // Each time we reach the dwell time, increment the center frequency,
+            // resetting it if it's out of range
             d_active_freq += d_hop_freq;
             if (d_active_freq > d_max_freq) {
                 d_active_freq = d_min_freq;
@@ -88,9 +130,19 @@ int frequency_sweeper_impl::work(int noutput_items,
 
             // Issue the command to retune the receiver.
             publish_retune_command();
+        }
+
+        // Carry over the samples received since the last retune into the next call.
+        nsamples %= d_nsamples_per_step;
+    }
+    d_nsamples = nsamples;
 
-            // At the next call to work, start recounting samples afresh.
-            d_nsamples = 0;
+    if (d_stats.enabled()) {
+        d_stats.add(NITEMS, noutput_items);
+        d_stats.add(NWORK_CALLS, 1);
+        d_stats.add_elapsed(WORK_TIME_NS, start);
+        if (d_stats.is_publish_due()) {
+            message_port_pub(STATS_PORT, d_stats.to_pmt());
         }
     }
     return noutput_items;
@@ -7,6 +7,7 @@
 #ifndef INCLUDED_SPECTRE_FREQUENCY_SWEEPER_IMPL_H
 #define INCLUDED_SPECTRE_FREQUENCY_SWEEPER_IMPL_H
 
+#include "block_stats.h"
 #include <gnuradio/spectre/frequency_sweeper.h>
 
 namespace gr {
@@ -23,9 +24,12 @@ public:
                            float dwell_time,
                            float sample_rate,
                            const std::string& retune_cmd_name,
-                           const std::string& input_type);
+                           const std::string& input_type,
+                           float stats_interval);
     ~frequency_sweeper_impl();
 
+    void setup_rpc() override;
+
     void publish_retune_command();
     int work(int noutput_items,
              gr_vector_const_void_star& input_items,
@@ -35,10 +39,13 @@ private:
     const float d_min_freq;
     const float d_max_freq;
     const float d_hop_freq;
-    const float d_nsamples_per_step;
+    const uint64_t d_nsamples_per_step;
     pmt::pmt_t d_retune_cmd_name;
-    int d_nsamples;
+    // The number of samples received since the last retune.
+    uint64_t d_nsamples;
     float d_active_freq;
+
+    block_stats d_stats;
 };
 
 } // namespace spectre
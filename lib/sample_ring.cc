@@ -0,0 +1,75 @@
+/*
+ * Copyright 2024-2026 Jimmy Fitzpatrick.
+ * This file is part of SPECTRE
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "sample_ring.h"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+namespace gr {
+namespace spectre {
+
+sample_ring::sample_ring(size_t nchannels, size_t item_size, size_t capacity)
+    : d_item_size(item_size),
+      d_capacity(capacity),
+      d_channels(nchannels, std::vector<char>(capacity * item_size)),
+      d_head(0),
+      d_size(0),
+      d_offset(0)
+{
+}
+
+size_t sample_ring::capacity() const { return d_capacity; }
+
+size_t sample_ring::size() const { return d_size; }
+
+uint64_t sample_ring::offset() const { return d_offset; }
+
+void sample_ring::push(const std::vector<const void*>& items, size_t nitems)
+{
+    if (d_size + nitems > d_capacity) {
+        throw std::length_error("The sample ring is full.");
+    }
+
+    // Copy in up to two parts, either side of the end of the ring.
+    size_t tail = (d_head + d_size) % d_capacity;
+    size_t nfirst = std::min(nitems, d_capacity - tail);
+    for (size_t n = 0; n < d_channels.size(); n++) {
+        const char* in = static_cast<const char*>(items[n]);
+        char* out = d_channels[n].data();
+        std::memcpy(out + tail * d_item_size, in, nfirst * d_item_size);
+        std::memcpy(out, in + nfirst * d_item_size, (nitems - nfirst) * d_item_size);
+    }
+    d_size += nitems;
+}
+
+size_t sample_ring::front(std::vector<const void*>& items) const
+{
+    items.resize(d_channels.size());
+    for (size_t n = 0; n < d_channels.size(); n++) {
+        items[n] = d_channels[n].data() + d_head * d_item_size;
+    }
+    return std::min(d_size, d_capacity - d_head);
+}
+
+void sample_ring::pop(size_t nitems)
+{
+    nitems = std::min(nitems, d_size);
+    d_head = (d_head + nitems) % d_capacity;
+    d_size -= nitems;
+    d_offset += nitems;
+}
+
+void sample_ring::clear(uint64_t offset)
+{
+    d_head = 0;
+    d_size = 0;
+    d_offset = offset;
+}
+
+} // namespace spectre
+} // namespace gr
@@ -0,0 +1,80 @@
+/*
+ * Copyright 2024-2026 Jimmy Fitzpatrick.
+ * This file is part of SPECTRE
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef INCLUDED_SPECTRE_SAMPLE_RING_H
+#define INCLUDED_SPECTRE_SAMPLE_RING_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace gr {
+namespace spectre {
+
+/*!
+ * \brief A fixed-size ring of the most recent samples from each of several inputs.
+ *
+ * Samples are pushed in at the back and popped from the front, in lockstep across every
+ * input. Nothing is allocated once the ring is constructed.
+ */
+class sample_ring
+{
+public:
+    /*!
+     * \param nchannels The number of inputs.
+     * \param item_size The size of each sample, in bytes.
+     * \param capacity The maximum number of samples held per input.
+     */
+    sample_ring(size_t nchannels, size_t item_size, size_t capacity);
+
+    size_t capacity() const;
+    size_t size() const;
+
+    /*!
+     * \brief The absolute offset of the sample at the front of the ring.
+     */
+    uint64_t offset() const;
+
+    /*!
+     * \brief Copy `nitems` samples from each input to the back of the ring, which must
+     * have room for them.
+     */
+    void push(const std::vector<const void*>& items, size_t nitems);
+
+    /*!
+     * \brief Point `items` at the samples at the front of the ring, one per input.
+     *
+     * \return The number of samples which are contiguous in memory from there, which may
+     * be less than the size of the ring if it wraps around.
+     */
+    size_t front(std::vector<const void*>& items) const;
+
+    /*!
+     * \brief Drop `nitems` samples from the front of the ring.
+     */
+    void pop(size_t nitems);
+
+    /*!
+     * \brief Empty the ring, so that the next sample pushed has the absolute offset
+     * `offset`.
+     */
+    void clear(uint64_t offset = 0);
+
+private:
+    const size_t d_item_size;
+    const size_t d_capacity;
+    std::vector<std::vector<char>> d_channels;
+
+    // The index of the front of the ring, in samples.
+    size_t d_head;
+    size_t d_size;
+    uint64_t d_offset;
+};
+
+} // namespace spectre
+} // namespace gr
+
+#endif
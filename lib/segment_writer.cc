@@ -0,0 +1,148 @@
+/*
+ * Copyright 2024-2026 Jimmy Fitzpatrick.
+ * This file is part of SPECTRE
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "segment_writer.h"
+#include "utils.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+namespace {
+
+double get_timestamp(const gr::spectre::segment_record_header& header)
+{
+    return header.timestamp_s + header.timestamp_us * 1e-6;
+}
+
+} // namespace
+
+namespace gr {
+namespace spectre {
+
+segment_writer::segment_writer(uint64_t max_size, double max_duration)
+    : d_max_size(max_size),
+      d_max_duration(max_duration),
+      d_fd(-1),
+      d_filename(),
+      d_nwritten_bytes(0),
+      d_first_timestamp(0)
+{
+}
+
+segment_writer::~segment_writer()
+{
+    try {
+        close();
+    } catch (...) {
+        // There's no one left to report the error to.
+    }
+}
+
+file_range segment_writer::append(const std::filesystem::path& new_segment_path,
+                                  segment_record_header header,
+                                  const char* data,
+                                  size_t data_size,
+                                  const char* tags,
+                                  size_t tags_size,
+                                  const std::string& metadata)
+{
+    std::memcpy(header.magic, SEGMENT_RECORD_MAGIC, sizeof(header.magic));
+    header.version = SEGMENT_RECORD_VERSION;
+    header.header_size = sizeof(segment_record_header);
+    header.data_size = data_size;
+    header.tags_offset = sizeof(segment_record_header) + data_size;
+    header.tags_size = tags_size;
+    header.metadata_size = metadata.size();
+    header.reserved = 0;
+    uint64_t record_size = header.tags_offset + header.tags_size + header.metadata_size;
+
+    std::lock_guard<std::mutex> lock(d_mutex);
+    if (!has_room_for(header, record_size)) {
+        close_segment();
+    }
+    if (d_fd < 0) {
+        open(new_segment_path);
+        d_first_timestamp = get_timestamp(header);
+    }
+    file_range range{ d_filename, d_nwritten_bytes + sizeof(header), data_size };
+
+    write(reinterpret_cast<const char*>(&header), sizeof(header));
+    write(data, data_size);
+    write(tags, tags_size);
+    write(metadata.data(), metadata.size());
+    return range;
+}
+
+void segment_writer::close()
+{
+    std::lock_guard<std::mutex> lock(d_mutex);
+    close_segment();
+}
+
+void segment_writer::close_segment()
+{
+    if (d_fd < 0) {
+        return;
+    }
+    int fd = d_fd;
+    uint64_t nbytes = d_nwritten_bytes;
+    d_fd = -1;
+    d_nwritten_bytes = 0;
+
+    // Release whatever was reserved past the last record, so a segment closed early
+    // (e.g., by the maximum duration, or the flowgraph stopping) doesn't keep taking up
+    // the full segment size on disk.
+    bool ok = (d_max_size == 0 || ::ftruncate(fd, nbytes) == 0);
+    ok = (::close(fd) == 0) && ok;
+    if (!ok) {
+        throw make_system_error("Failed to close", d_filename);
+    }
+}
+
+bool segment_writer::has_room_for(const segment_record_header& header,
+                                  uint64_t record_size) const
+{
+    // An empty segment always has room, even for a record larger than the maximum size.
+    if (d_fd < 0 || d_nwritten_bytes == 0) {
+        return true;
+    }
+    if (d_max_size > 0 && d_nwritten_bytes + record_size > d_max_size) {
+        return false;
+    }
+    double elapsed = get_timestamp(header) - d_first_timestamp;
+    return d_max_duration <= 0 || elapsed < d_max_duration;
+}
+
+void segment_writer::open(const std::filesystem::path& filename)
+{
+    d_fd = open_creating_parents(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC);
+    if (d_fd < 0) {
+        throw make_system_error("Failed to open", filename);
+    }
+    d_filename = filename;
+
+#ifdef __linux__
+    // Reserve space for the whole segment up front, so it isn't fragmented as records
+    // are appended. Keep the apparent file size unchanged, so the file only ever
+    // contains whole records. This is just a hint, so it's fine if the file system
+    // doesn't support it.
+    if (d_max_size > 0) {
+        ::fallocate(d_fd, FALLOC_FL_KEEP_SIZE, 0, d_max_size);
+    }
+#endif
+}
+
+void segment_writer::write(const char* s, size_t nbytes)
+{
+    write_all(d_fd, s, nbytes, d_filename);
+    d_nwritten_bytes += nbytes;
+}
+
+} // namespace spectre
+} // namespace gr
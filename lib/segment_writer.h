@@ -0,0 +1,110 @@
+/*
+ * Copyright 2024-2026 Jimmy Fitzpatrick.
+ * This file is part of SPECTRE
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef INCLUDED_SPECTRE_SEGMENT_WRITER_H
+#define INCLUDED_SPECTRE_SEGMENT_WRITER_H
+
+#include "batch_index_writer.h"
+#include <cstdint>
+#include <filesystem>
+#include <mutex>
+#include <string>
+
+namespace gr {
+namespace spectre {
+
+static constexpr char SEGMENT_RECORD_MAGIC[4] = { 'S', 'P', 'C', 'B' };
+static constexpr uint16_t SEGMENT_RECORD_VERSION = 1;
+
+/*!
+ * \brief The fixed-size header which precedes every batch in a segment file.
+ *
+ * Each record is laid out as the header, followed by `data_size` bytes of data,
+ * `tags_size` bytes of tags (laid out as in the batch's `.hdr` file) and then
+ * `metadata_size` bytes of JSON. All fields are in native (little-endian) byte order.
+ */
+struct segment_record_header {
+    char magic[4];
+    uint16_t version;
+    uint16_t header_size;
+    // The time the first sample in the batch was recorded, since the Unix epoch.
+    int64_t timestamp_s;
+    uint32_t timestamp_us;
+    uint32_t num_channels;
+    // The number of samples in the batch, per channel.
+    uint64_t nsamples;
+    uint64_t data_size;
+    // Relative to the start of the record.
+    uint64_t tags_offset;
+    uint64_t tags_size;
+    uint32_t metadata_size;
+    uint32_t reserved;
+};
+
+static_assert(sizeof(segment_record_header) == 64,
+              "The segment record header must have a fixed size.");
+
+/*!
+ * \brief Appends batches, one record after another, to large preallocated segment files.
+ *
+ * A new segment is started whenever appending the next record would exceed the maximum
+ * segment size, or when the next record is at least the maximum segment duration later
+ * than the first record in the segment. Records are never split across segments, so a
+ * single record may exceed the maximum size. Safe to call from several threads.
+ */
+class segment_writer
+{
+public:
+    /*!
+     * \param max_size The maximum size of each segment, in bytes. Zero for no limit.
+     * \param max_duration The maximum time spanned by each segment, in seconds. Zero for
+     * no limit.
+     */
+    segment_writer(uint64_t max_size, double max_duration);
+    ~segment_writer();
+
+    /*!
+     * \brief Append a record to the current segment.
+     *
+     * \param new_segment_path Where to create the next segment, should this record start
+     * one.
+     * \param header The header for this record. The sizes and offsets are filled in here.
+     * \return Where the data for this record was written.
+     */
+    file_range append(const std::filesystem::path& new_segment_path,
+                      segment_record_header header,
+                      const char* data,
+                      size_t data_size,
+                      const char* tags,
+                      size_t tags_size,
+                      const std::string& metadata);
+
+    /*!
+     * \brief Close the current segment. The next record appended starts a new one.
+     */
+    void close();
+
+private:
+    // Each of these expects the mutex to be held.
+    bool has_room_for(const segment_record_header& header, uint64_t record_size) const;
+    void close_segment();
+    void open(const std::filesystem::path& filename);
+    void write(const char* s, size_t nbytes);
+
+    const uint64_t d_max_size;
+    const double d_max_duration;
+
+    std::mutex d_mutex;
+    int d_fd;
+    std::filesystem::path d_filename;
+    uint64_t d_nwritten_bytes;
+    double d_first_timestamp;
+};
+
+} // namespace spectre
+} // namespace gr
+
+#endif
@@ -0,0 +1,620 @@
+/*
+ * Copyright 2024-2026 Jimmy Fitzpatrick.
+ * This file is part of SPECTRE
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "stream_writer.h"
+#include "utils.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+
+#ifdef SPECTRE_HAVE_LIBURING
+#include <liburing.h>
+#else
+// Never instantiated, but `std::unique_ptr` needs a complete type to be destroyed.
+struct io_uring {
+};
+#endif
+
+namespace {
+
+// Large enough to coalesce the (typically much smaller) chunks passed to `work`.
+static constexpr size_t STAGING_BUFFER_SIZE = 1 << 20;
+
+// Direct I/O requires the buffers, file offsets and write sizes to be aligned. A page is
+// a safe choice for every file system we'd expect to write to.
+static constexpr size_t DIRECT_IO_ALIGNMENT = 4096;
+static constexpr size_t DIRECT_IO_BUFFER_SIZE = 4 << 20;
+
+size_t round_up(size_t n, size_t alignment)
+{
+    return ((n + alignment - 1) / alignment) * alignment;
+}
+
+void reserve_space(int fd, size_t nbytes)
+{
+#ifdef __linux__
+    // Keep the apparent file size unchanged, so that if the flowgraph stops mid-batch
+    // the file only contains the samples that were actually written. This is just a
+    // hint, so it's fine if the file system doesn't support it.
+    ::fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, nbytes);
+#endif
+}
+
+int open_file(const std::filesystem::path& filename, int flags)
+{
+    int fd = gr::spectre::open_creating_parents(filename,
+                                                flags | O_CREAT | O_TRUNC | O_CLOEXEC);
+    if (fd < 0) {
+        throw gr::spectre::make_system_error("Failed to open", filename);
+    }
+    return fd;
+}
+
+} // namespace
+
+namespace gr {
+namespace spectre {
+
+stream_writer::stream_writer()
+    : d_preopened_fd(),
+      d_preopened_filename(),
+      d_preopened_nbytes(0),
+      d_request(),
+      d_stopping(false),
+      d_thread(&stream_writer::run, this)
+{
+}
+
+stream_writer::~stream_writer()
+{
+    discard_preopened();
+    {
+        std::lock_guard<std::mutex> lock(d_mutex);
+        d_stopping = true;
+    }
+    d_requested.notify_one();
+    d_thread.join();
+}
+
+void stream_writer::open(const std::filesystem::path& filename, size_t nbytes)
+{
+    close();
+
+    int fd = -1;
+    if (d_preopened_fd.valid() && d_preopened_nbytes == nbytes) {
+        try {
+            fd = d_preopened_fd.get();
+        } catch (...) {
+            // Try again from scratch, so that the error is reported for the real file.
+        }
+        if (fd >= 0) {
+            if (rename_creating_parents(d_preopened_filename, filename) < 0) {
+                // Most likely, the file has to cross file systems.
+                ::close(fd);
+                ::unlink(d_preopened_filename.c_str());
+                fd = -1;
+            }
+        }
+    }
+    discard_preopened();
+
+    if (fd < 0) {
+        fd = create(filename, nbytes);
+    }
+    attach(fd, filename, nbytes);
+}
+
+void stream_writer::preopen(const std::filesystem::path& filename, size_t nbytes)
+{
+    discard_preopened();
+    d_preopened_filename = filename;
+    d_preopened_nbytes = nbytes;
+    std::packaged_task<int()> request(
+        [this, filename, nbytes]() { return create(filename, nbytes); });
+    d_preopened_fd = request.get_future();
+    {
+        std::lock_guard<std::mutex> lock(d_mutex);
+        d_request = std::move(request);
+    }
+    d_requested.notify_one();
+}
+
+void stream_writer::discard_preopened()
+{
+    if (!d_preopened_fd.valid()) {
+        return;
+    }
+    try {
+        ::close(d_preopened_fd.get());
+        ::unlink(d_preopened_filename.c_str());
+    } catch (...) {
+        // The file couldn't be created, so there's nothing to remove.
+    }
+}
+
+void stream_writer::run()
+{
+    std::unique_lock<std::mutex> lock(d_mutex);
+    while (true) {
+        d_requested.wait(lock, [this] { return d_request.valid() || d_stopping; });
+        if (!d_request.valid()) {
+            return;
+        }
+        std::packaged_task<int()> request = std::move(d_request);
+
+        // Don't hold the lock while creating the file, so the next can be requested.
+        lock.unlock();
+        request();
+        lock.lock();
+    }
+}
+
+staged_stream_writer::staged_stream_writer(size_t staging_size, bool sync_on_close)
+    : d_sync_on_close(sync_on_close),
+      d_fd(-1),
+      d_filename(),
+      d_staging_buffer(std::vector<char>(staging_size, 0)),
+      d_nstaged_bytes(0),
+      d_nwritten_bytes(0)
+{
+}
+
+staged_stream_writer::~staged_stream_writer()
+{
+    // The background thread can't call back into us once we're destroyed.
+    discard_preopened();
+    try {
+        close();
+    } catch (...) {
+        // There's no one left to report the error to.
+    }
+}
+
+int staged_stream_writer::create(const std::filesystem::path& filename,
+                                 size_t nbytes) const
+{
+    int fd = open_file(filename, O_WRONLY);
+    reserve_space(fd, nbytes);
+    return fd;
+}
+
+void staged_stream_writer::attach(int fd,
+                                  const std::filesystem::path& filename,
+                                  size_t nbytes)
+{
+    d_fd = fd;
+    d_filename = filename;
+    d_nwritten_bytes = 0;
+}
+
+void staged_stream_writer::write(const char* s, size_t nbytes)
+{
+    d_nwritten_bytes += nbytes;
+
+    // Make room in the staging buffer, if there isn't enough already.
+    if (d_nstaged_bytes + nbytes > d_staging_buffer.size()) {
+        flush_staging_buffer();
+    }
+
+    // If the chunk still doesn't fit, there's no point copying it first.
+    if (nbytes > d_staging_buffer.size()) {
+        write_all(d_fd, s, nbytes, d_filename);
+        return;
+    }
+
+    std::memcpy(d_staging_buffer.data() + d_nstaged_bytes, s, nbytes);
+    d_nstaged_bytes += nbytes;
+}
+
+void staged_stream_writer::close()
+{
+    if (d_fd < 0) {
+        return;
+    }
+
+    // Close the file even if flushing fails, so we don't leak the descriptor.
+    int fd = d_fd;
+    d_fd = -1;
+    try {
+        write_all(fd, d_staging_buffer.data(), d_nstaged_bytes, d_filename);
+        // If the file wasn't filled (e.g., the batch ended early on a tag, or the
+        // flowgraph stopped mid-batch), release the space reserved past the end of it.
+        if (::ftruncate(fd, d_nwritten_bytes) < 0) {
+            throw make_system_error("Failed to resize", d_filename);
+        }
+        if (d_sync_on_close && ::fdatasync(fd) < 0) {
+            throw make_system_error("Failed to sync", d_filename);
+        }
+    } catch (...) {
+        d_nstaged_bytes = 0;
+        ::close(fd);
+        throw;
+    }
+    d_nstaged_bytes = 0;
+
+    if (::close(fd) < 0) {
+        throw make_system_error("Failed to close", d_filename);
+    }
+}
+
+void staged_stream_writer::flush_staging_buffer()
+{
+    write_all(d_fd, d_staging_buffer.data(), d_nstaged_bytes, d_filename);
+    d_nstaged_bytes = 0;
+}
+
+mmap_stream_writer::mmap_stream_writer(bool sync_on_close)
+    : d_sync_on_close(sync_on_close),
+      d_fd(-1),
+      d_filename(),
+      d_mapping(nullptr),
+      d_mapping_size(0),
+      d_nwritten_bytes(0)
+{
+}
+
+mmap_stream_writer::~mmap_stream_writer()
+{
+    discard_preopened();
+    try {
+        close();
+    } catch (...) {
+        // There's no one left to report the error to.
+    }
+}
+
+int mmap_stream_writer::create(const std::filesystem::path& filename, size_t nbytes) const
+{
+    int fd = open_file(filename, O_RDWR);
+
+    // The file has to be at its final size before it's mapped, since writing past the
+    // end of the file through the mapping is an error.
+    reserve_space(fd, nbytes);
+    if (::ftruncate(fd, nbytes) < 0) {
+        std::runtime_error error = make_system_error("Failed to resize", filename);
+        ::close(fd);
+        throw error;
+    }
+    return fd;
+}
+
+void mmap_stream_writer::attach(int fd,
+                                const std::filesystem::path& filename,
+                                size_t nbytes)
+{
+    d_fd = fd;
+    d_filename = filename;
+    d_nwritten_bytes = 0;
+
+    if (nbytes == 0) {
+        return;
+    }
+    void* mapping = ::mmap(nullptr, nbytes, PROT_WRITE, MAP_SHARED, d_fd, 0);
+    if (mapping == MAP_FAILED) {
+        throw make_system_error("Failed to map", filename);
+    }
+    d_mapping = static_cast<char*>(mapping);
+    d_mapping_size = nbytes;
+
+    // We only ever write each page once, front to back.
+    ::madvise(d_mapping, d_mapping_size, MADV_SEQUENTIAL);
+}
+
+void mmap_stream_writer::write(const char* s, size_t nbytes)
+{
+    if (d_nwritten_bytes + nbytes > d_mapping_size) {
+        throw std::runtime_error("Attempted to write past the end of: " +
+                                 d_filename.string());
+    }
+    std::memcpy(d_mapping + d_nwritten_bytes, s, nbytes);
+    d_nwritten_bytes += nbytes;
+}
+
+void mmap_stream_writer::close()
+{
+    if (d_fd < 0) {
+        return;
+    }
+
+    int fd = d_fd;
+    d_fd = -1;
+    bool ok = true;
+    if (d_mapping) {
+        // With `MS_ASYNC`, this only schedules the write back and returns immediately.
+        int flags = (d_sync_on_close) ? MS_SYNC : MS_ASYNC;
+        ok = (::msync(d_mapping, d_mapping_size, flags) == 0);
+        ok = (::munmap(d_mapping, d_mapping_size) == 0) && ok;
+        d_mapping = nullptr;
+        d_mapping_size = 0;
+    }
+
+    // If the file wasn't filled (e.g., the flowgraph stopped mid-batch), trim it so it
+    // only contains the samples which were actually written.
+    ok = (::ftruncate(fd, d_nwritten_bytes) == 0) && ok;
+    ok = (::close(fd) == 0) && ok;
+    if (!ok) {
+        throw make_system_error("Failed to close", d_filename);
+    }
+}
+
+void direct_stream_writer::aligned_deleter::operator()(char* p) const { std::free(p); }
+
+direct_stream_writer::direct_stream_writer(size_t buffer_size,
+                                           size_t max_inflight,
+                                           bool sync_on_close)
+    : d_sync_on_close(sync_on_close),
+      d_buffer_size(round_up(buffer_size, DIRECT_IO_ALIGNMENT)),
+      d_fd(-1),
+      d_filename(),
+      d_nwritten_bytes(0),
+      d_submitted_offset(0),
+      d_active_buffer(nullptr),
+      d_nactive_bytes(0),
+      d_ring(nullptr),
+      d_ninflight(0)
+{
+    // One buffer is always being filled, while the rest may be in flight.
+    for (size_t n = 0; n < max_inflight + 1; n++) {
+        void* p = std::aligned_alloc(DIRECT_IO_ALIGNMENT, d_buffer_size);
+        if (!p) {
+            throw std::bad_alloc();
+        }
+        d_buffers.emplace_back(static_cast<char*>(p));
+        d_buffer_writes.push_back(buffer_write{ d_buffers.back().get(), 0 });
+        d_free_buffers.push_back(d_buffers.back().get());
+    }
+
+#ifdef SPECTRE_HAVE_LIBURING
+    if (max_inflight > 0) {
+        d_ring = std::make_unique<io_uring>();
+        // If io_uring is unavailable (e.g., an older kernel, or it's been disabled), fall
+        // back to synchronous writes.
+        if (io_uring_queue_init(max_inflight, d_ring.get(), 0) < 0) {
+            d_ring.reset();
+        }
+    }
+#endif
+}
+
+direct_stream_writer::~direct_stream_writer()
+{
+    discard_preopened();
+    try {
+        close();
+    } catch (...) {
+        // There's no one left to report the error to.
+    }
+#ifdef SPECTRE_HAVE_LIBURING
+    if (d_ring) {
+        io_uring_queue_exit(d_ring.get());
+    }
+#endif
+}
+
+int direct_stream_writer::create(const std::filesystem::path& filename,
+                                 size_t nbytes) const
+{
+    int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+    int fd = open_creating_parents(filename, flags | O_DIRECT);
+    if (fd < 0 && errno == EINVAL) {
+        // The file system doesn't support direct I/O (e.g., tmpfs).
+        fd = open_creating_parents(filename, flags);
+    }
+    if (fd < 0) {
+        throw make_system_error("Failed to open", filename);
+    }
+    reserve_space(fd, nbytes);
+    return fd;
+}
+
+void direct_stream_writer::attach(int fd,
+                                  const std::filesystem::path& filename,
+                                  size_t nbytes)
+{
+    d_fd = fd;
+    d_filename = filename;
+    d_nwritten_bytes = 0;
+    d_submitted_offset = 0;
+    acquire_active_buffer();
+}
+
+void direct_stream_writer::write(const char* s, size_t nbytes)
+{
+    while (nbytes > 0) {
+        size_t nchunk = std::min(nbytes, d_buffer_size - d_nactive_bytes);
+        std::memcpy(d_active_buffer + d_nactive_bytes, s, nchunk);
+        d_nactive_bytes += nchunk;
+        d_nwritten_bytes += nchunk;
+        s += nchunk;
+        nbytes -= nchunk;
+
+        if (d_nactive_bytes == d_buffer_size) {
+            submit_active_buffer(d_buffer_size);
+            acquire_active_buffer();
+        }
+    }
+}
+
+void direct_stream_writer::close()
+{
+    if (d_fd < 0) {
+        return;
+    }
+
+    int fd = d_fd;
+    try {
+        // Direct I/O can only write whole blocks, so pad out the last one. The padding is
+        // trimmed off again once everything has been written.
+        if (d_nactive_bytes > 0) {
+            size_t nbytes = round_up(d_nactive_bytes, DIRECT_IO_ALIGNMENT);
+            std::memset(d_active_buffer + d_nactive_bytes, 0, nbytes - d_nactive_bytes);
+            submit_active_buffer(nbytes);
+        } else if (d_active_buffer) {
+            d_free_buffers.push_back(d_active_buffer);
+            d_active_buffer = nullptr;
+        }
+        while (d_ninflight > 0) {
+            wait_for_one();
+        }
+        // Trim the padding, and release any space reserved past the end of the file if
+        // it wasn't filled.
+        if (::ftruncate(fd, d_nwritten_bytes) < 0) {
+            throw make_system_error("Failed to resize", d_filename);
+        }
+        if (d_sync_on_close && ::fdatasync(fd) < 0) {
+            throw make_system_error("Failed to sync", d_filename);
+        }
+    } catch (...) {
+        // Drop anything still in flight, so the writer is usable for the next file.
+        while (d_ninflight > 0) {
+            try {
+                wait_for_one();
+            } catch (...) {
+            }
+        }
+        d_fd = -1;
+        ::close(fd);
+        throw;
+    }
+
+    d_fd = -1;
+    if (::close(fd) < 0) {
+        throw make_system_error("Failed to close", d_filename);
+    }
+}
+
+void direct_stream_writer::submit_active_buffer(size_t nbytes)
+{
+    char* buffer = d_active_buffer;
+    uint64_t offset = d_submitted_offset;
+    d_active_buffer = nullptr;
+    d_nactive_bytes = 0;
+    d_submitted_offset += nbytes;
+
+#ifdef SPECTRE_HAVE_LIBURING
+    if (d_ring) {
+        io_uring_sqe* sqe = io_uring_get_sqe(d_ring.get());
+        if (!sqe) {
+            // The submission queue is sized to the number of buffers, so this shouldn't
+            // happen, but make room just in case.
+            wait_for_one();
+            sqe = io_uring_get_sqe(d_ring.get());
+        }
+        auto write = std::find_if(
+            d_buffer_writes.begin(),
+            d_buffer_writes.end(),
+            [buffer](const buffer_write& w) { return w.buffer == buffer; });
+        write->nbytes = nbytes;
+        io_uring_prep_write(sqe, d_fd, buffer, nbytes, offset);
+        io_uring_sqe_set_data(sqe, &*write);
+        int ret = io_uring_submit(d_ring.get());
+        if (ret < 0) {
+            d_free_buffers.push_back(buffer);
+            errno = -ret;
+            throw make_system_error("Failed to submit write", d_filename);
+        }
+        d_ninflight++;
+        return;
+    }
+#endif
+
+    try {
+        pwrite_all(d_fd, buffer, nbytes, offset, d_filename);
+    } catch (...) {
+        d_free_buffers.push_back(buffer);
+        throw;
+    }
+    d_free_buffers.push_back(buffer);
+}
+
+void direct_stream_writer::acquire_active_buffer()
+{
+    // If every buffer is in flight, wait for one to come back.
+    while (d_free_buffers.empty()) {
+        wait_for_one();
+    }
+    d_active_buffer = d_free_buffers.back();
+    d_free_buffers.pop_back();
+    d_nactive_bytes = 0;
+}
+
+void direct_stream_writer::wait_for_one()
+{
+#ifdef SPECTRE_HAVE_LIBURING
+    if (d_ring && d_ninflight > 0) {
+        io_uring_cqe* cqe = nullptr;
+        int ret = io_uring_wait_cqe(d_ring.get(), &cqe);
+        if (ret < 0) {
+            errno = -ret;
+            throw make_system_error("Failed to wait for write", d_filename);
+        }
+        int res = cqe->res;
+        const buffer_write* write =
+            static_cast<const buffer_write*>(io_uring_cqe_get_data(cqe));
+        d_free_buffers.push_back(write->buffer);
+        io_uring_cqe_seen(d_ring.get(), cqe);
+        d_ninflight--;
+
+        // A short write can't be resumed with direct I/O, since the remainder would no
+        // longer be aligned. In practice, they don't happen for regular files, but if
+        // one does, the rest of the buffer would be left as a hole in the file.
+        if (res < 0) {
+            errno = -res;
+            throw make_system_error("Failed to write", d_filename);
+        }
+        if (static_cast<size_t>(res) != write->nbytes) {
+            throw std::runtime_error("Short write to: " + d_filename.string() + " (" +
+                                     std::to_string(res) + " of " +
+                                     std::to_string(write->nbytes) + " bytes)");
+        }
+        return;
+    }
+#endif
+    throw std::logic_error("Waiting for a write, but none are in flight.");
+}
+
+write_mode get_write_mode(const std::string& name)
+{
+    if (name == "buffered") {
+        return write_mode::buffered;
+    }
+    if (name == "streaming") {
+        return write_mode::streaming;
+    }
+    if (name == "mmap") {
+        return write_mode::mmap;
+    }
+    if (name == "direct") {
+        return write_mode::direct;
+    }
+    throw std::invalid_argument("Unsupported write mode: " + name);
+}
+
+std::unique_ptr<stream_writer> make_stream_writer(write_mode mode,
+                                                  bool sync_on_close,
+                                                  int queue_depth)
+{
+    if (mode == write_mode::streaming) {
+        return std::make_unique<staged_stream_writer>(STAGING_BUFFER_SIZE, sync_on_close);
+    } else if (mode == write_mode::mmap) {
+        return std::make_unique<mmap_stream_writer>(sync_on_close);
+    } else if (mode == write_mode::direct) {
+        return std::make_unique<direct_stream_writer>(
+            DIRECT_IO_BUFFER_SIZE, queue_depth, sync_on_close);
+    } else {
+        throw std::invalid_argument("The buffered write mode has no stream writer.");
+    }
+}
+
+} // namespace spectre
+} // namespace gr
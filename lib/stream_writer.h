@@ -0,0 +1,245 @@
+/*
+ * Copyright 2024-2026 Jimmy Fitzpatrick.
+ * This file is part of SPECTRE
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef INCLUDED_SPECTRE_STREAM_WRITER_H
+#define INCLUDED_SPECTRE_STREAM_WRITER_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <filesystem>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct io_uring;
+
+namespace gr {
+namespace spectre {
+
+/*!
+ * \brief Writes the data for one batch at a time straight to file, as samples arrive.
+ */
+class stream_writer
+{
+public:
+    stream_writer();
+    virtual ~stream_writer();
+
+    /*!
+     * \brief Open a new file, creating any missing parent directories.
+     *
+     * If a file of the same size has been preopened, it's renamed to `filename` instead,
+     * which is much cheaper than creating it from scratch.
+     *
+     * \param filename The file to write to. It's truncated if it already exists.
+     * \param nbytes The size of the file, once every sample in the batch is written.
+     */
+    void open(const std::filesystem::path& filename, size_t nbytes);
+
+    /*!
+     * \brief Start creating the next file on the writer's background thread, under a
+     * temporary name, ready to be opened.
+     *
+     * It should be on the same file system as the file it'll be renamed to. Otherwise,
+     * it's discarded and the file is created when it's opened.
+     */
+    void preopen(const std::filesystem::path& filename, size_t nbytes);
+
+    /*!
+     * \brief Remove the preopened file, if there is one.
+     */
+    void discard_preopened();
+
+    /*!
+     * \brief Append `nbytes` from `s` to the open file.
+     */
+    virtual void write(const char* s, size_t nbytes) = 0;
+
+    /*!
+     * \brief Make sure everything written so far reaches the file, then close it.
+     */
+    virtual void close() = 0;
+
+protected:
+    /*!
+     * \brief Create (or truncate) a file ready to be written, and return its descriptor.
+     *
+     * This may be called from a background thread, so it mustn't modify the writer.
+     */
+    virtual int create(const std::filesystem::path& filename, size_t nbytes) const = 0;
+
+    /*!
+     * \brief Start writing to a file returned by `create`.
+     */
+    virtual void attach(int fd, const std::filesystem::path& filename, size_t nbytes) = 0;
+
+private:
+    void run();
+
+    std::future<int> d_preopened_fd;
+    std::filesystem::path d_preopened_filename;
+    size_t d_preopened_nbytes;
+
+    // The file to be preopened is handed to a single thread, which lives as long as the
+    // writer.
+    std::mutex d_mutex;
+    std::condition_variable d_requested;
+    std::packaged_task<int()> d_request;
+    bool d_stopping;
+    std::thread d_thread;
+};
+
+/*!
+ * \brief Writes to file through a small staging buffer, so that many short writes are
+ * coalesced into fewer, larger ones.
+ *
+ * Space for the whole file is reserved up front (where the file system supports it), to
+ * limit fragmentation as the file grows. Whatever isn't used is released on closing.
+ */
+class staged_stream_writer : public stream_writer
+{
+public:
+    staged_stream_writer(size_t staging_size, bool sync_on_close);
+    ~staged_stream_writer() override;
+
+    void write(const char* s, size_t nbytes) override;
+    void close() override;
+
+protected:
+    int create(const std::filesystem::path& filename, size_t nbytes) const override;
+    void attach(int fd, const std::filesystem::path& filename, size_t nbytes) override;
+
+private:
+    void flush_staging_buffer();
+
+    const bool d_sync_on_close;
+    int d_fd;
+    std::filesystem::path d_filename;
+    std::vector<char> d_staging_buffer;
+    size_t d_nstaged_bytes;
+    // Including those still in the staging buffer.
+    size_t d_nwritten_bytes;
+};
+
+/*!
+ * \brief Writes to file by copying straight into a memory mapping of the file.
+ *
+ * Each file is created at its final size and mapped into memory when it's opened, so
+ * samples are copied once, directly into the page cache.
+ */
+class mmap_stream_writer : public stream_writer
+{
+public:
+    mmap_stream_writer(bool sync_on_close);
+    ~mmap_stream_writer() override;
+
+    void write(const char* s, size_t nbytes) override;
+    void close() override;
+
+protected:
+    int create(const std::filesystem::path& filename, size_t nbytes) const override;
+    void attach(int fd, const std::filesystem::path& filename, size_t nbytes) override;
+
+private:
+    const bool d_sync_on_close;
+    int d_fd;
+    std::filesystem::path d_filename;
+    char* d_mapping;
+    size_t d_mapping_size;
+    size_t d_nwritten_bytes;
+};
+
+/*!
+ * \brief Writes to file with direct I/O, bypassing the page cache.
+ *
+ * Samples are copied into a pool of page-aligned buffers, and each buffer is written to
+ * file as soon as it's full. If built with liburing, several writes are kept in flight
+ * at once using io_uring. Otherwise (or if io_uring is unavailable at runtime), each
+ * buffer is written synchronously with `pwrite`. Falls back to buffered I/O if the file
+ * system doesn't support `O_DIRECT`.
+ */
+class direct_stream_writer : public stream_writer
+{
+public:
+    direct_stream_writer(size_t buffer_size, size_t max_inflight, bool sync_on_close);
+    ~direct_stream_writer() override;
+
+    void write(const char* s, size_t nbytes) override;
+    void close() override;
+
+protected:
+    int create(const std::filesystem::path& filename, size_t nbytes) const override;
+    void attach(int fd, const std::filesystem::path& filename, size_t nbytes) override;
+
+private:
+    struct aligned_deleter {
+        void operator()(char* p) const;
+    };
+
+    // A buffer, and how many bytes of it were last submitted to be written.
+    struct buffer_write {
+        char* buffer;
+        size_t nbytes;
+    };
+
+    void submit_active_buffer(size_t nbytes);
+    void acquire_active_buffer();
+    void wait_for_one();
+
+    const bool d_sync_on_close;
+    const size_t d_buffer_size;
+    int d_fd;
+    std::filesystem::path d_filename;
+    size_t d_nwritten_bytes;
+    uint64_t d_submitted_offset;
+
+    std::vector<std::unique_ptr<char, aligned_deleter>> d_buffers;
+    // One for each buffer, in the same order. Each write in flight carries a pointer to
+    // its own, so its completion can be checked against the length submitted.
+    std::vector<buffer_write> d_buffer_writes;
+    std::vector<char*> d_free_buffers;
+    char* d_active_buffer;
+    size_t d_nactive_bytes;
+
+    // Only set if writes are submitted through io_uring.
+    std::unique_ptr<io_uring> d_ring;
+    size_t d_ninflight;
+};
+
+/*!
+ * \brief How the sink writes batches to file.
+ */
+enum class write_mode {
+    // Each batch is held in memory until it's full, then written in one go.
+    buffered,
+    // Samples are written as they arrive, through one of the stream writers.
+    streaming,
+    mmap,
+    direct,
+};
+
+write_mode get_write_mode(const std::string& name);
+
+/*!
+ * \brief Make a stream writer for the input write mode.
+ *
+ * \param mode Either `streaming`, `mmap` or `direct`.
+ * \param sync_on_close If true, block on closing each file until its contents have
+ * reached the disk. Otherwise, leave it to the kernel to write them back in its own time.
+ * \param queue_depth The number of writes which may be in flight at once. Only used by
+ * the `direct` write mode.
+ */
+std::unique_ptr<stream_writer> make_stream_writer(write_mode mode,
+                                                  bool sync_on_close,
+                                                  int queue_depth);
+
+} // namespace spectre
+} // namespace gr
+
+#endif
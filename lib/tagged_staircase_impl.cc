@@ -5,12 +5,26 @@
  */
 
 #include "tagged_staircase_impl.h"
+#include "tracer.h"
 #include <gnuradio/io_signature.h>
 #include <gnuradio/tagged_stream_block.h>
 
 namespace {
 
 static constexpr int OUTPUT_PORT = 0;
+static const pmt::pmt_t STATS_PORT = pmt::string_to_symbol("stats");
+
+// The stats kept for each staircase, indexing the names below.
+enum staircase_counter {
+    NITEMS = 0,
+    NWORK_CALLS,
+    WORK_TIME_NS,
+    NTAGS,
+};
+const std::vector<std::string> COUNTER_NAMES{
+    "items", "work_calls", "work_time_ns", "tags"
+};
+const std::vector<std::string> COUNTER_UNITS{ "items", "calls", "ns", "tags" };
 
 float compute_initial_freq(const float sample_rate)
 {
@@ -33,13 +47,15 @@ tagged_staircase::sptr tagged_staircase::make(int min_samples_per_step,
                                               int max_samples_per_step,
                                               float hop_freq,
                                               int step_increment,
-                                              float sample_rate)
+                                              float sample_rate,
+                                              float stats_interval)
 {
     return gnuradio::make_block_sptr<tagged_staircase_impl>(min_samples_per_step,
                                                             max_samples_per_step,
                                                             hop_freq,
                                                             step_increment,
-                                                            sample_rate);
+                                                            sample_rate,
+                                                            stats_interval);
 }
 
 
@@ -47,7 +63,8 @@ tagged_staircase_impl::tagged_staircase_impl(int min_samples_per_step,
                                              int max_samples_per_step,
                                              float hop_freq,
                                              int step_increment,
-                                             float sample_rate)
+                                             float sample_rate,
+                                             float stats_interval)
     : gr::sync_block("tagged_staircase",
                      gr::io_signature::make(0, 0, 0),
                      gr::io_signature::make(1, 1, sizeof(output_type))),
@@ -59,13 +76,20 @@ tagged_staircase_impl::tagged_staircase_impl(int min_samples_per_step,
       d_nstep(0),
       d_nsamples(0),
       d_nsamples_per_step(min_samples_per_step),
-      d_active_freq(d_initial_freq)
+      d_active_freq(d_initial_freq),
+      d_stats(COUNTER_NAMES, {}, stats_interval)
 {
+    message_port_register_out(STATS_PORT);
 }
 
 
 tagged_staircase_impl::~tagged_staircase_impl() {}
 
+void tagged_staircase_impl::setup_rpc()
+{
+    d_stats.setup_rpc(*this, COUNTER_UNITS);
+}
+
 void tagged_staircase_impl::tag_step(int rel_sample_index)
 {
     // Tag the first sample in a new step using the sample index relative to the current
@@ -74,6 +98,7 @@ void tagged_staircase_impl::tag_step(int rel_sample_index)
     const pmt::pmt_t value = pmt::from_float(d_active_freq);
     const pmt::pmt_t srcid = pmt::string_to_symbol(alias());
     add_item_tag(OUTPUT_PORT, absolute_offset, TAG_KEY, value, srcid);
+    d_stats.add(NTAGS, 1);
 }
 
 
@@ -81,7 +106,8 @@ int tagged_staircase_impl::work(int noutput_items,
                                 gr_vector_const_void_star& input_items,
                                 gr_vector_void_star& output_items)
 {
-
+    SPECTRE_TRACE_SCOPE("tagged_staircase::work", noutput_items);
+    block_stats::time_point start = d_stats.start();
     output_type* out = static_cast<output_type*>(output_items[0]);
 
     for (int n = 0; n < noutput_items; n++) {
@@ -113,6 +139,14 @@ int tagged_staircase_impl::work(int noutput_items,
         }
     }
 
+    if (d_stats.enabled()) {
+        d_stats.add(NITEMS, noutput_items);
+        d_stats.add(NWORK_CALLS, 1);
+        d_stats.add_elapsed(WORK_TIME_NS, start);
+        if (d_stats.is_publish_due()) {
+            message_port_pub(STATS_PORT, d_stats.to_pmt());
+        }
+    }
     return noutput_items;
 }
 
@@ -7,6 +7,7 @@
 #ifndef INCLUDED_SPECTRE_TAGGED_STAIRCASE_IMPL_H
 #define INCLUDED_SPECTRE_TAGGED_STAIRCASE_IMPL_H
 
+#include "block_stats.h"
 #include <gnuradio/spectre/tagged_staircase.h>
 
 namespace gr {
@@ -21,10 +22,13 @@ public:
                           int max_samples_per_step,
                           float hop_freq,
                           int step_increment,
-                          float sample_rate);
+                          float sample_rate,
+                          float stats_interval);
 
     ~tagged_staircase_impl();
 
+    void setup_rpc() override;
+
     void tag_step(int rel_sample_index);
 
     int work(int noutput_items,
@@ -42,6 +46,8 @@ private:
     int d_nsamples;
     int d_nsamples_per_step;
     float d_active_freq;
+
+    block_stats d_stats;
 };
 
 } // namespace spectre
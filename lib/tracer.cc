@@ -0,0 +1,258 @@
+/*
+ * Copyright 2024-2026 Jimmy Fitzpatrick.
+ * This file is part of SPECTRE
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "tracer.h"
+#include <gnuradio/spectre/trace.h>
+
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+
+namespace {
+
+constexpr size_t TRACE_BUFFER_CAPACITY = 1 << 16;
+
+struct trace_event {
+    // Nanoseconds on the monotonic clock.
+    uint64_t timestamp_ns;
+    const char* name;
+    int64_t arg;
+    // The thread which recorded the event, since a buffer outlives its thread.
+    pid_t tid;
+    char phase;
+};
+
+/*
+ * The events recorded by a single thread at a time. Only that thread writes to it. Once
+ * it's full, each new event overwrites the oldest.
+ */
+struct trace_buffer {
+    // The number of events ever recorded. Each is published once it's been written.
+    std::atomic<uint64_t> nevents{ 0 };
+    std::unique_ptr<trace_event[]> events{ new trace_event[TRACE_BUFFER_CAPACITY] };
+};
+
+/*
+ * Every buffer, and the name of every thread which has recorded into one. When a thread
+ * exits, its buffer is handed on to the next thread to record an event, so restarting a
+ * flowgraph (with new scheduler threads) doesn't allocate more. The exited thread's
+ * events are kept until they're overwritten.
+ */
+class trace_registry
+{
+public:
+    static trace_registry& get()
+    {
+        static trace_registry registry;
+        return registry;
+    }
+
+    trace_buffer* acquire(pid_t tid)
+    {
+        char name[16] = { 0 };
+        ::pthread_getname_np(::pthread_self(), name, sizeof(name));
+
+        std::lock_guard<std::mutex> lock(d_mutex);
+        d_thread_names[tid] = name;
+        if (!d_free_buffers.empty()) {
+            trace_buffer* buffer = d_free_buffers.back();
+            d_free_buffers.pop_back();
+            return buffer;
+        }
+        d_buffers.push_back(std::make_shared<trace_buffer>());
+        return d_buffers.back().get();
+    }
+
+    void release(trace_buffer* buffer)
+    {
+        std::lock_guard<std::mutex> lock(d_mutex);
+        d_free_buffers.push_back(buffer);
+    }
+
+    std::vector<std::shared_ptr<trace_buffer>> buffers()
+    {
+        std::lock_guard<std::mutex> lock(d_mutex);
+        return d_buffers;
+    }
+
+    std::map<pid_t, std::string> thread_names()
+    {
+        std::lock_guard<std::mutex> lock(d_mutex);
+        return d_thread_names;
+    }
+
+private:
+    std::mutex d_mutex;
+    std::vector<std::shared_ptr<trace_buffer>> d_buffers;
+    std::vector<trace_buffer*> d_free_buffers;
+    // As each thread was named when it first recorded an event.
+    std::map<pid_t, std::string> d_thread_names;
+};
+
+/*
+ * Holds a buffer for as long as its thread is running.
+ */
+class thread_buffer
+{
+public:
+    thread_buffer()
+        : tid(static_cast<pid_t>(::syscall(SYS_gettid))),
+          buffer(trace_registry::get().acquire(tid))
+    {
+    }
+    ~thread_buffer() { trace_registry::get().release(buffer); }
+
+    thread_buffer(const thread_buffer&) = delete;
+    thread_buffer& operator=(const thread_buffer&) = delete;
+
+    const pid_t tid;
+    trace_buffer* const buffer;
+};
+
+thread_buffer& get_thread_buffer()
+{
+    thread_local thread_buffer buffer;
+    return buffer;
+}
+
+// The events in a buffer which haven't been overwritten, oldest first.
+std::vector<trace_event> read_events(const trace_buffer& buffer)
+{
+    uint64_t end = buffer.nevents.load(std::memory_order_acquire);
+    uint64_t begin = (end > TRACE_BUFFER_CAPACITY) ? end - TRACE_BUFFER_CAPACITY : 0;
+    std::vector<trace_event> events;
+    events.reserve(end - begin);
+    for (uint64_t n = begin; n < end; n++) {
+        events.push_back(buffer.events[n % TRACE_BUFFER_CAPACITY]);
+    }
+
+    // Events may have been recorded while they were being copied. Any which could have
+    // been overwritten in the meantime (including one part-way through being written)
+    // are discarded.
+    uint64_t new_end = buffer.nevents.load(std::memory_order_acquire);
+    if (new_end + 1 > begin + TRACE_BUFFER_CAPACITY) {
+        uint64_t first_valid = new_end + 1 - TRACE_BUFFER_CAPACITY;
+        size_t noverwritten = std::min<uint64_t>(first_valid - begin, events.size());
+        events.erase(events.begin(), events.begin() + noverwritten);
+    }
+    return events;
+}
+
+void write_json_string(std::ostream& out, const std::string& s)
+{
+    out << '"';
+    for (char c : s) {
+        if (c == '"' || c == '\\') {
+            out << '\\' << c;
+        } else if (static_cast<unsigned char>(c) >= 0x20) {
+            out << c;
+        }
+    }
+    out << '"';
+}
+
+// Microseconds, to the nanosecond, as the trace event format expects.
+void write_timestamp(std::ostream& out, uint64_t timestamp_ns)
+{
+    char s[32];
+    std::snprintf(s,
+                  sizeof(s),
+                  "%llu.%03llu",
+                  static_cast<unsigned long long>(timestamp_ns / 1000),
+                  static_cast<unsigned long long>(timestamp_ns % 1000));
+    out << s;
+}
+
+} // namespace
+
+
+namespace gr {
+namespace spectre {
+
+void record_trace_event(const char* name, char phase, int64_t arg)
+{
+    thread_buffer& owner = get_thread_buffer();
+    trace_buffer& buffer = *owner.buffer;
+    uint64_t n = buffer.nevents.load(std::memory_order_relaxed);
+    trace_event& event = buffer.events[n % TRACE_BUFFER_CAPACITY];
+    event.timestamp_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                             std::chrono::steady_clock::now().time_since_epoch())
+                             .count();
+    event.name = name;
+    event.arg = arg;
+    event.tid = owner.tid;
+    event.phase = phase;
+    buffer.nevents.store(n + 1, std::memory_order_release);
+}
+
+bool trace_enabled()
+{
+#ifdef SPECTRE_ENABLE_TRACING
+    return true;
+#else
+    return false;
+#endif
+}
+
+void dump_trace(const std::string& filename)
+{
+    if (!trace_enabled()) {
+        throw std::runtime_error(
+            "Tracing isn't enabled. Rebuild gr-spectre with -DENABLE_TRACING=ON.");
+    }
+
+    std::ofstream out(filename);
+    if (!out) {
+        throw std::runtime_error("Failed to open trace file: " + filename);
+    }
+    const pid_t pid = ::getpid();
+    out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+    bool first = true;
+    for (const auto& [tid, name] : trace_registry::get().thread_names()) {
+        out << ((first) ? "\n" : ",\n");
+        first = false;
+        out << "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":" << pid
+            << ",\"tid\":" << tid << ",\"args\":{\"name\":";
+        write_json_string(out, name);
+        out << "}}";
+    }
+    for (const auto& buffer : trace_registry::get().buffers()) {
+        // The trace is cut short if the ring has wrapped, so a span may end without
+        // having begun. Perfetto discards those.
+        for (const trace_event& event : read_events(*buffer)) {
+            out << ((first) ? "\n" : ",\n");
+            first = false;
+            out << "{\"ph\":\"" << event.phase << "\",\"name\":";
+            write_json_string(out, event.name);
+            out << ",\"ts\":";
+            write_timestamp(out, event.timestamp_ns);
+            out << ",\"pid\":" << pid << ",\"tid\":" << event.tid;
+            if (event.phase == 'B') {
+                out << ",\"args\":{\"arg\":" << event.arg << "}";
+            }
+            out << "}";
+        }
+    }
+    out << "\n]}\n";
+
+    out.close();
+    if (!out) {
+        throw std::runtime_error("Failed to write trace file: " + filename);
+    }
+}
+
+} // namespace spectre
+} // namespace gr
@@ -0,0 +1,61 @@
+/*
+ * Copyright 2024-2026 Jimmy Fitzpatrick.
+ * This file is part of SPECTRE
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef INCLUDED_SPECTRE_TRACER_H
+#define INCLUDED_SPECTRE_TRACER_H
+
+#include <cstdint>
+
+namespace gr {
+namespace spectre {
+
+/*!
+ * \brief Record a trace event on the calling thread.
+ *
+ * Each thread records into its own ring buffer, overwriting its oldest events once it's
+ * full, so recording never blocks or allocates (other than the first time a thread
+ * records an event, unless there's a buffer left by an exited thread to reuse). The
+ * name must outlive the tracer, e.g., a string literal.
+ *
+ * \param phase 'B' to begin a span, or 'E' to end it.
+ * \param arg Recorded alongside the event, for whatever's useful (e.g., a size).
+ */
+void record_trace_event(const char* name, char phase, int64_t arg);
+
+/*!
+ * \brief Records a span from construction to destruction.
+ */
+class trace_scope
+{
+public:
+    trace_scope(const char* name, int64_t arg) : d_name(name)
+    {
+        record_trace_event(name, 'B', arg);
+    }
+    ~trace_scope() { record_trace_event(d_name, 'E', 0); }
+
+    trace_scope(const trace_scope&) = delete;
+    trace_scope& operator=(const trace_scope&) = delete;
+
+private:
+    const char* d_name;
+};
+
+} // namespace spectre
+} // namespace gr
+
+// Trace events are only recorded if gr-spectre is built with `ENABLE_TRACING`.
+// Otherwise, this expands to nothing, and its arguments aren't evaluated.
+#ifdef SPECTRE_ENABLE_TRACING
+#define SPECTRE_TRACE_CONCAT_(a, b) a##b
+#define SPECTRE_TRACE_CONCAT(a, b) SPECTRE_TRACE_CONCAT_(a, b)
+#define SPECTRE_TRACE_SCOPE(name, arg) \
+    ::gr::spectre::trace_scope SPECTRE_TRACE_CONCAT(trace_scope_, __LINE__)(name, arg)
+#else
+#define SPECTRE_TRACE_SCOPE(name, arg)
+#endif
+
+#endif
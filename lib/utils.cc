@@ -1,6 +1,69 @@
 #include "utils.h"
 
+#include <fcntl.h>
 #include <gnuradio/types.h>
+#include <unistd.h>
+#include <volk/volk.h>
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <unordered_set>
+
+namespace {
+
+static constexpr int64_t SECONDS_PER_DAY = 86400;
+
+// Every directory created so far, by any block, so each is only created once.
+std::mutex known_dirs_mutex;
+std::unordered_set<std::string> known_dirs;
+
+// Writes `value` as exactly `width` decimal digits, padded with leading zeros.
+char* write_digits(char* out, int value, int width)
+{
+    char digits[16];
+    char* end = std::to_chars(digits, digits + sizeof(digits), value).ptr;
+    out = std::fill_n(out, std::max(0, width - static_cast<int>(end - digits)), '0');
+    return std::copy(digits, end, out);
+}
+
+// Converts days since the Unix epoch to a (proleptic Gregorian) calendar date, as per
+// http://howardhinnant.github.io/date_algorithms.html#civil_from_days
+void civil_from_days(int64_t days, int& year, int& month, int& day)
+{
+    days += 719468;
+    const int64_t era = (days >= 0 ? days : days - 146096) / 146097;
+    const int64_t doe = days - era * 146097;
+    const int64_t yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    const int64_t doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    const int64_t mp = (5 * doy + 2) / 153;
+    day = doy - (153 * mp + 2) / 5 + 1;
+    month = (mp < 10) ? mp + 3 : mp - 9;
+    year = yoe + era * 400 + (month <= 2);
+}
+
+// VOLK saturates out of range values, so scaled samples are clipped to the
+// representable range of the output type.
+void convert_fc32_to_sc16(char* out, const char* in, float scale, size_t nitems)
+{
+    // Each complex sample is converted as two independent floats.
+    volk_32f_s32f_convert_16i(reinterpret_cast<int16_t*>(out),
+                              reinterpret_cast<const float*>(in),
+                              scale,
+                              2 * nitems);
+}
+
+void convert_fc32_to_sc8(char* out, const char* in, float scale, size_t nitems)
+{
+    volk_32f_s32f_convert_8i(reinterpret_cast<int8_t*>(out),
+                             reinterpret_cast<const float*>(in),
+                             scale,
+                             2 * nitems);
+}
+
+} // namespace
 
 namespace gr {
 namespace spectre {
@@ -21,5 +84,202 @@ int get_sizeof_stream_item(const std::string& input_type)
     }
 }
 
+std::runtime_error make_system_error(const std::string& what,
+                                     const std::filesystem::path& filename)
+{
+    return std::runtime_error(what + ": " + filename.string() + " (" +
+                              std::strerror(errno) + ")");
+}
+
+void write_all(int fd,
+               const char* s,
+               size_t nbytes,
+               const std::filesystem::path& filename)
+{
+    // A single call to `write` may write fewer bytes than requested, so keep going
+    // until everything has been written.
+    while (nbytes > 0) {
+        ssize_t nwritten = ::write(fd, s, nbytes);
+        if (nwritten < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw make_system_error("Failed to write", filename);
+        }
+        s += nwritten;
+        nbytes -= nwritten;
+    }
+}
+
+void pwrite_all(int fd,
+                const char* s,
+                size_t nbytes,
+                uint64_t offset,
+                const std::filesystem::path& filename)
+{
+    while (nbytes > 0) {
+        ssize_t nwritten = ::pwrite(fd, s, nbytes, offset);
+        if (nwritten < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw make_system_error("Failed to write", filename);
+        }
+        s += nwritten;
+        nbytes -= nwritten;
+        offset += nwritten;
+    }
+}
+
+void pread_all(int fd,
+               char* s,
+               size_t nbytes,
+               uint64_t offset,
+               const std::filesystem::path& filename)
+{
+    while (nbytes > 0) {
+        ssize_t nread = ::pread(fd, s, nbytes, offset);
+        if (nread < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw make_system_error("Failed to read", filename);
+        }
+        if (nread == 0) {
+            throw std::runtime_error("Unexpected end of file: " + filename.string());
+        }
+        s += nread;
+        nbytes -= nread;
+        offset += nread;
+    }
+}
+
+int64_t get_end_ns(const batch_index_entry& entry)
+{
+    double duration_ns = entry.nsamples * 1e9 / entry.sample_rate;
+    return entry.start_ns + static_cast<int64_t>(duration_ns);
+}
+
+void create_parent_directories(const std::filesystem::path& filename)
+{
+    std::filesystem::path parent_dir{ filename.parent_path() };
+    if (parent_dir.empty()) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(known_dirs_mutex);
+    if (known_dirs.count(parent_dir.string()) == 0) {
+        std::filesystem::create_directories(parent_dir);
+        known_dirs.insert(parent_dir.string());
+    }
+}
+
+void forget_parent_directories(const std::filesystem::path& filename)
+{
+    // Every ancestor is forgotten too, since any of them may have been removed.
+    std::lock_guard<std::mutex> lock(known_dirs_mutex);
+    for (std::filesystem::path dir = filename.parent_path(); !dir.empty();
+         dir = dir.parent_path()) {
+        known_dirs.erase(dir.string());
+        if (dir == dir.parent_path()) {
+            break;
+        }
+    }
+}
+
+int open_creating_parents(const std::filesystem::path& filename, int flags)
+{
+    create_parent_directories(filename);
+    int fd = ::open(filename.c_str(), flags, 0644);
+    if (fd < 0 && errno == ENOENT && (flags & O_CREAT)) {
+        forget_parent_directories(filename);
+        create_parent_directories(filename);
+        fd = ::open(filename.c_str(), flags, 0644);
+    }
+    return fd;
+}
+
+int rename_creating_parents(const std::filesystem::path& from,
+                            const std::filesystem::path& to)
+{
+    create_parent_directories(to);
+    int ret = std::rename(from.c_str(), to.c_str());
+    if (ret < 0 && errno == ENOENT && std::filesystem::exists(from)) {
+        forget_parent_directories(to);
+        create_parent_directories(to);
+        ret = std::rename(from.c_str(), to.c_str());
+    }
+    return ret;
+}
+
+timestamp_formatter::timestamp_formatter(bool group_by_date)
+    : d_group_by_date(group_by_date), d_day(INT64_MIN), d_date_size(0), d_timestamp()
+{
+}
+
+void timestamp_formatter::format(int64_t unix_s, int us)
+{
+    // Round down, even for times before the epoch.
+    int64_t day = unix_s / SECONDS_PER_DAY - (unix_s % SECONDS_PER_DAY < 0);
+    int seconds = unix_s - day * SECONDS_PER_DAY;
+
+    if (day != d_day) {
+        int year, month, mday;
+        civil_from_days(day, year, month, mday);
+
+        char date[32];
+        char* out = date;
+        if (d_group_by_date) {
+            out = write_digits(out, year, 4);
+            *out++ = '/';
+            out = write_digits(out, month, 2);
+            *out++ = '/';
+            out = write_digits(out, mday, 2);
+            *out++ = '/';
+        }
+        out = write_digits(out, year, 4);
+        *out++ = '-';
+        out = write_digits(out, month, 2);
+        *out++ = '-';
+        out = write_digits(out, mday, 2);
+        *out++ = 'T';
+
+        d_timestamp.assign(date, out);
+        d_date_size = d_timestamp.size();
+        d_day = day;
+    }
+
+    // HH:MM:SS.uuuuuuZ
+    char time[16];
+    char* out = write_digits(time, seconds / 3600, 2);
+    *out++ = ':';
+    out = write_digits(out, seconds / 60 % 60, 2);
+    *out++ = ':';
+    out = write_digits(out, seconds % 60, 2);
+    *out++ = '.';
+    out = write_digits(out, us, 6);
+    *out++ = 'Z';
+
+    d_timestamp.resize(d_date_size);
+    d_timestamp.append(time, out);
+}
+
+const std::string& timestamp_formatter::str() const { return d_timestamp; }
+
+sample_converter get_sample_converter(const std::string& input_type,
+                                      const std::string& output_type)
+{
+    // No conversion is required if the types already match.
+    if (output_type == input_type) {
+        return nullptr;
+    } else if (input_type == "fc32" && output_type == "sc16") {
+        return convert_fc32_to_sc16;
+    } else if (input_type == "fc32" && output_type == "sc8") {
+        return convert_fc32_to_sc8;
+    } else {
+        throw std::invalid_argument("Unsupported conversion from " + input_type + " to " +
+                                    output_type);
+    }
+}
+
 } // namespace spectre
 } // namespace gr
\ No newline at end of file
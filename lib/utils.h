@@ -1,12 +1,83 @@
 #ifndef INCLUDED_SPECTRE_UTILS_H
 #define INCLUDED_SPECTRE_UTILS_H
 
+#include <gnuradio/spectre/batch_index.h>
+#include <cstdint>
+#include <filesystem>
+#include <stdexcept>
 #include <string>
 
 namespace gr {
 namespace spectre {
 int get_sizeof_stream_item(const std::string& input_type);
+
+// An error describing the system call which failed on `filename`, going by `errno`.
+std::runtime_error make_system_error(const std::string& what,
+                                     const std::filesystem::path& filename);
+
+// Write all `nbytes` from `s` to `fd`, carrying on after short or interrupted writes.
+void write_all(int fd,
+               const char* s,
+               size_t nbytes,
+               const std::filesystem::path& filename);
+
+// As `write_all`, but starting at `offset` in the file.
+void pwrite_all(int fd,
+                const char* s,
+                size_t nbytes,
+                uint64_t offset,
+                const std::filesystem::path& filename);
+
+// Read exactly `nbytes` from `offset` in the file into `s`, or throw.
+void pread_all(int fd,
+               char* s,
+               size_t nbytes,
+               uint64_t offset,
+               const std::filesystem::path& filename);
+
+// The time just after the last sample in a batch, in nanoseconds since the Unix epoch.
+int64_t get_end_ns(const batch_index_entry& entry);
+
+// Directories which have already been created are remembered, so each is only created
+// (or checked for) once.
+void create_parent_directories(const std::filesystem::path& filename);
+
+// Forget that the parent directories of `filename` were created (e.g., because they've
+// since been removed), so the next call to `create_parent_directories` creates them.
+void forget_parent_directories(const std::filesystem::path& filename);
+
+// As `::open` and `std::rename`, having first created any missing parent directories of
+// the new file. If it fails with `ENOENT`, a parent directory may have been removed since
+// it was created (e.g., by a cleanup job), so it's created again and retried once. On
+// failure, they return -1 and leave `errno` set.
+int open_creating_parents(const std::filesystem::path& filename, int flags);
+int rename_creating_parents(const std::filesystem::path& from,
+                            const std::filesystem::path& to);
+
+// Formats the timestamp at the start of each file name (e.g.,
+// `2024-01-31T12:34:56.123456Z`, prefixed by `2024/01/31/` when grouping by date). The
+// date is only formatted when it changes, so formatting each batch is cheap.
+class timestamp_formatter
+{
+public:
+    timestamp_formatter(bool group_by_date);
+
+    // Format the UTC time `unix_s` seconds and `us` microseconds after the Unix epoch.
+    void format(int64_t unix_s, int us);
+    const std::string& str() const;
+
+private:
+    const bool d_group_by_date;
+    int64_t d_day;
+    size_t d_date_size;
+    std::string d_timestamp;
+};
+
+// Converts `nitems` samples from `in` to another sample format, writing them to `out`.
+using sample_converter = void (*)(char* out, const char* in, float scale, size_t nitems);
+sample_converter get_sample_converter(const std::string& input_type,
+                                      const std::string& output_type);
 }
 } // namespace gr
 
-#endif
\ No newline at end of file
+#endif
@@ -14,7 +14,7 @@
 /* BINDTOOL_GEN_AUTOMATIC(0)                                                       */
 /* BINDTOOL_USE_PYGCCXML(0)                                                        */
 /* BINDTOOL_HEADER_FILE(batched_file_sink.h)                                        */
-/* BINDTOOL_HEADER_FILE_HASH(974219b1eb7e27c7ac3cf6048eece7fc)                     */
+/* BINDTOOL_HEADER_FILE_HASH(2b493d053f232bb55e4fe63468bfd86f)                     */
 /***********************************************************************************/
 
 #include <pybind11/complex.h>
@@ -31,6 +31,51 @@ void bind_batched_file_sink(py::module& m)
 {
 
     using batched_file_sink    = ::gr::spectre::batched_file_sink;
+    using batched_file_sink_options    = ::gr::spectre::batched_file_sink_options;
+
+
+    py::class_<batched_file_sink_options>(
+        m, "batched_file_sink_options", D(batched_file_sink_options))
+
+        .def(py::init<>())
+        // Any option can be set by keyword, e.g.,
+        // `batched_file_sink_options(queue_depth=4, write_index=True)`.
+        .def(py::init([](py::kwargs kwargs) {
+            batched_file_sink_options options;
+            py::object self = py::cast(&options, py::return_value_policy::reference);
+            for (const auto& item : kwargs) {
+                py::setattr(self, item.first, item.second);
+            }
+            return options;
+        }))
+        .def_readwrite("queue_depth", &batched_file_sink_options::queue_depth)
+        .def_readwrite("write_mode", &batched_file_sink_options::write_mode)
+        .def_readwrite("sync_on_close", &batched_file_sink_options::sync_on_close)
+        .def_readwrite("output_type", &batched_file_sink_options::output_type)
+        .def_readwrite("scale", &batched_file_sink_options::scale)
+        .def_readwrite("compression", &batched_file_sink_options::compression)
+        .def_readwrite("compression_level", &batched_file_sink_options::compression_level)
+        .def_readwrite("num_inputs", &batched_file_sink_options::num_inputs)
+        .def_readwrite("interleave", &batched_file_sink_options::interleave)
+        .def_readwrite("stripe_dirs", &batched_file_sink_options::stripe_dirs)
+        .def_readwrite("stripe_policy", &batched_file_sink_options::stripe_policy)
+        .def_readwrite("segment_size", &batched_file_sink_options::segment_size)
+        .def_readwrite("segment_duration", &batched_file_sink_options::segment_duration)
+        .def_readwrite("write_index", &batched_file_sink_options::write_index)
+        .def_readwrite("use_rx_time", &batched_file_sink_options::use_rx_time)
+        .def_readwrite("hdr_version", &batched_file_sink_options::hdr_version)
+        .def_readwrite("metadata_tag_keys", &batched_file_sink_options::metadata_tag_keys)
+        .def_readwrite("batch_boundary", &batched_file_sink_options::batch_boundary)
+        .def_readwrite("boundaries_per_batch",
+                       &batched_file_sink_options::boundaries_per_batch)
+        .def_readwrite("capture_mode", &batched_file_sink_options::capture_mode)
+        .def_readwrite("trigger_source", &batched_file_sink_options::trigger_source)
+        .def_readwrite("trigger_threshold", &batched_file_sink_options::trigger_threshold)
+        .def_readwrite("pre_trigger", &batched_file_sink_options::pre_trigger)
+        .def_readwrite("disk_quota", &batched_file_sink_options::disk_quota)
+        .def_readwrite("backpressure", &batched_file_sink_options::backpressure)
+        .def_readwrite("stats_interval", &batched_file_sink_options::stats_interval)
+        ;
 
 
     py::class_<batched_file_sink, gr::sync_block, gr::block, gr::basic_block,
@@ -46,6 +91,7 @@ void bind_batched_file_sink(py::module& m)
            py::arg("is_tagged") = false,
            py::arg("tag_key") = "freq",
            py::arg("initial_tag_value") = 0,
+           py::arg("options") = batched_file_sink_options(),
            D(batched_file_sink,make)
         )
         
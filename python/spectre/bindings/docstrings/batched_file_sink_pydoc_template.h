@@ -16,6 +16,9 @@
 
 
  
+ static const char *__doc_gr_spectre_batched_file_sink_options = R"doc()doc";
+
+
  static const char *__doc_gr_spectre_batched_file_sink = R"doc()doc";
 
 
@@ -14,7 +14,7 @@
 /* BINDTOOL_GEN_AUTOMATIC(0)                                                       */
 /* BINDTOOL_USE_PYGCCXML(0)                                                        */
 /* BINDTOOL_HEADER_FILE(frequency_sweeper.h)                                        */
-/* BINDTOOL_HEADER_FILE_HASH(4d26b7ca0ba4b76b18dc758ee1f01511)                     */
+/* BINDTOOL_HEADER_FILE_HASH(e1e4aee0b12925b130658b49842793bf)                     */
 /***********************************************************************************/
 
 #include <pybind11/complex.h>
@@ -44,6 +44,7 @@ void bind_frequency_sweeper(py::module& m)
            py::arg("sample_rate") = 2.0E+6,
            py::arg("retune_cmd_name") = "freq",
            py::arg("input_type") = "fc32",
+           py::arg("stats_interval") = 0,
            D(frequency_sweeper,make)
         )
         
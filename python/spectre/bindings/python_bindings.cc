@@ -24,6 +24,7 @@ namespace py = pybind11;
     void bind_batched_file_sink(py::module& m);
     void bind_tagged_staircase(py::module& m);
     void bind_frequency_sweeper(py::module& m);
+    void bind_trace(py::module& m);
 // ) END BINDING_FUNCTION_PROTOTYPES
 
 
@@ -55,5 +56,6 @@ PYBIND11_MODULE(spectre_python, m)
     bind_batched_file_sink(m);
     bind_tagged_staircase(m);
     bind_frequency_sweeper(m);
+    bind_trace(m);
     // ) END BINDING_FUNCTION_CALLS
 }
\ No newline at end of file
@@ -14,7 +14,7 @@
 /* BINDTOOL_GEN_AUTOMATIC(0)                                                       */
 /* BINDTOOL_USE_PYGCCXML(0)                                                        */
 /* BINDTOOL_HEADER_FILE(tagged_staircase.h)                                        */
-/* BINDTOOL_HEADER_FILE_HASH(ab6eb751ce262d01c28d016b51bd2386)                     */
+/* BINDTOOL_HEADER_FILE_HASH(00da60f3b725622fe0402d71a00b5e7b)                     */
 /***********************************************************************************/
 
 #include <pybind11/complex.h>
@@ -42,6 +42,7 @@ void bind_tagged_staircase(py::module& m)
            py::arg("hop_freq") = 32000,
            py::arg("step_increment") = 200,
            py::arg("sample_rate") = 32000,
+           py::arg("stats_interval") = 0,
            D(tagged_staircase,make)
         )
         
@@ -0,0 +1,41 @@
+/*
+ * Copyright 2026 Free Software Foundation, Inc.
+ *
+ * This file is part of GNU Radio
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ */
+
+/***********************************************************************************/
+/* This file is automatically generated using bindtool and can be manually edited  */
+/* The following lines can be configured to regenerate this file during cmake      */
+/* If manual edits are made, the following tags should be modified accordingly.    */
+/* BINDTOOL_GEN_AUTOMATIC(0)                                                       */
+/* BINDTOOL_USE_PYGCCXML(0)                                                        */
+/* BINDTOOL_HEADER_FILE(trace.h)                                        */
+/* BINDTOOL_HEADER_FILE_HASH(5c0eff3b5f494ba1f004874427cdbb61)                     */
+/***********************************************************************************/
+
+#include <pybind11/complex.h>
+#include <pybind11/pybind11.h>
+#include <pybind11/stl.h>
+
+namespace py = pybind11;
+
+#include <gnuradio/spectre/trace.h>
+// pydoc.h is automatically generated in the build directory
+#include <trace_pydoc.h>
+
+void bind_trace(py::module& m)
+{
+
+
+    m.def("trace_enabled", &::gr::spectre::trace_enabled, D(trace_enabled));
+
+
+    m.def("dump_trace",
+          &::gr::spectre::dump_trace,
+          py::arg("filename"),
+          D(dump_trace));
+}
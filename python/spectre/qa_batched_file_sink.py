@@ -0,0 +1,595 @@
+#!/usr/bin/env python3
+#
+# Copyright 2024-2026 Jimmy Fitzpatrick.
+# This file is part of SPECTRE
+# SPDX-License-Identifier: GPL-3.0-or-later
+#
+
+import bisect
+import cmath
+import json
+import os
+import shutil
+import struct
+import sys
+import tempfile
+
+import pmt
+from gnuradio import gr, gr_unittest
+
+try:
+    from gnuradio import blocks, spectre
+except ImportError:
+    dirname, filename = os.path.split(os.path.abspath(__file__))
+    sys.path.append(os.path.join(dirname, "bindings"))
+    from gnuradio import blocks, spectre
+
+
+SAMPLE_RATE = 1000
+# The size of an fc32 sample, in bytes.
+SIZEOF_FC32 = 8
+# Each file counts as a whole number of these against the disk quota.
+DISK_BLOCK_SIZE = 4096
+
+
+def make_tag(offset, key, value):
+    tag = gr.tag_t()
+    tag.offset = offset
+    tag.key = pmt.intern(key)
+    tag.value = value
+    return tag
+
+
+def make_rx_time(full_secs, frac_secs=0.0):
+    return pmt.make_tuple(pmt.from_uint64(full_secs), pmt.from_double(frac_secs))
+
+
+def make_ramp(nsamples):
+    # Every sample is distinct, so it's clear which were written where.
+    return [complex(n, -n) for n in range(nsamples)]
+
+
+def read_file(path):
+    with open(path, "rb") as f:
+        return f.read()
+
+
+def to_samples(data):
+    floats = struct.unpack(f"<{len(data) // 4}f", data)
+    return [complex(re, im) for re, im in zip(floats[0::2], floats[1::2])]
+
+
+def read_samples(path):
+    return to_samples(read_file(path))
+
+
+def make_tone(nsamples, amplitude, cycles_per_sample=0.01):
+    return [
+        amplitude * cmath.exp(2j * cmath.pi * cycles_per_sample * n)
+        for n in range(nsamples)
+    ]
+
+
+def read_converted_samples(path, output_type):
+    """Read interleaved integer samples back as complex numbers, before rescaling."""
+    data = read_file(path)
+    format = "h" if output_type == "sc16" else "b"
+    ints = struct.unpack(f"<{len(data) // struct.calcsize(format)}{format}", data)
+    return [complex(re, im) for re, im in zip(ints[0::2], ints[1::2])]
+
+
+def read_json(path):
+    with open(path) as f:
+        return json.load(f)
+
+
+def read_index(dir, tag):
+    """Read the header, and every entry (with its path), from an index."""
+    data = read_file(os.path.join(dir, tag + ".idx"))
+    paths = read_file(os.path.join(dir, tag + ".paths"))
+    fields = struct.unpack_from("<4sHHI", data)
+    header = dict(zip(["magic", "version", "entry_size", "flags"], fields))
+    entries = []
+    for offset in range(16, len(data), header["entry_size"]):
+        fields = struct.unpack_from("<qQQQQQfI", data, offset)
+        entry = dict(
+            zip(
+                [
+                    "start_ns",
+                    "sample_offset",
+                    "nsamples",
+                    "path_id",
+                    "byte_offset",
+                    "byte_size",
+                    "sample_rate",
+                    "ntags",
+                ],
+                fields,
+            )
+        )
+        end = paths.index(b"\n", entry["path_id"])
+        entry["path"] = paths[entry["path_id"] : end].decode()
+        entries.append(entry)
+    return header, entries
+
+
+def lookup(entries, start_ns, end_ns):
+    """Find the entries overlapping `[start_ns, end_ns)`, as `batch_index` does."""
+    starts = [entry["start_ns"] for entry in entries]
+    first = max(bisect.bisect_right(starts, start_ns) - 1, 0)
+    matches = []
+    for entry in entries[first:]:
+        if entry["start_ns"] >= end_ns:
+            break
+        duration_ns = entry["nsamples"] * 1e9 / entry["sample_rate"]
+        if entry["start_ns"] + duration_ns > start_ns:
+            matches.append(entry)
+    return matches
+
+
+def read_tag_file(path):
+    """Read the header and `(offset, count, value)` records of a v2 .hdr file."""
+    data = read_file(path)
+    fields = struct.unpack_from("<4sHHIIQd", data)
+    header = dict(
+        zip(
+            [
+                "magic",
+                "version",
+                "header_size",
+                "record_size",
+                "reserved",
+                "nrecords",
+                "sample_rate",
+            ],
+            fields,
+        )
+    )
+    start, size = header["header_size"], header["record_size"]
+    records = [
+        struct.unpack_from("<QQd", data, start + n * size)
+        for n in range(header["nrecords"])
+    ]
+    return header, records
+
+
+def unshuffle(data, typesize):
+    # Undo the byte transpose, so byte `b` of each element is back in place.
+    nelements = len(data) // typesize
+    out = bytearray(len(data))
+    for b in range(typesize):
+        out[b::typesize] = data[b * nelements : (b + 1) * nelements]
+    return bytes(out)
+
+
+def decompress_seekable(data, typesize):
+    """Decompress a file in the Zstandard seekable format, with shuffled frames."""
+    import zstandard
+
+    nframes, _, magic = struct.unpack_from("<IBI", data, len(data) - 9)
+    assert magic == 0x8F92EAB1
+    table = len(data) - 9 - nframes * 8
+    decompressor = zstandard.ZstdDecompressor()
+    out = b""
+    offset = 0
+    for n in range(nframes):
+        compressed_size, size = struct.unpack_from("<II", data, table + n * 8)
+        frame = decompressor.decompress(
+            data[offset : offset + compressed_size], max_output_size=size
+        )
+        out += unshuffle(frame, typesize)
+        offset += compressed_size
+    # Everything up to the skippable frame holding the seek table is data.
+    assert offset == table - 8
+    return out
+
+
+class qa_batched_file_sink(gr_unittest.TestCase):
+    def setUp(self):
+        self.tb = gr.top_block()
+        self.dir = tempfile.mkdtemp()
+
+    def tearDown(self):
+        self.tb = None
+        shutil.rmtree(self.dir)
+
+    def run_sink(self, data, tags, max_noutput_items=None, **kwargs):
+        """Record `data` (with `tags`) at `SAMPLE_RATE`, returning the files written."""
+        src = blocks.vector_source_c(data, False, 1, tags)
+        sink = spectre.batched_file_sink(
+            self.dir, "qa", "fc32", sample_rate=SAMPLE_RATE, **kwargs
+        )
+        if max_noutput_items:
+            sink.set_max_noutput_items(max_noutput_items)
+        self.tb.connect(src, sink)
+        self.tb.run()
+        return sorted(os.listdir(self.dir))
+
+    def path(self, filename):
+        return os.path.join(self.dir, filename)
+
+    def test_rx_time_on_first_sample_of_later_call(self):
+        # Each call to `work` takes 500 samples, so the second `rx_time` tag lands on
+        # the first sample of the second call, in the middle of the first batch.
+        tags = [
+            make_tag(0, "rx_time", make_rx_time(100)),
+            make_tag(500, "rx_time", make_rx_time(200)),
+        ]
+        files = self.run_sink(
+            [0j] * 2000,
+            tags,
+            max_noutput_items=500,
+            batch_size=1.0,
+            options=spectre.batched_file_sink_options(use_rx_time=True),
+        )
+        data_files = [f for f in files if f.endswith(".fc32")]
+        # The second batch counts on from the second tag: 200 s, plus 500 samples.
+        self.assertEqual(
+            data_files,
+            [
+                "1970-01-01T00:01:40.000000Z_qa.fc32",
+                "1970-01-01T00:03:20.500000Z_qa.fc32",
+            ],
+        )
+
+    def test_restart_streaming(self):
+        # Each run stops half way through its second batch, which has already been
+        # streamed to file, so it's finished when the flowgraph stops.
+        data = make_ramp(1500)
+        src = blocks.vector_source_c(data, False)
+        sink = spectre.batched_file_sink(
+            self.dir,
+            "qa",
+            "fc32",
+            batch_size=1.0,
+            sample_rate=SAMPLE_RATE,
+            options=spectre.batched_file_sink_options(
+                use_rx_time=True, write_mode="streaming"
+            ),
+        )
+        self.tb.connect(src, sink)
+        for full_secs in [100, 200]:
+            src.set_data(data, [make_tag(0, "rx_time", make_rx_time(full_secs))])
+            self.tb.run()
+
+        files = sorted(os.listdir(self.dir))
+        data_files = [f for f in files if f.endswith(".fc32")]
+        self.assertEqual(
+            data_files,
+            [
+                "1970-01-01T00:01:40.000000Z_qa.fc32",
+                "1970-01-01T00:01:41.000000Z_qa.fc32",
+                "1970-01-01T00:03:20.000000Z_qa.fc32",
+                "1970-01-01T00:03:21.000000Z_qa.fc32",
+            ],
+        )
+        # After the restart, batches start from the beginning of the stream again.
+        for filename, start, end in zip(data_files, [0, 1000] * 2, [1000, 1500] * 2):
+            self.assertEqual(read_samples(self.path(filename)), data[start:end])
+        for filename in [
+            "1970-01-01T00:01:41.000000Z_qa.json",
+            "1970-01-01T00:03:21.000000Z_qa.json",
+        ]:
+            self.assertEqual(read_json(self.path(filename))["nsamples"], 500)
+
+    def check_conversion(self, output_type, full_scale):
+        # With the default scale, the tone fills half the range of the output type.
+        data = make_tone(1000, 0.5)
+        files = self.run_sink(
+            data,
+            [make_tag(0, "rx_time", make_rx_time(100))],
+            batch_size=1.0,
+            options=spectre.batched_file_sink_options(
+                use_rx_time=True, output_type=output_type
+            ),
+        )
+        filename = "1970-01-01T00:01:40.000000Z_qa." + output_type
+        self.assertIn(filename, files)
+        metadata = read_json(self.path("1970-01-01T00:01:40.000000Z_qa.json"))
+        self.assertEqual(metadata["scale"], full_scale)
+
+        samples = read_converted_samples(self.path(filename), output_type)
+        self.assertEqual(len(samples), len(data))
+        # Each component is rounded to the nearest step.
+        for expected, actual in zip(data, samples):
+            error = expected - actual / full_scale
+            self.assertLessEqual(abs(error.real), 1 / full_scale)
+            self.assertLessEqual(abs(error.imag), 1 / full_scale)
+
+    def test_sc16_round_trip(self):
+        self.check_conversion("sc16", 32767)
+
+    def test_sc8_round_trip(self):
+        self.check_conversion("sc8", 127)
+
+    def test_index_lookup(self):
+        # Timestamps follow `rx_time`, so each batch starts 100 ms after the last.
+        data = make_ramp(500)
+        self.run_sink(
+            data,
+            [make_tag(0, "rx_time", make_rx_time(100))],
+            batch_size=0.1,
+            options=spectre.batched_file_sink_options(
+                use_rx_time=True, write_index=True
+            ),
+        )
+        header, entries = read_index(self.dir, "qa")
+        self.assertEqual(header["magic"], b"SPCI")
+        self.assertEqual(header["version"], 1)
+        self.assertEqual(header["entry_size"], 56)
+        self.assertEqual(header["flags"], 0)
+        self.assertEqual(len(entries), 5)
+
+        # Look up the batches overlapping [100.15 s, 100.25 s).
+        matches = lookup(entries, 100_150_000_000, 100_250_000_000)
+        self.assertEqual(
+            [entry["start_ns"] for entry in matches], [100_100_000_000, 100_200_000_000]
+        )
+        for entry in matches:
+            self.assertEqual(entry["nsamples"], 100)
+            self.assertEqual(entry["sample_rate"], SAMPLE_RATE)
+            self.assertEqual(entry["byte_size"], 100 * SIZEOF_FC32)
+            # Each entry points at the samples it covers.
+            with open(self.path(entry["path"]), "rb") as f:
+                f.seek(entry["byte_offset"])
+                samples = to_samples(f.read(entry["byte_size"]))
+            start = entry["sample_offset"]
+            self.assertEqual(samples, data[start : start + entry["nsamples"]])
+
+    def test_hdr_v2(self):
+        tags = [
+            make_tag(0, "rx_time", make_rx_time(100)),
+            make_tag(0, "freq", pmt.from_double(1.0)),
+            make_tag(50, "freq", pmt.from_double(2.0)),
+            make_tag(150, "freq", pmt.from_double(3.0)),
+        ]
+        files = self.run_sink(
+            make_ramp(200),
+            tags,
+            batch_size=0.1,
+            is_tagged=True,
+            options=spectre.batched_file_sink_options(use_rx_time=True, hdr_version=2),
+        )
+        hdr_files = [f for f in files if f.endswith(".hdr")]
+        self.assertEqual(
+            hdr_files,
+            [
+                "1970-01-01T00:01:40.000000Z_qa.hdr",
+                "1970-01-01T00:01:40.100000Z_qa.hdr",
+            ],
+        )
+        expected = [
+            [(0, 50, 1.0), (50, 50, 2.0)],
+            # The second batch carries on with the tag in effect at its first sample.
+            [(0, 50, 2.0), (50, 50, 3.0)],
+        ]
+        for filename, records in zip(hdr_files, expected):
+            header, actual = read_tag_file(self.path(filename))
+            self.assertEqual(header["magic"], b"SPCT")
+            self.assertEqual(header["version"], 2)
+            self.assertEqual(header["header_size"], 32)
+            self.assertEqual(header["record_size"], 24)
+            self.assertEqual(header["sample_rate"], SAMPLE_RATE)
+            self.assertEqual(actual, records)
+
+    def test_compression_round_trip(self):
+        try:
+            import zstandard  # noqa: F401
+        except ImportError:
+            self.skipTest("zstandard isn't installed")
+        data = make_ramp(2000)
+        try:
+            files = self.run_sink(
+                data,
+                [make_tag(0, "rx_time", make_rx_time(100))],
+                batch_size=1.0,
+                options=spectre.batched_file_sink_options(
+                    use_rx_time=True, compression="zstd", compression_level=3
+                ),
+            )
+        except ValueError:
+            self.skipTest("gr-spectre was built without zstd")
+        data_files = [f for f in files if f.endswith(".fc32.zst")]
+        self.assertEqual(len(data_files), 2)
+        for n, filename in enumerate(data_files):
+            metadata = read_json(self.path(filename[: -len(".fc32.zst")] + ".json"))
+            self.assertEqual(metadata["compression"], "zstd")
+            typesize = metadata["shuffle_typesize"]
+            samples = to_samples(
+                decompress_seekable(read_file(self.path(filename)), typesize)
+            )
+            self.assertEqual(samples, data[n * 1000 : (n + 1) * 1000])
+
+    def test_tag_boundaries(self):
+        tags = [make_tag(0, "rx_time", make_rx_time(100))] + [
+            make_tag(offset, "freq", pmt.from_double(value))
+            for offset, value in [(0, 1.0), (30, 2.0), (100, 3.0), (170, 4.0)]
+        ]
+        files = self.run_sink(
+            make_ramp(300),
+            tags,
+            batch_size=1.0,
+            options=spectre.batched_file_sink_options(
+                use_rx_time=True, batch_boundary="tag"
+            ),
+        )
+        # The last batch is never completed, so it isn't written.
+        metadata = [read_json(self.path(f)) for f in files if f.endswith(".json")]
+        self.assertEqual([m["nsamples"] for m in metadata], [30, 70, 70])
+        data_files = [f for f in files if f.endswith(".fc32")]
+        sizes = [os.path.getsize(self.path(f)) for f in data_files]
+        self.assertEqual(sizes, [n * SIZEOF_FC32 for n in [30, 70, 70]])
+
+    def test_wrap_boundaries(self):
+        # The frequency sweeps 1, 2, 3 and wraps back around every 60 samples.
+        tags = [make_tag(0, "rx_time", make_rx_time(100))] + [
+            make_tag(20 * n, "freq", pmt.from_double(1 + n % 3)) for n in range(7)
+        ]
+        files = self.run_sink(
+            make_ramp(200),
+            tags,
+            batch_size=1.0,
+            options=spectre.batched_file_sink_options(
+                use_rx_time=True, batch_boundary="wrap"
+            ),
+        )
+        metadata = [read_json(self.path(f)) for f in files if f.endswith(".json")]
+        self.assertEqual([m["nsamples"] for m in metadata], [60, 60])
+
+    def test_triggered_capture(self):
+        # A short burst, well above the threshold, in a quiet signal.
+        data = [complex(0.01, 0)] * 2000
+        data[500:510] = [complex(1, 0)] * 10
+        files = self.run_sink(
+            data,
+            [make_tag(0, "rx_time", make_rx_time(100))],
+            batch_size=0.1,
+            options=spectre.batched_file_sink_options(
+                use_rx_time=True,
+                capture_mode="triggered",
+                trigger_source="power",
+                trigger_threshold=-20,
+                pre_trigger=0.02,
+            ),
+        )
+        # Only the burst is captured, starting 20 samples before it.
+        data_files = [f for f in files if f.endswith(".fc32")]
+        self.assertEqual(data_files, ["1970-01-01T00:01:40.480000Z_qa.fc32"])
+        self.assertEqual(read_samples(self.path(data_files[0])), data[480:580])
+
+    def test_file_pool_recycling(self):
+        # Enough for three batches, rounded down, with a block for each file.
+        nbytes_per_batch = 3 * DISK_BLOCK_SIZE
+        data = make_ramp(1000)
+        files = self.run_sink(
+            data,
+            [make_tag(0, "rx_time", make_rx_time(100))],
+            batch_size=0.1,
+            options=spectre.batched_file_sink_options(
+                use_rx_time=True, disk_quota=3.5 * nbytes_per_batch / (1 << 30)
+            ),
+        )
+        # Only the three most recent batches are kept.
+        data_files = [f for f in files if f.endswith(".fc32")]
+        self.assertEqual(
+            data_files,
+            [
+                "1970-01-01T00:01:40.700000Z_qa.fc32",
+                "1970-01-01T00:01:40.800000Z_qa.fc32",
+                "1970-01-01T00:01:40.900000Z_qa.fc32",
+            ],
+        )
+        # The recycled files were overwritten in full.
+        for n, filename in enumerate(data_files):
+            start = 700 + n * 100
+            samples = read_samples(self.path(filename))
+            self.assertEqual(samples, data[start : start + 100])
+
+        # The pool file records how many batches it holds.
+        magic, version, _, _, nslots = struct.unpack_from(
+            "<4sHHII", read_file(self.path("qa.pool"))
+        )
+        self.assertEqual(magic, b"SPCP")
+        self.assertEqual(version, 1)
+        self.assertEqual(nslots, 3)
+
+        # Every preallocated file has been taken over by a batch.
+        self.assertEqual([f for f in files if f.startswith("qa.pool.")], [])
+
+    def test_file_pool_preallocation(self):
+        nbytes_per_batch = 3 * DISK_BLOCK_SIZE
+        files = self.run_sink(
+            make_ramp(150),
+            [make_tag(0, "rx_time", make_rx_time(100))],
+            batch_size=0.1,
+            options=spectre.batched_file_sink_options(
+                use_rx_time=True, disk_quota=3.5 * nbytes_per_batch / (1 << 30)
+            ),
+        )
+        # The one batch written took over the first slot, and the files of the others
+        # were preallocated at their full size.
+        self.assertEqual(
+            [f for f in files if f.endswith(".fc32")],
+            ["1970-01-01T00:01:40.000000Z_qa.fc32"],
+        )
+        preallocated = [f for f in files if f.startswith("qa.pool.")]
+        self.assertEqual(preallocated, ["qa.pool.1.0", "qa.pool.2.0"])
+        for filename in preallocated:
+            self.assertEqual(os.path.getsize(self.path(filename)), 100 * SIZEOF_FC32)
+
+    def test_drop_accounting(self):
+        # With tiny batches and a single buffer in the queue, the writer can't keep up.
+        batch_nsamples = 10
+        files = self.run_sink(
+            make_ramp(2000),
+            [make_tag(0, "rx_time", make_rx_time(100))],
+            batch_size=batch_nsamples / SAMPLE_RATE,
+            options=spectre.batched_file_sink_options(
+                use_rx_time=True,
+                write_index=True,
+                queue_depth=1,
+                backpressure="drop_newest",
+            ),
+        )
+        _, entries = read_index(self.dir, "qa")
+        written = [entry["sample_offset"] for entry in entries]
+        data_files = [f for f in files if f.endswith(".fc32")]
+        self.assertEqual(len(written), len(data_files))
+
+        # Each batch dropped is recorded by the next one written.
+        dropped = []
+        for filename in files:
+            if not filename.endswith(".json"):
+                continue
+            summary = read_json(self.path(filename)).get("dropped")
+            if not summary:
+                continue
+            ranges = summary["ranges"]
+            self.assertEqual(summary["nbatches"], len(ranges))
+            self.assertEqual(summary["nsamples"], sum(r[3] for r in ranges))
+            for start_ns, end_ns, sample_offset, nsamples in ranges:
+                self.assertEqual(nsamples, batch_nsamples)
+                self.assertEqual(end_ns - start_ns, nsamples * 1e9 / SAMPLE_RATE)
+                dropped.append(sample_offset)
+
+        # Every batch is accounted for exactly once, except those dropped after the
+        # last batch written, which nothing is left to record.
+        self.assertFalse(set(written) & set(dropped))
+        recorded = sorted(written + dropped)
+        self.assertEqual(len(recorded), len(set(recorded)))
+        self.assertEqual(recorded, list(range(0, max(written) + 1, batch_nsamples)))
+
+    def test_runtime_commands(self):
+        # Throttle the input, so the command is applied partway through.
+        moved_dir = os.path.join(self.dir, "moved")
+        tags = [make_tag(0, "rx_time", make_rx_time(100))]
+        src = blocks.vector_source_c(make_ramp(2000), False, 1, tags)
+        throttle = blocks.throttle(gr.sizeof_gr_complex, 10 * SAMPLE_RATE)
+        sink = spectre.batched_file_sink(
+            self.dir,
+            "qa",
+            "fc32",
+            batch_size=0.1,
+            sample_rate=SAMPLE_RATE,
+            options=spectre.batched_file_sink_options(use_rx_time=True),
+        )
+        self.tb.connect(src, throttle, sink)
+        command = pmt.make_dict()
+        command = pmt.dict_add(command, pmt.intern("dir"), pmt.intern(moved_dir))
+        command = pmt.dict_add(command, pmt.intern("tag"), pmt.intern("moved"))
+        sink._post(pmt.intern("command"), command)
+        self.tb.run()
+
+        before = sorted(f for f in os.listdir(self.dir) if f.endswith(".fc32"))
+        after = sorted(f for f in os.listdir(moved_dir) if f.endswith(".fc32"))
+        self.assertTrue(after)
+        self.assertTrue(all(f.endswith("_qa.fc32") for f in before))
+        self.assertTrue(all(f.endswith("_moved.fc32") for f in after))
+        # Every batch is written once, and none go back to the old directory.
+        self.assertEqual(len(before) + len(after), 20)
+        if before:
+            self.assertLess(before[-1][:27], after[0][:27])
+
+
+if __name__ == "__main__":
+    gr_unittest.run(qa_batched_file_sink)
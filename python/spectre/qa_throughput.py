@@ -0,0 +1,282 @@
+#!/usr/bin/env python3
+#
+# Copyright 2024-2026 Jimmy Fitzpatrick.
+# This file is part of SPECTRE
+# SPDX-License-Identifier: GPL-3.0-or-later
+#
+
+"""
+Measures how fast realistic flowgraphs run, headless and at full speed, and fails if
+any has slowed down by more than a threshold against a stored baseline.
+
+Each configuration runs in its own process, so that its peak RSS is its own. For each,
+the harness records the throughput in MSps, the peak RSS, the CPU time of the whole
+process and of each scheduler thread (by name). The results are written as JSON. If
+there's no baseline yet, the results are only recorded; pass `--update-baseline` to
+store them as the baseline.
+"""
+
+import argparse
+import json
+import os
+import platform
+import resource
+import shutil
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+try:
+    from gnuradio import blocks, gr, spectre
+except ImportError:
+    dirname, filename = os.path.split(os.path.abspath(__file__))
+    sys.path.append(os.path.join(dirname, "bindings"))
+    from gnuradio import blocks, gr, spectre
+
+
+SAMPLE_RATE = 1e6
+# How often the CPU time of each scheduler thread is sampled, in seconds.
+SAMPLE_INTERVAL = 0.05
+
+
+def make_staircase_to_sink(dir, nitems, queue_depth):
+    tb = gr.top_block()
+    src = spectre.tagged_staircase(4000, 5000, 32000, 200, SAMPLE_RATE)
+    head = blocks.head(gr.sizeof_gr_complex, nitems)
+    sink = spectre.batched_file_sink(
+        dir=dir,
+        tag="throughput",
+        input_type="fc32",
+        batch_size=1.0,
+        sample_rate=SAMPLE_RATE,
+        is_tagged=True,
+        tag_key="rx_freq",
+        options=spectre.batched_file_sink_options(queue_depth=queue_depth),
+    )
+    tb.connect(src, head, sink)
+    return tb
+
+
+def make_null_to_sweeper(dir, nitems):
+    tb = gr.top_block()
+    src = blocks.null_source(gr.sizeof_gr_complex)
+    head = blocks.head(gr.sizeof_gr_complex, nitems)
+    sweeper = spectre.frequency_sweeper(90e6, 110e6, 2e6, 0.2, 2e6, "freq", "fc32")
+    tb.connect(src, head, sweeper)
+    return tb
+
+
+# Each configuration, by name, with the number of items it's run for and how to make
+# its flowgraph, writing (if at all) to the given directory.
+CONFIGS = {
+    "staircase_to_sink": (
+        20_000_000,
+        lambda dir, nitems: make_staircase_to_sink(dir, nitems, 0),
+    ),
+    "staircase_to_sink_queued": (
+        20_000_000,
+        lambda dir, nitems: make_staircase_to_sink(dir, nitems, 4),
+    ),
+    "null_to_sweeper": (
+        200_000_000,
+        make_null_to_sweeper,
+    ),
+}
+
+
+def read_thread_cpu():
+    """The CPU time of each thread in this process so far, in seconds, by thread ID."""
+    ticks_per_sec = os.sysconf("SC_CLK_TCK")
+    threads = {}
+    for tid in os.listdir("/proc/self/task"):
+        try:
+            with open(f"/proc/self/task/{tid}/stat") as f:
+                stat = f.read()
+        except FileNotFoundError:
+            # The thread has exited since the directory was listed.
+            continue
+        # The name is in parentheses, and may itself contain spaces.
+        name = stat[stat.index("(") + 1 : stat.rindex(")")]
+        fields = stat[stat.rindex(")") + 2 :].split()
+        utime, stime = int(fields[11]), int(fields[12])
+        threads[tid] = (name, (utime + stime) / ticks_per_sec)
+    return threads
+
+
+def run_config(name, dir):
+    """Run a configuration to completion in this process, and measure it."""
+    nitems, make_flowgraph = CONFIGS[name]
+    tb = make_flowgraph(dir, nitems)
+
+    # The scheduler threads are the ones which appear once the flowgraph starts. Their
+    # CPU time is sampled until they exit, so the last sample of each is slightly short.
+    existing_threads = set(read_thread_cpu())
+    scheduler_threads = {}
+    done = threading.Event()
+
+    def sample_threads():
+        sampler_tid = str(threading.get_native_id())
+        while not done.wait(SAMPLE_INTERVAL):
+            for tid, thread in read_thread_cpu().items():
+                if tid not in existing_threads and tid != sampler_tid:
+                    scheduler_threads[tid] = thread
+
+    sampler = threading.Thread(target=sample_threads)
+    start_usage = resource.getrusage(resource.RUSAGE_SELF)
+    start = time.monotonic()
+    sampler.start()
+    tb.start()
+    tb.wait()
+    elapsed = time.monotonic() - start
+    done.set()
+    sampler.join()
+    end_usage = resource.getrusage(resource.RUSAGE_SELF)
+
+    thread_cpu = {}
+    for thread_name, cpu in scheduler_threads.values():
+        thread_cpu[thread_name] = round(thread_cpu.get(thread_name, 0) + cpu, 3)
+    cpu = (end_usage.ru_utime - start_usage.ru_utime) + (
+        end_usage.ru_stime - start_usage.ru_stime
+    )
+    return {
+        "nitems": nitems,
+        "elapsed_s": round(elapsed, 3),
+        "msps": round(nitems / elapsed / 1e6, 3),
+        # On Linux, `ru_maxrss` is in KiB.
+        "peak_rss_mib": round(end_usage.ru_maxrss / 1024, 1),
+        "cpu_s": round(cpu, 3),
+        "thread_cpu_s": thread_cpu,
+    }
+
+
+def measure(name, dir):
+    """Run a configuration in a new process, returning what it measured."""
+    config_dir = os.path.join(dir, name)
+    os.makedirs(config_dir)
+    try:
+        command = [sys.executable, os.path.abspath(__file__), "--child", name]
+        completed = subprocess.run(
+            command + ["--dir", config_dir],
+            stdout=subprocess.PIPE,
+            check=True,
+            text=True,
+        )
+    finally:
+        shutil.rmtree(config_dir, ignore_errors=True)
+    # The results are on the last line, after anything the flowgraph printed.
+    return json.loads(completed.stdout.strip().splitlines()[-1])
+
+
+def find_regressions(results, baseline, threshold):
+    """The configurations whose throughput has dropped by more than `threshold`."""
+    regressions = []
+    for name, result in results.items():
+        if name not in baseline:
+            continue
+        baseline_msps = baseline[name]["msps"]
+        if result["msps"] < baseline_msps * (1 - threshold):
+            regressions.append((name, result["msps"], baseline_msps))
+    return regressions
+
+
+def parse_args():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument(
+        "--configs",
+        nargs="+",
+        choices=sorted(CONFIGS),
+        default=list(CONFIGS),
+        help="The configurations to run (default: all of them)",
+    )
+    parser.add_argument(
+        "--dir",
+        default=None,
+        help="Where the flowgraphs write their files (default: a temporary directory)",
+    )
+    parser.add_argument(
+        "--results",
+        default="throughput_results.json",
+        help="Where to write the results, as JSON",
+    )
+    parser.add_argument(
+        "--baseline",
+        default=os.path.join(
+            os.path.dirname(os.path.abspath(__file__)), "throughput_baseline.json"
+        ),
+        help="The results to compare against",
+    )
+    parser.add_argument(
+        "--threshold",
+        type=float,
+        default=0.2,
+        help="The largest drop in throughput allowed, as a fraction of the baseline",
+    )
+    parser.add_argument(
+        "--update-baseline",
+        action="store_true",
+        help="Store the results as the new baseline, rather than comparing against it",
+    )
+    parser.add_argument("--child", help=argparse.SUPPRESS)
+    return parser.parse_args()
+
+
+def main():
+    args = parse_args()
+    if args.child:
+        print(json.dumps(run_config(args.child, args.dir)))
+        return 0
+
+    dir = args.dir or tempfile.mkdtemp(prefix="spectre-throughput-")
+    try:
+        results = {}
+        for name in args.configs:
+            results[name] = measure(name, dir)
+            result = results[name]
+            print(
+                f"{name:<28} {result['msps']:>10.3f} MSps "
+                f"{result['peak_rss_mib']:>8.1f} MiB RSS {result['cpu_s']:>8.3f} s CPU",
+                flush=True,
+            )
+    finally:
+        if args.dir is None:
+            shutil.rmtree(dir, ignore_errors=True)
+
+    report = {
+        "host": platform.node(),
+        "machine": platform.machine(),
+        "gnuradio": gr.version(),
+        "timestamp": time.strftime("%Y-%m-%dT%H:%M:%SZ", time.gmtime()),
+        "results": results,
+    }
+    with open(args.results, "w") as f:
+        json.dump(report, f, indent=2)
+
+    if args.update_baseline:
+        with open(args.baseline, "w") as f:
+            json.dump(report, f, indent=2)
+        print(f"Stored the results as the baseline in {args.baseline}")
+        return 0
+
+    if not os.path.exists(args.baseline):
+        print(
+            f"There's no baseline at {args.baseline}, so nothing was compared. Run with "
+            "--update-baseline to store these results as the baseline."
+        )
+        return 0
+
+    with open(args.baseline) as f:
+        baseline = json.load(f)["results"]
+    regressions = find_regressions(results, baseline, args.threshold)
+    for name, msps, baseline_msps in regressions:
+        print(
+            f"Regression: {name} ran at {msps:.3f} MSps, against "
+            f"{baseline_msps:.3f} MSps in the baseline (more than "
+            f"{args.threshold:.0%} slower)"
+        )
+    return 1 if regressions else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())